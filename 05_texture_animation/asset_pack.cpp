@@ -0,0 +1,92 @@
+#include "asset_pack.h"
+
+#include <cstring>
+#include <utility>
+
+#include "lz4.h"
+
+namespace ns {
+
+bool asset_pack::open(const std::string& path) {
+  mapped_file pack(path);
+  pack_header header;
+  if (pack.size() < sizeof(header)) return false;
+  std::memcpy(&header, pack.data(), sizeof(header));
+  if (std::memcmp(header.magic, pack_magic, sizeof(pack_magic)) != 0 ||
+      header.version != pack_version) {
+    return false;
+  }
+  const uint64_t index_size =
+      uint64_t(header.entry_count) * sizeof(pack_entry) + header.names_size;
+  if (index_size > pack.size() - sizeof(header)) return false;
+
+  // checked once here, so that load doesn't need to
+  const pack_entry* index =
+      reinterpret_cast<const pack_entry*>(pack.data() + sizeof(header));
+  for (uint32_t i = 0; i < header.entry_count; ++i) {
+    const pack_entry& entry = index[i];
+    if (uint64_t(entry.name_offset) + entry.name_size > header.names_size ||
+        entry.offset > pack.size() ||
+        entry.stored_size > pack.size() - entry.offset ||
+        (entry.compression == pack_stored &&
+         entry.stored_size != entry.size) ||
+        entry.compression > pack_lz4) {
+      return false;
+    }
+  }
+
+  file = std::move(pack);
+  entries = index;
+  entry_count = header.entry_count;
+  names = reinterpret_cast<const char*>(entries + entry_count);
+  return true;
+}
+
+const pack_entry* asset_pack::find(const std::string& name) const {
+  size_t first = 0, last = entry_count;
+  while (first < last) {
+    const size_t middle = first + (last - first) / 2;
+    const pack_entry& entry = entries[middle];
+    const int order =
+        name.compare(0, name.size(), names + entry.name_offset,
+                     entry.name_size);
+    if (order == 0) return &entry;
+    if (order < 0) {
+      last = middle;
+    } else {
+      first = middle + 1;
+    }
+  }
+  return nullptr;
+}
+
+bool asset_pack::load(const std::string& name, asset& out) const {
+  out = asset();
+  const pack_entry* entry = find(name);
+  if (entry == nullptr) {
+    out.file = mapped_file(name);
+    if (out.file.empty()) return false;
+    out.begin = out.file.data();
+    out.length = out.file.size();
+    out.time = out.file.mtime();
+    return true;
+  }
+
+  out.time = file.mtime();
+  out.length = static_cast<size_t>(entry->size);
+  const unsigned char* blob = file.data() + entry->offset;
+  if (entry->compression == pack_stored) {
+    out.begin = blob;
+    return true;
+  }
+  out.buffer.resize(out.length);
+  if (!lz4_decompress(blob, static_cast<size_t>(entry->stored_size),
+                      out.buffer.data(), out.length)) {
+    out = asset();
+    return false;
+  }
+  out.begin = out.buffer.data();
+  return true;
+}
+
+}  // namespace ns
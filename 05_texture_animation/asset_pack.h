@@ -0,0 +1,82 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "mapped_file.h"
+
+namespace ns {
+
+// The format of a pack, in little-endian byte order: a pack_header, the
+// pack_entry of every asset sorted by name, their names one after the other
+// and then the blobs of the assets, each at a multiple of pack_alignment.
+// A blob is the asset as it is, or LZ4 compressed when that saves enough.
+const char pack_magic[4] = {'W', 'G', 'P', 'K'};
+const uint32_t pack_version = 1;
+const size_t pack_alignment = 64;
+
+enum pack_compression : uint32_t { pack_stored = 0, pack_lz4 = 1 };
+
+struct pack_header {
+  char magic[4];
+  uint32_t version;
+  uint32_t entry_count;
+  uint32_t names_size;
+};
+
+struct pack_entry {
+  uint64_t offset;       // of the blob from the start of the pack
+  uint64_t size;         // of the asset
+  uint64_t stored_size;  // of the blob
+  uint32_t name_offset;  // from the start of the names
+  uint32_t name_size;
+  uint32_t compression;
+  uint32_t reserved;
+};
+
+// The bytes of an asset, wherever they are: in the mapped pack, decompressed
+// into a buffer of its own or in its own mapped file.
+class asset {
+ public:
+  bool empty() const { return begin == nullptr; }
+  const unsigned char* data() const { return begin; }
+  size_t size() const { return length; }
+  // of the file it is in, the pack or its own
+  int64_t mtime() const { return time; }
+
+ private:
+  friend class asset_pack;
+
+  const unsigned char* begin = nullptr;
+  size_t length = 0;
+  int64_t time = 0;
+  std::vector<unsigned char> buffer;
+  mapped_file file;
+};
+
+// The assets of a mapped pack file, looked up by name with a binary search
+// of its index. Stored assets are views into the pack, so loading them
+// reads nothing until their pages are touched. An asset that isn't in the
+// pack, or any when there is no pack, is the file of its name, mapped too.
+class asset_pack {
+ public:
+  // Maps the pack at path, false if it is missing or not a valid pack.
+  bool open(const std::string& path);
+
+  // Loads the asset called name, false if there is none or it is corrupt.
+  // It may be called from many threads at once.
+  bool load(const std::string& name, asset& out) const;
+
+  bool is_open() const { return !file.empty(); }
+
+ private:
+  const pack_entry* find(const std::string& name) const;
+
+  mapped_file file;
+  const pack_entry* entries = nullptr;
+  uint32_t entry_count = 0;
+  const char* names = nullptr;
+};
+
+}  // namespace ns
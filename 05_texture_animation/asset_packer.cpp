@@ -0,0 +1,139 @@
+// Packs asset files into one pack file for asset_pack, whose format is
+// described in asset_pack.h. Each file is named in the pack by the path it
+// is given as, the one the engine loads it by, so run it from the directory
+// the game runs in. Files that LZ4 makes at least an eighth smaller are
+// compressed, the others, such as PNG images, are stored as they are.
+//
+// usage: asset_packer [-s] pack_file file...
+//   -s  stores every file, compressing none
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "asset_pack.h"
+#include "lz4.h"
+
+namespace {
+
+struct packed_file {
+  std::string name;
+  size_t size = 0;
+  std::vector<unsigned char> blob;
+  ns::pack_compression compression = ns::pack_stored;
+};
+
+bool read_file(const std::string& path, std::vector<unsigned char>& content) {
+  std::ifstream ifs(path, std::ios_base::binary);
+  if (!ifs) return false;
+  ifs.seekg(0, std::ios_base::end);
+  const size_t size = ifs.tellg();
+  content.resize(size);
+  ifs.seekg(0, std::ios_base::beg);
+  ifs.read(reinterpret_cast<char*>(content.data()), size);
+  return static_cast<bool>(ifs);
+}
+
+size_t align(size_t offset) {
+  return (offset + ns::pack_alignment - 1) / ns::pack_alignment *
+         ns::pack_alignment;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int arg = 1;
+  bool compress = true;
+  if (arg < argc && std::strcmp(argv[arg], "-s") == 0) {
+    compress = false;
+    ++arg;
+  }
+  if (argc - arg < 2) {
+    std::cerr << "usage: asset_packer [-s] pack_file file..." << std::endl;
+    return 1;
+  }
+  const std::string pack_path = argv[arg++];
+
+  std::vector<packed_file> files;
+  for (; arg < argc; ++arg) {
+    packed_file file;
+    file.name = argv[arg];
+    if (!read_file(file.name, file.blob)) {
+      std::cerr << "error: can't read " << file.name << std::endl;
+      return 1;
+    }
+    file.size = file.blob.size();
+    if (compress && file.size != 0) {
+      std::vector<unsigned char> compressed(ns::lz4_compress_bound(file.size));
+      compressed.resize(ns::lz4_compress(file.blob.data(), file.size,
+                                         compressed.data()));
+      if (compressed.size() <= file.size - file.size / 8) {
+        file.blob.swap(compressed);
+        file.compression = ns::pack_lz4;
+      }
+    }
+    files.push_back(std::move(file));
+  }
+
+  // the index is searched by name
+  std::sort(files.begin(), files.end(),
+            [](const packed_file& a, const packed_file& b) {
+              return a.name < b.name;
+            });
+  for (size_t i = 1; i < files.size(); ++i) {
+    if (files[i].name == files[i - 1].name) {
+      std::cerr << "error: " << files[i].name << " is given twice"
+                << std::endl;
+      return 1;
+    }
+  }
+
+  ns::pack_header header;
+  std::memcpy(header.magic, ns::pack_magic, sizeof(ns::pack_magic));
+  header.version = ns::pack_version;
+  header.entry_count = static_cast<uint32_t>(files.size());
+  std::string names;
+  std::vector<ns::pack_entry> entries(files.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    entries[i].name_offset = static_cast<uint32_t>(names.size());
+    entries[i].name_size = static_cast<uint32_t>(files[i].name.size());
+    names += files[i].name;
+  }
+  header.names_size = static_cast<uint32_t>(names.size());
+  size_t offset = align(sizeof(header) + entries.size() * sizeof(entries[0]) +
+                        names.size());
+  for (size_t i = 0; i < files.size(); ++i) {
+    entries[i].offset = offset;
+    entries[i].size = files[i].size;
+    entries[i].stored_size = files[i].blob.size();
+    entries[i].compression = files[i].compression;
+    entries[i].reserved = 0;
+    offset = align(offset + files[i].blob.size());
+  }
+
+  std::ofstream ofs(pack_path, std::ios_base::binary);
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char*>(entries.data()),
+            entries.size() * sizeof(entries[0]));
+  ofs.write(names.data(), names.size());
+  const char padding[ns::pack_alignment] = {};
+  for (size_t i = 0; i < files.size(); ++i) {
+    ofs.write(padding, static_cast<std::streamsize>(
+                           entries[i].offset - uint64_t(ofs.tellp())));
+    ofs.write(reinterpret_cast<const char*>(files[i].blob.data()),
+              files[i].blob.size());
+    std::clog << files[i].name << ": " << files[i].size << " bytes, "
+              << (files[i].compression == ns::pack_lz4 ? "lz4 " : "stored ")
+              << files[i].blob.size() << std::endl;
+  }
+  if (!ofs) {
+    std::cerr << "error: can't write " << pack_path << std::endl;
+    return 1;
+  }
+  return 0;
+}
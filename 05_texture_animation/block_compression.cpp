@@ -0,0 +1,286 @@
+#include "block_compression.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <thread>
+
+namespace ns {
+
+size_t block_size(block_format format) {
+  return format == block_format::bc1 ? 8 : 16;
+}
+
+size_t compressed_size(size_t width, size_t height, block_format format) {
+  return (width + 3) / 4 * ((height + 3) / 4) * block_size(format);
+}
+
+block_format choose_block_format(const unsigned char* rgba, size_t pixels) {
+  for (size_t i = 0; i < pixels; ++i) {
+    if (rgba[i * 4 + 3] != 255) return block_format::bc3;
+  }
+  return block_format::bc1;
+}
+
+namespace {
+
+typedef unsigned char pixel_block[16][4];
+
+uint16_t pack565(const float color[3]) {
+  const float scale[3] = {31.f / 255, 63.f / 255, 31.f / 255};
+  int channel[3];
+  for (int c = 0; c < 3; ++c) {
+    channel[c] = static_cast<int>(
+        std::min(std::max(color[c], 0.f), 255.f) * scale[c] + .5f);
+  }
+  return static_cast<uint16_t>(channel[0] << 11 | channel[1] << 5 |
+                               channel[2]);
+}
+
+// as the GPU expands it, the top bits repeated in the low ones
+void unpack565(uint16_t color, int out[3]) {
+  const int r = color >> 11, g = (color >> 5) & 63, b = color & 31;
+  out[0] = r << 3 | r >> 2;
+  out[1] = g << 2 | g >> 4;
+  out[2] = b << 3 | b >> 2;
+}
+
+// The four colors of a block. With c0 <= c1 BC1 has three and black for
+// transparent pixels, which BC3 doesn't.
+void color_palette(uint16_t c0, uint16_t c1, bool bc1, int palette[4][3]) {
+  unpack565(c0, palette[0]);
+  unpack565(c1, palette[1]);
+  for (int c = 0; c < 3; ++c) {
+    if (c0 > c1 || !bc1) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    } else {
+      palette[2][c] = (palette[0][c] + palette[1][c]) / 2;
+      palette[3][c] = 0;
+    }
+  }
+}
+
+void alpha_palette(int a0, int a1, int palette[8]) {
+  palette[0] = a0;
+  palette[1] = a1;
+  if (a0 > a1) {
+    for (int k = 2; k < 8; ++k) {
+      palette[k] = ((8 - k) * a0 + (k - 1) * a1) / 7;
+    }
+  } else {
+    for (int k = 2; k < 6; ++k) {
+      palette[k] = ((6 - k) * a0 + (k - 1) * a1) / 5;
+    }
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+}
+
+void write16(unsigned char* out, uint16_t value) {
+  out[0] = static_cast<unsigned char>(value);
+  out[1] = static_cast<unsigned char>(value >> 8);
+}
+
+uint16_t read16(const unsigned char* in) {
+  return static_cast<uint16_t>(in[0] | in[1] << 8);
+}
+
+// The colors of a block in 8 bytes: the endpoints and 2-bit indices.
+void encode_colors(const pixel_block& block, unsigned char* out) {
+  float mean[3] = {0, 0, 0};
+  for (const unsigned char* pixel : block) {
+    for (int c = 0; c < 3; ++c) mean[c] += pixel[c] / 16.f;
+  }
+  float covariance[3][3] = {};
+  for (const unsigned char* pixel : block) {
+    const float d[3] = {pixel[0] - mean[0], pixel[1] - mean[1],
+                        pixel[2] - mean[2]};
+    for (int i = 0; i < 3; ++i) {
+      for (int j = 0; j < 3; ++j) covariance[i][j] += d[i] * d[j];
+    }
+  }
+  // The axis of the largest spread, by power iteration from the spread of
+  // the widest channel. It stays 0 for a block of one color.
+  int widest = 0;
+  for (int i = 1; i < 3; ++i) {
+    if (covariance[i][i] > covariance[widest][widest]) widest = i;
+  }
+  float axis[3] = {0, 0, 0};
+  float next[3] = {covariance[widest][0], covariance[widest][1],
+                   covariance[widest][2]};
+  for (int iteration = 0; iteration < 8; ++iteration) {
+    const float norm = std::sqrt(next[0] * next[0] + next[1] * next[1] +
+                                 next[2] * next[2]);
+    if (norm < 1e-6f) break;
+    for (int i = 0; i < 3; ++i) axis[i] = next[i] / norm;
+    for (int i = 0; i < 3; ++i) {
+      next[i] = covariance[i][0] * axis[0] + covariance[i][1] * axis[1] +
+                covariance[i][2] * axis[2];
+    }
+  }
+  float low = 0, high = 0;
+  for (const unsigned char* pixel : block) {
+    const float t = (pixel[0] - mean[0]) * axis[0] +
+                    (pixel[1] - mean[1]) * axis[1] +
+                    (pixel[2] - mean[2]) * axis[2];
+    low = std::min(low, t);
+    high = std::max(high, t);
+  }
+  float end0[3], end1[3];
+  for (int c = 0; c < 3; ++c) {
+    end0[c] = mean[c] + axis[c] * high;
+    end1[c] = mean[c] + axis[c] * low;
+  }
+  uint16_t c0 = pack565(end0), c1 = pack565(end1);
+  if (c0 < c1) std::swap(c0, c1);  // four colors
+  write16(out, c0);
+  write16(out + 2, c1);
+
+  uint32_t indices = 0;
+  if (c0 != c1) {
+    int palette[4][3];
+    color_palette(c0, c1, true, palette);
+    for (int i = 0; i < 16; ++i) {
+      int best = 0, best_distance = 1 << 30;
+      for (int k = 0; k < 4; ++k) {
+        int distance = 0;
+        for (int c = 0; c < 3; ++c) {
+          const int d = block[i][c] - palette[k][c];
+          distance += d * d;
+        }
+        if (distance < best_distance) {
+          best = k;
+          best_distance = distance;
+        }
+      }
+      indices |= static_cast<uint32_t>(best) << (2 * i);
+    }
+  }
+  for (int i = 0; i < 4; ++i) {
+    out[4 + i] = static_cast<unsigned char>(indices >> (8 * i));
+  }
+}
+
+// The alphas of a block in 8 bytes: the endpoints and 3-bit indices.
+void encode_alphas(const pixel_block& block, unsigned char* out) {
+  int a0 = 0, a1 = 255;
+  for (const unsigned char* pixel : block) {
+    a0 = std::max<int>(a0, pixel[3]);
+    a1 = std::min<int>(a1, pixel[3]);
+  }
+  out[0] = static_cast<unsigned char>(a0);
+  out[1] = static_cast<unsigned char>(a1);
+  uint64_t indices = 0;
+  if (a0 != a1) {
+    int palette[8];
+    alpha_palette(a0, a1, palette);
+    for (int i = 0; i < 16; ++i) {
+      int best = 0, best_distance = 256;
+      for (int k = 0; k < 8; ++k) {
+        const int distance = std::abs(block[i][3] - palette[k]);
+        if (distance < best_distance) {
+          best = k;
+          best_distance = distance;
+        }
+      }
+      indices |= static_cast<uint64_t>(best) << (3 * i);
+    }
+  }
+  for (int i = 0; i < 6; ++i) {
+    out[2 + i] = static_cast<unsigned char>(indices >> (8 * i));
+  }
+}
+
+void compress_rows(const unsigned char* rgba, size_t width, size_t height,
+                   block_format format, unsigned char* out, size_t begin,
+                   size_t end) {
+  const size_t blocks_across = (width + 3) / 4;
+  const size_t size = block_size(format);
+  for (size_t by = begin; by < end; ++by) {
+    for (size_t bx = 0; bx < blocks_across; ++bx) {
+      pixel_block block;
+      for (size_t y = 0; y < 4; ++y) {
+        const size_t sy = std::min(by * 4 + y, height - 1);
+        for (size_t x = 0; x < 4; ++x) {
+          const size_t sx = std::min(bx * 4 + x, width - 1);
+          std::memcpy(block[y * 4 + x], rgba + (sy * width + sx) * 4, 4);
+        }
+      }
+      unsigned char* block_out = out + (by * blocks_across + bx) * size;
+      if (format == block_format::bc3) {
+        encode_alphas(block, block_out);
+        block_out += 8;
+      }
+      encode_colors(block, block_out);
+    }
+  }
+}
+
+}  // namespace
+
+std::vector<unsigned char> compress_blocks(const unsigned char* rgba,
+                                           size_t width, size_t height,
+                                           block_format format,
+                                           unsigned threads) {
+  std::vector<unsigned char> blocks(compressed_size(width, height, format));
+  const size_t rows = (height + 3) / 4;
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  const size_t shares = std::min<size_t>(threads, rows);
+  std::vector<std::thread> workers;
+  for (size_t share = 1; share < shares; ++share) {
+    workers.emplace_back(compress_rows, rgba, width, height, format,
+                         blocks.data(), rows * share / shares,
+                         rows * (share + 1) / shares);
+  }
+  compress_rows(rgba, width, height, format, blocks.data(), 0,
+                rows / std::max<size_t>(1, shares));
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  return blocks;
+}
+
+void decompress_blocks(const unsigned char* blocks, size_t width,
+                       size_t height, block_format format,
+                       unsigned char* rgba) {
+  const size_t blocks_across = (width + 3) / 4;
+  const size_t size = block_size(format);
+  for (size_t by = 0; by < (height + 3) / 4; ++by) {
+    for (size_t bx = 0; bx < blocks_across; ++bx) {
+      const unsigned char* block = blocks + (by * blocks_across + bx) * size;
+      int alphas[8] = {255, 255, 255, 255, 255, 255, 255, 255};
+      uint64_t alpha_indices = 0;
+      if (format == block_format::bc3) {
+        alpha_palette(block[0], block[1], alphas);
+        for (int i = 0; i < 6; ++i) {
+          alpha_indices |= static_cast<uint64_t>(block[2 + i]) << (8 * i);
+        }
+        block += 8;
+      }
+      const uint16_t c0 = read16(block), c1 = read16(block + 2);
+      int colors[4][3];
+      color_palette(c0, c1, format == block_format::bc1, colors);
+      const uint32_t indices = block[4] | block[5] << 8 | block[6] << 16 |
+                               static_cast<uint32_t>(block[7]) << 24;
+      for (size_t i = 0; i < 16; ++i) {
+        const size_t x = bx * 4 + i % 4, y = by * 4 + i / 4;
+        if (x >= width || y >= height) continue;
+        unsigned char* pixel = rgba + (y * width + x) * 4;
+        const unsigned index = (indices >> (2 * i)) & 3;
+        for (int c = 0; c < 3; ++c) {
+          pixel[c] = static_cast<unsigned char>(colors[index][c]);
+        }
+        int alpha = alphas[(alpha_indices >> (3 * i)) & 7];
+        if (format == block_format::bc1 && c0 <= c1 && index == 3) {
+          alpha = 0;  // the black of three colors is transparent
+        }
+        pixel[3] = static_cast<unsigned char>(alpha);
+      }
+    }
+  }
+}
+
+}  // namespace ns
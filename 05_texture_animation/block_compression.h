@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace ns {
+
+// The S3TC block formats, BC1 and BC3 in Direct3D terms. Both store each
+// block of 4x4 pixels on their own, BC1 opaque in 8 bytes, an eighth of
+// RGBA8, and BC3 with alpha in 16 bytes, a quarter of it.
+enum class block_format { bc1, bc3 };
+
+// Their internal formats in GL, from EXT_texture_compression_s3tc.
+const uint32_t gl_compressed_rgb_s3tc_dxt1 = 0x83F0;
+const uint32_t gl_compressed_rgba_s3tc_dxt5 = 0x83F3;
+
+size_t block_size(block_format format);
+
+// The size of an image of width x height pixels in this format, whose
+// blocks at the right and bottom edges may stick out of it.
+size_t compressed_size(size_t width, size_t height, block_format format);
+
+// BC3 for an RGBA8 image with any pixel that isn't opaque, BC1 otherwise.
+block_format choose_block_format(const unsigned char* rgba, size_t pixels);
+
+// Compresses an RGBA8 image whose rows follow each other without padding.
+// The endpoints of each block are the ends of its colors along the axis
+// they spread most on. Pixels outside the image repeat the ones at its
+// edges. The rows of blocks are shared by threads, 0 for one per core.
+std::vector<unsigned char> compress_blocks(const unsigned char* rgba,
+                                           size_t width, size_t height,
+                                           block_format format,
+                                           unsigned threads = 0);
+
+// Decompresses an image into RGBA8, for GL without the extension.
+void decompress_blocks(const unsigned char* blocks, size_t width,
+                       size_t height, block_format format,
+                       unsigned char* rgba);
+
+}  // namespace ns
@@ -2,14 +2,30 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
 #include <exception>
+#include <fstream>
+#include <functional>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
+#include <thread>
 #include <vector>
 
+#include "asset_pack.h"
+#include "block_compression.h"
+#include "ktx.h"
+#include "mipmap.h"
 #include "picopng.cpp"
+#include "texture_cache.h"
 
 #define GLEW_STATIC
 #include <GL/glew.h>
@@ -21,34 +37,120 @@
 //#include <SDL2/SDL_opengles2.h>
 //#endif
 
-#define ENGINE_GL_CHECK()                                             \
-                                                                      \
-  {                                                                   \
-    const int err = glGetError();                                     \
-    if (err != GL_NO_ERROR) {                                         \
-      switch (err) {                                                  \
-        case GL_INVALID_ENUM:                                         \
-          std::cerr << GL_INVALID_ENUM << std::endl;                  \
-          break;                                                      \
-        case GL_INVALID_VALUE:                                        \
-          std::cerr << GL_INVALID_VALUE << std::endl;                 \
-          break;                                                      \
-        case GL_INVALID_OPERATION:                                    \
-          std::cerr << GL_INVALID_OPERATION << std::endl;             \
-          break;                                                      \
-        case GL_INVALID_FRAMEBUFFER_OPERATION:                        \
-          std::cerr << GL_INVALID_FRAMEBUFFER_OPERATION << std::endl; \
-          break;                                                      \
-        case GL_OUT_OF_MEMORY:                                        \
-          std::cerr << GL_OUT_OF_MEMORY << std::endl;                 \
-          break;                                                      \
-      }                                                               \
-      assert(false);                                                  \
-    }                                                                 \
-  }
+// How much GL errors are checked for: 0 not at all, 1 once a frame, 2 after
+// every call. The runtime level, from the ENGINE_GL_CHECK environment
+// variable, can only lower it. With 1 or more GL reports errors through
+// KHR_debug as well, asynchronously, with the last call site checked.
+#ifndef ENGINE_GL_CHECK_LEVEL
+#ifdef NDEBUG
+#define ENGINE_GL_CHECK_LEVEL 0
+#else
+#define ENGINE_GL_CHECK_LEVEL 2
+#endif
+#endif
+
+#define ENGINE_GL_STRING(x) #x
+#define ENGINE_GL_SITE(line) __FILE__ ":" ENGINE_GL_STRING(line)
+
+#if ENGINE_GL_CHECK_LEVEL >= 2
+#define ENGINE_GL_CHECK()                                              \
+  do {                                                                 \
+    gl_call_site.store(ENGINE_GL_SITE(__LINE__),                       \
+                       std::memory_order_relaxed);                     \
+    if (gl_check_level == gl_check::call) {                            \
+      check_gl_error(ENGINE_GL_SITE(__LINE__));                        \
+    }                                                                  \
+  } while (false)
+#elif ENGINE_GL_CHECK_LEVEL == 1
+#define ENGINE_GL_CHECK()                                              \
+  do {                                                                 \
+    gl_call_site.store(ENGINE_GL_SITE(__LINE__),                       \
+                       std::memory_order_relaxed);                     \
+  } while (false)
+#else
+#define ENGINE_GL_CHECK() \
+  do {                    \
+  } while (false)
+#endif
 
 namespace ns {
 
+enum class gl_check { off, frame, call };
+
+static gl_check gl_check_level = static_cast<gl_check>(ENGINE_GL_CHECK_LEVEL);
+// the last checked GL call, for the messages of KHR_debug
+static std::atomic<const char*> gl_call_site(nullptr);
+
+static const char* gl_error_name(GLenum error) {
+  switch (error) {
+    case GL_INVALID_ENUM:
+      return "GL_INVALID_ENUM";
+    case GL_INVALID_VALUE:
+      return "GL_INVALID_VALUE";
+    case GL_INVALID_OPERATION:
+      return "GL_INVALID_OPERATION";
+    case GL_INVALID_FRAMEBUFFER_OPERATION:
+      return "GL_INVALID_FRAMEBUFFER_OPERATION";
+    case GL_OUT_OF_MEMORY:
+      return "GL_OUT_OF_MEMORY";
+    default:
+      return "GL error";
+  }
+}
+
+// Waits for GL to be done with the calls before, which is what makes
+// checking after every call slow.
+static void check_gl_error(const char* site) {
+  const GLenum error = glGetError();
+  if (error != GL_NO_ERROR) {
+    std::cerr << "error: " << gl_error_name(error) << " at " << site
+              << std::endl;
+    assert(false);
+  }
+}
+
+// The level from the environment, no higher than the one compiled in.
+static gl_check read_gl_check_level() {
+  const gl_check compiled = static_cast<gl_check>(ENGINE_GL_CHECK_LEVEL);
+  const char* level = std::getenv("ENGINE_GL_CHECK");
+  if (level == nullptr) return compiled;
+  const std::string name(level);
+  const gl_check wanted = name == "off"     ? gl_check::off
+                          : name == "frame" ? gl_check::frame
+                                            : gl_check::call;
+  return std::min(wanted, compiled);
+}
+
+// Called by the driver, maybe later than the call that caused the message
+// and on a thread of its own, so the call site is only the last one checked.
+static void GLAPIENTRY on_gl_message(GLenum /*source*/, GLenum type,
+                                     GLuint id, GLenum severity,
+                                     GLsizei /*length*/,
+                                     const GLchar* message,
+                                     const void* /*user*/) {
+  if (severity == GL_DEBUG_SEVERITY_NOTIFICATION) return;
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  const char* site = gl_call_site.load(std::memory_order_relaxed);
+  std::cerr << (type == GL_DEBUG_TYPE_ERROR ? "error: gl " : "gl: ") << id
+            << ' ' << message << " after " << (site ? site : "init")
+            << std::endl;
+}
+
+// KHR_debug, or ARB_debug_output which it grew out of, in a debug context.
+// GL_DEBUG_OUTPUT_SYNCHRONOUS is left off so the driver doesn't stall.
+static void enable_gl_messages() {
+  if (GLEW_KHR_debug) {
+    glEnable(GL_DEBUG_OUTPUT);
+    glDebugMessageCallback(on_gl_message, nullptr);
+  } else if (GLEW_ARB_debug_output) {
+    glDebugMessageCallbackARB(on_gl_message, nullptr);
+  } else {
+    return;
+  }
+  std::clog << "gl: debug messages on" << std::endl;
+}
+
 static const int WINDOW_WIDTH = 640;
 static const int WINDOW_HEIGHT = 480;
 const char* WINDOW_TITLE = "Title";
@@ -187,9 +289,663 @@ bool check_GL_version(void) {
   return true;
 }
 
+// How the pixels of a decoder format are stored in a texture and passed to
+// GL. The greyscale formats use the luminance formats of the compatibility
+// profile, which the #version 120 shaders sample as grey without a swizzle.
+struct texture_format {
+  GLenum internal_format;  // sized, for glTexStorage2D
+  GLenum format;
+  GLenum type;
+};
+
+static texture_format gl_format(picopng::Format format) {
+  switch (format) {
+    case picopng::FORMAT_RGB565:
+      return {GL_RGB5, GL_RGB, GL_UNSIGNED_SHORT_5_6_5};
+    case picopng::FORMAT_RGBA4444:
+      return {GL_RGBA4, GL_RGBA, GL_UNSIGNED_SHORT_4_4_4_4};
+    case picopng::FORMAT_RG8:
+      return {GL_LUMINANCE8_ALPHA8, GL_LUMINANCE_ALPHA, GL_UNSIGNED_BYTE};
+    case picopng::FORMAT_R8:
+      return {GL_LUMINANCE8, GL_LUMINANCE, GL_UNSIGNED_BYTE};
+    case picopng::FORMAT_RGBA8:
+      break;
+  }
+  return {GL_RGBA8, GL_RGBA, GL_UNSIGNED_BYTE};
+}
+
+// The base format is what glTexImage2D takes where there is no
+// ARB_texture_storage, with no pixels to read in it.
+static texture_format compressed_format(const ktx_texture& ktx) {
+  return {ktx.gl_internal_format, ktx.gl_base_internal_format,
+          GL_UNSIGNED_BYTE};
+}
+
+// The smallest texture format for a PNG of this color type: greyscale takes
+// a quarter of RGBA, greyscale with alpha and opaque color half of it.
+// Palette images may have alpha per entry and stay RGBA. Only the rare color
+// key of a tRNS chunk is lost, in the formats without alpha.
+static picopng::Format choose_format(unsigned long color_type) {
+  switch (color_type) {
+    case 0:
+      return picopng::FORMAT_R8;
+    case 2:
+      return picopng::FORMAT_RGB565;
+    case 4:
+      return picopng::FORMAT_RG8;
+  }
+  return picopng::FORMAT_RGBA8;
+}
+
+static pixel_format mip_format(picopng::Format format) {
+  switch (format) {
+    case picopng::FORMAT_RGB565:
+      return pixel_format::rgb565;
+    case picopng::FORMAT_RGBA4444:
+      return pixel_format::rgba4444;
+    case picopng::FORMAT_RG8:
+      return pixel_format::rg8;
+    case picopng::FORMAT_R8:
+      return pixel_format::r8;
+    case picopng::FORMAT_RGBA8:
+      break;
+  }
+  return pixel_format::rgba8;
+}
+
+// Textures have premultiplied alpha, which filters without dark fringes and
+// blends with GL_ONE, and their rows bottom up as GL expects them. Both are
+// done by the decoder as it writes each row.
+template <class Decoder>
+static void set_texture_options(Decoder& decoder) {
+  decoder.setPremultiply(true);
+  decoder.setFlip(true);
+}
+
+// Allocates the storage of the texture bound to GL_TEXTURE_2D and of its
+// first levels mipmap levels, to be filled in with glTexSubImage2D. It is
+// immutable where the driver has ARB_texture_storage.
+static void reserve_texture(GLsizei width, GLsizei height,
+                            const texture_format& format, GLsizei levels = 1) {
+  if (GLEW_ARB_texture_storage) {
+    glTexStorage2D(GL_TEXTURE_2D, levels, format.internal_format, width,
+                   height);
+  } else {
+    for (GLsizei level = 0; level < levels; ++level) {
+      glTexImage2D(GL_TEXTURE_2D, level, format.internal_format,
+                   std::max(1, width >> level), std::max(1, height >> level),
+                   0, format.format, format.type, nullptr);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+  }
+  ENGINE_GL_CHECK();
+}
+
+// Uploads every level of a mip chain, built or from the cache, into the
+// texture bound to GL_TEXTURE_2D, reserved with as many levels, and samples
+// them trilinearly when it is drawn smaller than it is. A minified texture
+// then reads a level about its own size on the screen, which keeps its
+// texels in the texture cache and doesn't alias.
+template <class Chain>
+static void upload_mip_chain(const Chain& chain,
+                             const texture_format& format) {
+  for (size_t i = 0; i < chain.levels.size(); ++i) {
+    const mip_chain::level& level = chain.levels[i];
+    glTexSubImage2D(GL_TEXTURE_2D, static_cast<GLint>(i), 0, 0,
+                    static_cast<GLsizei>(level.width),
+                    static_cast<GLsizei>(level.height), format.format,
+                    format.type, chain.data(i));
+    ENGINE_GL_CHECK();
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  ENGINE_GL_CHECK();
+}
+
+// A mip chain in a pixel buffer of map_pixel_buffer, for upload_mip_chain
+// with the buffer bound to GL_PIXEL_UNPACK_BUFFER, where the data of a level
+// is its offset into the buffer.
+struct buffered_chain {
+  std::vector<mip_chain::level> levels;
+
+  const GLvoid* data(size_t i) const {
+    return reinterpret_cast<const GLvoid*>(levels[i].offset);
+  }
+};
+
+// Makes a pixel buffer of size bytes and maps it, for a worker to write a
+// chain straight into the memory GL uploads it from, without a copy in
+// client memory. nullptr and no buffer if it can't be mapped.
+static unsigned char* map_pixel_buffer(size_t size, GLuint& buffer) {
+  glGenBuffers(1, &buffer);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+  void* pixels = glMapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  ENGINE_GL_CHECK();
+  if (pixels == nullptr) {
+    glDeleteBuffers(1, &buffer);
+    buffer = 0;
+  }
+  return static_cast<unsigned char*>(pixels);
+}
+
+// Unmaps a buffer of map_pixel_buffer, false if its pixels were lost while
+// it was mapped, as they can be when the screen mode changes.
+static bool unmap_pixel_buffer(GLuint buffer) {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+  const bool kept = glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_TRUE;
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  ENGINE_GL_CHECK();
+  return kept;
+}
+
+// Uploads the chain in an unmapped buffer of map_pixel_buffer into the
+// texture bound to GL_TEXTURE_2D, reserved with as many levels, and deletes
+// the buffer.
+static void upload_pixel_buffer(GLuint buffer, const buffered_chain& chain,
+                                const texture_format& format) {
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, buffer);
+  ENGINE_GL_CHECK();
+  upload_mip_chain(chain, format);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  glDeleteBuffers(1, &buffer);
+  ENGINE_GL_CHECK();
+}
+
+// The block format of a KTX texture, false for one the engine doesn't know
+// or whose levels aren't the sizes they should be.
+static bool check_ktx(const ktx_texture& ktx, block_format& format) {
+  if (ktx.gl_internal_format == gl_compressed_rgb_s3tc_dxt1) {
+    format = block_format::bc1;
+  } else if (ktx.gl_internal_format == gl_compressed_rgba_s3tc_dxt5) {
+    format = block_format::bc3;
+  } else {
+    return false;
+  }
+  if (ktx.levels.size() > mip_level_count(ktx.width, ktx.height)) return false;
+  for (size_t i = 0; i < ktx.levels.size(); ++i) {
+    if (ktx.levels[i].size != compressed_size(std::max(1u, ktx.width >> i),
+                                              std::max(1u, ktx.height >> i),
+                                              format)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// The levels of a block-compressed texture as they are, into the texture
+// bound to GL_TEXTURE_2D, reserved in its format with as many levels.
+static void upload_compressed(const ktx_texture& ktx) {
+  for (size_t i = 0; i < ktx.levels.size(); ++i) {
+    glCompressedTexSubImage2D(
+        GL_TEXTURE_2D, static_cast<GLint>(i), 0, 0,
+        std::max(1, static_cast<GLsizei>(ktx.width) >> i),
+        std::max(1, static_cast<GLsizei>(ktx.height) >> i),
+        ktx.gl_internal_format, static_cast<GLsizei>(ktx.levels[i].size),
+        ktx.levels[i].data);
+    ENGINE_GL_CHECK();
+  }
+  glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+                  GL_LINEAR_MIPMAP_LINEAR);
+  ENGINE_GL_CHECK();
+}
+
+// The levels of a block-compressed texture in RGBA8, for GL without S3TC.
+static void decompress_levels(const ktx_texture& ktx, block_format format,
+                              mip_chain& chain) {
+  chain.format = pixel_format::rgba8;
+  chain.levels = mip_levels(ktx.width, ktx.height, chain.format);
+  chain.levels.resize(ktx.levels.size());
+  const mip_chain::level& last = chain.levels.back();
+  chain.pixels.resize(last.offset + last.width * last.height * 4);
+  for (size_t i = 0; i < ktx.levels.size(); ++i) {
+    const mip_chain::level& level = chain.levels[i];
+    decompress_blocks(ktx.levels[i].data, level.width, level.height, format,
+                      chain.pixels.data() + level.offset);
+  }
+}
+
+// name.ktx for name.png, which ktx_encoder makes from it.
+static std::string ktx_name(const std::string& name) {
+  return name.substr(0, name.rfind('.')) + ".ktx";
+}
+
+// Writes a mapped PNG file to a decoder a piece at a time, so that its pages
+// are read as the decoder gets to them.
+static int stream_png(picopng::StreamDecoder& decoder, const asset& file) {
+  const size_t piece = 64 * 1024;
+  int error = 0;
+  for (size_t pos = 0; error == 0 && pos < file.size(); pos += piece) {
+    error = decoder.write(file.data() + pos,
+                          std::min(piece, file.size() - pos));
+  }
+  return error != 0 ? error : decoder.finish();
+}
+
+// Decodes a PNG that isn't interlaced a piece of the file at a time and
+// builds its mip chain from the rows as they come out, verified, so that a
+// corrupt file is an error and not a texture. Each finished row of each
+// level goes to sink, and besides them only a few rows and the 32 KiB
+// window of the decoder are in memory.
+static int stream_mip_chain(const asset& file, const picopng::Header& header,
+                            picopng::Format format,
+                            mip_row_builder::row_sink sink) {
+  mip_row_builder builder(header.width, header.height, mip_format(format),
+                          std::move(sink));
+  picopng::StreamDecoder decoder(
+      [](void* user, const unsigned char* row, unsigned long y) {
+        static_cast<mip_row_builder*>(user)->add_row(y, row);
+      },
+      &builder);
+  decoder.setFormat(format);
+  decoder.setVerify(true);
+  set_texture_options(decoder);
+  return stream_png(decoder, file);
+}
+
+// A vertex as the shader takes it, from a vertex buffer.
+struct mesh_vertex {
+  Vertex position;
+  Vertex texture;
+};
+
+// Points the attributes of the shader at the vertices in the buffer bound
+// to GL_ARRAY_BUFFER. A vertex array object keeps them.
+static void enable_vertex_layout() {
+  glVertexAttribPointer(
+      0, 2, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+      reinterpret_cast<const GLvoid*>(offsetof(mesh_vertex, position)));
+  ENGINE_GL_CHECK();
+  glEnableVertexAttribArray(0);
+  ENGINE_GL_CHECK();
+  glVertexAttribPointer(
+      1, 2, GL_FLOAT, GL_FALSE, sizeof(mesh_vertex),
+      reinterpret_cast<const GLvoid*>(offsetof(mesh_vertex, texture)));
+  ENGINE_GL_CHECK();
+  glEnableVertexAttribArray(1);
+  ENGINE_GL_CHECK();
+}
+
+static void disable_vertex_layout() {
+  glDisableVertexAttribArray(0);
+  glDisableVertexAttribArray(1);
+  ENGINE_GL_CHECK();
+}
+
+// A vertex as the layered program takes it. The background and the clouds
+// share their texture coordinates.
+struct layer_vertex {
+  Vertex position;
+  Vertex back;  // and up
+  Vertex model;
+};
+
+// The same as enable_vertex_layout, for layer_vertex.
+static void enable_layer_layout() {
+  const size_t offsets[3] = {offsetof(layer_vertex, position),
+                             offsetof(layer_vertex, back),
+                             offsetof(layer_vertex, model)};
+  for (GLuint i = 0; i < 3; ++i) {
+    glVertexAttribPointer(i, 2, GL_FLOAT, GL_FALSE, sizeof(layer_vertex),
+                          reinterpret_cast<const GLvoid*>(offsets[i]));
+    ENGINE_GL_CHECK();
+    glEnableVertexAttribArray(i);
+    ENGINE_GL_CHECK();
+  }
+}
+
+static void disable_layer_layout() {
+  for (GLuint i = 0; i < 3; ++i) {
+    glDisableVertexAttribArray(i);
+  }
+  ENGINE_GL_CHECK();
+}
+
+// What a frame cost, in draw calls and the bytes of vertices sent to GL.
+struct frame_stats {
+  size_t draw_calls = 0;
+  size_t triangles = 0;
+  size_t vertex_bytes = 0;
+};
+
+// Replaces the vertices in a streaming buffer, which is orphaned first so
+// that the driver doesn't wait for the GPU to be done with the old ones. It
+// grows to the most vertices of a frame and stays bound.
+static void upload_vertices(GLuint vbo, size_t& capacity, const void* data,
+                            size_t size) {
+  glBindBuffer(GL_ARRAY_BUFFER, vbo);
+  ENGINE_GL_CHECK();
+  if (size > capacity) {
+    capacity = std::max(size, 2 * capacity);
+  }
+  glBufferData(GL_ARRAY_BUFFER, capacity, nullptr, GL_STREAM_DRAW);
+  ENGINE_GL_CHECK();
+  glBufferSubData(GL_ARRAY_BUFFER, 0, size, data);
+  ENGINE_GL_CHECK();
+}
+
+// The triangles of a frame, kept in client memory as they are rendered and
+// drawn together at its end. They are uploaded into one vertex buffer, which
+// is orphaned every frame so that the driver doesn't wait for the GPU to be
+// done with the last one, and drawn with one call for each run of triangles
+// of the same texture. Runs aren't merged across others, the triangles are
+// drawn in the order they were rendered, which blending depends on.
+struct triangle_batch {
+  struct run {
+    GLuint texture;
+    GLint first;  // vertex
+    GLsizei count;
+  };
+
+  void create() {
+    glGenBuffers(1, &vbo);
+    ENGINE_GL_CHECK();
+  }
+
+  void destroy() {
+    glDeleteBuffers(1, &vbo);
+    ENGINE_GL_CHECK();
+    vbo = 0;
+  }
+
+  void add(const Vertex* positions, const Vertex* texture_coords,
+           GLuint texture) {
+    if (runs.empty() || runs.back().texture != texture) {
+      runs.push_back({texture, static_cast<GLint>(vertices.size()), 0});
+    }
+    for (int i = 0; i < 3; ++i) {
+      vertices.push_back({positions[i], texture_coords[i]});
+    }
+    runs.back().count += 3;
+  }
+
+  // Draws the triangles added since the last time and starts over.
+  void draw(frame_stats& stats) {
+    if (vertices.empty()) return;
+    const size_t size = vertices.size() * sizeof(mesh_vertex);
+    upload_vertices(vbo, capacity, vertices.data(), size);
+    enable_vertex_layout();
+
+    for (const run& r : runs) {
+      glBindTexture(GL_TEXTURE_2D, r.texture);
+      ENGINE_GL_CHECK();
+      glDrawArrays(GL_TRIANGLES, r.first, r.count);
+      ENGINE_GL_CHECK();
+    }
+
+    disable_vertex_layout();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    ENGINE_GL_CHECK();
+    stats.draw_calls += runs.size();
+    stats.triangles += vertices.size() / 3;
+    stats.vertex_bytes += size;
+    vertices.clear();
+    runs.clear();
+  }
+
+  GLuint vbo = 0;
+  size_t capacity = 0;  // of vbo, in bytes
+  std::vector<mesh_vertex> vertices;
+  std::vector<run> runs;
+};
+
+// Triangles with the three layers of a Triangle_2, drawn by the layered
+// program with one call. The textures of the layers are always the same,
+// on texture units 0 to 2.
+struct layer_batch {
+  void create() {
+    glGenBuffers(1, &vbo);
+    ENGINE_GL_CHECK();
+  }
+
+  void destroy() {
+    glDeleteBuffers(1, &vbo);
+    ENGINE_GL_CHECK();
+    vbo = 0;
+  }
+
+  void add(const Vertex* positions, const Vertex* back, const Vertex* model) {
+    for (int i = 0; i < 3; ++i) {
+      vertices.push_back({positions[i], back[i], model[i]});
+    }
+  }
+
+  // with the layered program in use
+  void draw(frame_stats& stats) {
+    if (vertices.empty()) return;
+    const size_t size = vertices.size() * sizeof(layer_vertex);
+    upload_vertices(vbo, capacity, vertices.data(), size);
+    enable_layer_layout();
+    glDrawArrays(GL_TRIANGLES, 0, static_cast<GLsizei>(vertices.size()));
+    ENGINE_GL_CHECK();
+    disable_layer_layout();
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    ENGINE_GL_CHECK();
+    ++stats.draw_calls;
+    stats.triangles += vertices.size() / 3;
+    stats.vertex_bytes += size;
+    vertices.clear();
+  }
+
+  GLuint vbo = 0;
+  size_t capacity = 0;  // of vbo, in bytes
+  std::vector<layer_vertex> vertices;
+};
+
+// Triangles uploaded once into a vertex buffer of their own, which GL keeps
+// for as long as the engine runs. Their vertex array object, where there is
+// ARB_vertex_array_object, binds the buffer and the attributes with one call.
+struct static_mesh {
+  GLuint vbo = 0;
+  GLuint vao = 0;
+  GLsizei vertex_count = 0;
+  bool layered = false;  // of layer_vertex, for the layered program
+};
+
+// The uniforms of a program that place a mesh, with the values they have.
+struct transform_uniforms {
+  void locate(GLuint program) {
+    offset = glGetUniformLocation(program, "u_offset");
+    uv_offset = glGetUniformLocation(program, "u_uv_offset");
+    uv_scale = glGetUniformLocation(program, "u_uv_scale");
+    ENGINE_GL_CHECK();
+    glUniform2f(uv_scale, 1.f, 1.f);  // the others are 0
+    ENGINE_GL_CHECK();
+  }
+
+  // Sets only the uniforms that change, so that a mesh drawn with the same
+  // transform as the one before costs no update. The program is in use.
+  void set(const Mesh_transform& next) {
+    set_uniform(offset, value.offset, next.offset);
+    set_uniform(uv_offset, value.uv_offset, next.uv_offset);
+    set_uniform(uv_scale, value.uv_scale, next.uv_scale);
+  }
+
+  static void set_uniform(GLint location, Vertex& value, const Vertex& next) {
+    if (value.x == next.x && value.y == next.y) return;
+    value = next;
+    glUniform2f(location, next.x, next.y);
+    ENGINE_GL_CHECK();
+  }
+
+  GLint offset = -1;
+  GLint uv_offset = -1;
+  GLint uv_scale = -1;
+  Mesh_transform value;
+};
+
+// The calls of a frame that draw, recorded by the game thread for the
+// render thread as an operation followed by its arguments, packed as they
+// are in memory. Vertices are written as their two floats.
+struct command_list {
+  enum class op : uint32_t {
+    triangle,
+    layers,
+    mesh,
+    create_mesh,
+    layered_mesh,
+    create_layered_mesh
+  };
+
+  template <class T>
+  void write(const T& value) {
+    const unsigned char* begin = reinterpret_cast<const unsigned char*>(&value);
+    bytes.insert(bytes.end(), begin, begin + sizeof(T));
+  }
+
+  void write(const Vertex* vertices, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      write(vertices[i].x);
+      write(vertices[i].y);
+    }
+  }
+
+  void write_transform(const Mesh_transform& transform) {
+    write(&transform.offset, 1);
+    write(&transform.uv_offset, 1);
+    write(&transform.uv_scale, 1);
+  }
+
+  template <class T>
+  T read(size_t& pos) const {
+    T value;
+    std::memcpy(&value, bytes.data() + pos, sizeof(T));
+    pos += sizeof(T);
+    return value;
+  }
+
+  void read(size_t& pos, Vertex* vertices, size_t count) const {
+    for (size_t i = 0; i < count; ++i) {
+      vertices[i].x = read<float>(pos);
+      vertices[i].y = read<float>(pos);
+    }
+  }
+
+  Mesh_transform read_transform(size_t& pos) const {
+    Mesh_transform transform;
+    read(pos, &transform.offset, 1);
+    read(pos, &transform.uv_offset, 1);
+    read(pos, &transform.uv_scale, 1);
+    return transform;
+  }
+
+  std::vector<unsigned char> bytes;
+};
+
+// Where the frames are drawn: by the thread that renders them, the game
+// thread, or a render thread of its own. With one the game either waits for
+// each frame to be drawn or goes on with the next, a frame behind the screen
+// but with the simulation and GL on two cores.
+enum class render_mode { direct, threaded, pipelined };
+
+// The mode from the ENGINE_RENDER_THREAD environment variable: off, on, or
+// latency for the pipelined one.
+static render_mode read_render_mode() {
+  const char* mode = std::getenv("ENGINE_RENDER_THREAD");
+  const std::string name(mode ? mode : "off");
+  return name == "on"        ? render_mode::threaded
+         : name == "latency" ? render_mode::pipelined
+                             : render_mode::direct;
+}
+
+static GLuint compile_shader(GLenum type, const GLchar* source) {
+  GLuint shader = glCreateShader(type);
+  ENGINE_GL_CHECK();
+  glShaderSource(shader, 1, &source, NULL);
+  ENGINE_GL_CHECK();
+  glCompileShader(shader);
+  ENGINE_GL_CHECK();
+
+  GLint compile_success;
+  glGetShaderiv(shader, GL_COMPILE_STATUS, &compile_success);
+  if (!compile_success) {
+    GLint log_len;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &log_len);
+    std::vector<GLchar> log(log_len);
+    glGetShaderInfoLog(shader, log_len, NULL, log.data());
+    glDeleteShader(shader);
+    std::cerr << (type == GL_VERTEX_SHADER ? "Vertex" : "Fragment")
+              << " shader error: " << log.data() << std::endl;
+    return 0;
+  }
+  return shader;
+}
+
+// Compiles and links a program whose attributes are at the locations of
+// their names in the list, 0 if it fails.
+static GLuint build_program(const GLchar* vertex_shader_source,
+                            const GLchar* fragment_shader_source,
+                            const std::vector<const char*>& attributes) {
+  const GLuint vertex_shader =
+      compile_shader(GL_VERTEX_SHADER, vertex_shader_source);
+  const GLuint fragment_shader =
+      compile_shader(GL_FRAGMENT_SHADER, fragment_shader_source);
+  GLuint program = glCreateProgram();
+  ENGINE_GL_CHECK();
+  if (vertex_shader == 0 || fragment_shader == 0 || program == 0) {
+    if (program == 0) std::cerr << "Create program error." << std::endl;
+    glDeleteShader(vertex_shader);  // ignores 0
+    glDeleteShader(fragment_shader);
+    glDeleteProgram(program);
+    return 0;
+  }
+  glAttachShader(program, vertex_shader);
+  ENGINE_GL_CHECK();
+  glAttachShader(program, fragment_shader);
+  ENGINE_GL_CHECK();
+  for (size_t i = 0; i < attributes.size(); ++i) {
+    glBindAttribLocation(program, static_cast<GLuint>(i), attributes[i]);
+    ENGINE_GL_CHECK();
+  }
+
+  glLinkProgram(program);
+  ENGINE_GL_CHECK();
+
+  GLint link_success;
+  glGetProgramiv(program, GL_LINK_STATUS, &link_success);
+  /* Cleanup. */
+  glDeleteShader(vertex_shader);
+  ENGINE_GL_CHECK();
+  glDeleteShader(fragment_shader);
+  ENGINE_GL_CHECK();
+  if (!link_success) {
+    GLint log_len;
+    glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
+    std::vector<GLchar> log(log_len);
+    glGetProgramInfoLog(program, log_len, NULL, log.data());
+    glDeleteProgram(program);
+    std::cerr << "Link Program error: " << log.data() << std::endl;
+    return 0;
+  }
+  return program;
+}
+
 class Engine_impl final : public IEngine {
  public:
+  // Assets come from the pack when there is one, from loose files otherwise
+  // or when it doesn't have them.
+  Engine_impl() {
+    if (assets.open("assets.pack")) {
+      std::clog << "assets: assets.pack" << std::endl;
+    }
+  }
+
+  ~Engine_impl() { stop_render_thread(); }
+
+  Asset_view load_asset(const std::string& name) final {
+    auto it = loaded_assets.find(name);
+    if (it == loaded_assets.end()) {
+      asset loaded;
+      if (!assets.load(name, loaded)) return Asset_view();
+      it = loaded_assets.emplace(name, std::move(loaded)).first;
+    }
+    return Asset_view(reinterpret_cast<const char*>(it->second.data()),
+                      it->second.size());
+  }
+
   std::string init(const std::string& config) final {
+    start_time = std::chrono::steady_clock::now();
     check_SDL_version();
 
     const int init_result = SDL_Init(SDL_INIT_EVERYTHING);
@@ -212,6 +968,10 @@ class Engine_impl final : public IEngine {
 
     set_keys(config);
 
+    gl_check_level = read_gl_check_level();
+    if (gl_check_level != gl_check::off) {
+      SDL_GL_SetAttribute(SDL_GL_CONTEXT_FLAGS, SDL_GL_CONTEXT_DEBUG_FLAG);
+    }
     // TODO: set attributes for version
     gl_context = SDL_GL_CreateContext(window);
     assert(gl_context != nullptr);
@@ -224,39 +984,22 @@ class Engine_impl final : public IEngine {
       SDL_Quit();
       return "";
     }
+    if (gl_check_level != gl_check::off) {
+      enable_gl_messages();
+    }
 
-    /* Vertex shader */
-    GLuint vertex_shader = glCreateShader(GL_VERTEX_SHADER);
-    ENGINE_GL_CHECK();
     static const GLchar* vertex_shader_source =
         "#version 120\n"
         "attribute vec2 a_coord2d;\n"
         "attribute vec2 a_texture2d;\n"
+        "uniform vec2 u_offset;\n"
+        "uniform vec2 u_uv_offset;\n"
+        "uniform vec2 u_uv_scale;\n"
         "varying vec2 v_TexCoord;\n"
         "void main() {\n"
-        "	gl_Position = vec4(a_coord2d, 0.0, 1.0);\n"
-        "	v_TexCoord = vec2(a_texture2d.x, 1.0f - a_texture2d.y);\n"
+        "	gl_Position = vec4(a_coord2d + u_offset, 0.0, 1.0);\n"
+        "	v_TexCoord = a_texture2d * u_uv_scale + u_uv_offset;\n"
         "}\n";
-    glShaderSource(vertex_shader, 1, &vertex_shader_source, NULL);
-    ENGINE_GL_CHECK();
-    glCompileShader(vertex_shader);
-    ENGINE_GL_CHECK();
-
-    GLint compile_success;
-    glGetShaderiv(vertex_shader, GL_COMPILE_STATUS, &compile_success);
-    if (!compile_success) {
-      GLint log_len;
-      glGetShaderiv(vertex_shader, GL_INFO_LOG_LENGTH, &log_len);
-      std::vector<GLchar> log(log_len);
-      glGetShaderInfoLog(vertex_shader, log_len, NULL, log.data());
-      glDeleteShader(vertex_shader);
-      std::cerr << "Vertex shader error: " << log.data() << std::endl;
-      return "";
-    }
-
-    /* Fragment shader */
-    GLuint fragment_shader = glCreateShader(GL_FRAGMENT_SHADER);
-    ENGINE_GL_CHECK();
     static const GLchar* fragment_shader_source =
         "#version 120\n"
         "varying vec2 v_TexCoord;\n"
@@ -264,64 +1007,76 @@ class Engine_impl final : public IEngine {
         "void main() {\n"
         "    gl_FragColor = texture2D(u_ourTexture, v_TexCoord);\n"
         "}\n";
-    glShaderSource(fragment_shader, 1, &fragment_shader_source, NULL);
-    ENGINE_GL_CHECK();
-    glCompileShader(fragment_shader);
-    ENGINE_GL_CHECK();
-
-    glGetShaderiv(fragment_shader, GL_COMPILE_STATUS, &compile_success);
-    if (!compile_success) {
-      GLint log_len;
-      glGetShaderiv(fragment_shader, GL_INFO_LOG_LENGTH, &log_len);
-      std::vector<GLchar> log(log_len);
-      glGetShaderInfoLog(fragment_shader, log_len, NULL, log.data());
-      glDeleteShader(fragment_shader);
-      std::cerr << "Fragment shader error: " << log.data() << std::endl;
-      return "";
-    }
-
-    /* Link shaders */
-    GLuint program = glCreateProgram();
-    ENGINE_GL_CHECK();
-    if (program == 0) {
-      std::cerr << "Create program error." << std::endl;
-      return "";
-    }
-    glAttachShader(program, vertex_shader);
-    ENGINE_GL_CHECK();
-    glAttachShader(program, fragment_shader);
-    ENGINE_GL_CHECK();
-    glBindAttribLocation(program, 0, "a_coord2d");
+    program = build_program(vertex_shader_source, fragment_shader_source,
+                            {"a_coord2d", "a_texture2d"});
+    if (program == 0) return "";
+
+    // The three layers of a Triangle_2 in one pass: the model over the
+    // background and the clouds over both, composited as blending would
+    // with premultiplied alpha, and blended once into the frame. The UV
+    // transform of a layered mesh scrolls the background and the clouds.
+    static const GLchar* layered_vertex_shader_source =
+        "#version 120\n"
+        "attribute vec2 a_coord2d;\n"
+        "attribute vec2 a_back2d;\n"
+        "attribute vec2 a_model2d;\n"
+        "uniform vec2 u_offset;\n"
+        "uniform vec2 u_uv_offset;\n"
+        "uniform vec2 u_uv_scale;\n"
+        "varying vec2 v_back;\n"
+        "varying vec2 v_model;\n"
+        "void main() {\n"
+        "	gl_Position = vec4(a_coord2d + u_offset, 0.0, 1.0);\n"
+        "	v_back = a_back2d * u_uv_scale + u_uv_offset;\n"
+        "	v_model = a_model2d;\n"
+        "}\n";
+    static const GLchar* layered_fragment_shader_source =
+        "#version 120\n"
+        "varying vec2 v_back;\n"
+        "varying vec2 v_model;\n"
+        "uniform sampler2D u_back;\n"
+        "uniform sampler2D u_model;\n"
+        "uniform sampler2D u_up;\n"
+        "void main() {\n"
+        "    vec4 color = texture2D(u_back, v_back);\n"
+        "    vec4 model = texture2D(u_model, v_model);\n"
+        "    color = model + color * (1.0 - model.a);\n"
+        "    vec4 up = texture2D(u_up, v_back);\n"
+        "    gl_FragColor = up + color * (1.0 - up.a);\n"
+        "}\n";
+    layered_program = build_program(
+        layered_vertex_shader_source, layered_fragment_shader_source,
+        {"a_coord2d", "a_back2d", "a_model2d"});
+    if (layered_program == 0) return "";
+    glUseProgram(layered_program);
     ENGINE_GL_CHECK();
-    glBindAttribLocation(program, 1, "a_texture2d");
+    glUniform1i(glGetUniformLocation(layered_program, "u_back"), 0);
+    glUniform1i(glGetUniformLocation(layered_program, "u_model"), 1);
+    glUniform1i(glGetUniformLocation(layered_program, "u_up"), 2);
     ENGINE_GL_CHECK();
+    layer_uniforms.locate(layered_program);
 
-    glLinkProgram(program);
+    glUseProgram(program);
     ENGINE_GL_CHECK();
 
-    glGetProgramiv(program, GL_LINK_STATUS, &compile_success);
-    if (!compile_success) {
-      GLint log_len;
-      glGetProgramiv(program, GL_INFO_LOG_LENGTH, &log_len);
-      std::vector<GLchar> log(log_len);
-      glGetProgramInfoLog(program, log_len, NULL, log.data());
-      glDeleteProgram(program);
-      std::cerr << "Link Program error: " << log.data() << std::endl;
-      return "";
-    }
+    batch.create();
+    layers.create();
 
-    /* Cleanup. */
-    glDeleteShader(vertex_shader);
-    ENGINE_GL_CHECK();
-    glDeleteShader(fragment_shader);
+    // the rows of textures of 1 and 2 bytes per pixel aren't padded to 4
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
     ENGINE_GL_CHECK();
 
-    glUseProgram(program);
+    const std::vector<GLuint> textures =
+        load_textures({"sand_brown.png", "tank.png", "clouds.png"});
+    texture_back = textures[0];
+    texture_model = textures[1];
+    texture_up = textures[2];
+    // for the layered program, unit 0 is bound to the texture of each draw
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D, texture_model);
+    glActiveTexture(GL_TEXTURE2);
+    glBindTexture(GL_TEXTURE_2D, texture_up);
     ENGINE_GL_CHECK();
-
-    texture_back = load_texture("sand_brown.png", 0);
-    texture_model = load_texture("tank.png", 0);
-    texture_up = load_texture("clouds.png", 0);
     GLint textureLocation = glGetUniformLocation(program, "u_ourTexture");
     ENGINE_GL_CHECK();
     glActiveTexture(GL_TEXTURE0);
@@ -330,119 +1085,428 @@ class Engine_impl final : public IEngine {
     glUniform1i(textureLocation, 0);
     ENGINE_GL_CHECK();
 
+    mesh_uniforms.locate(program);
+
     glEnable(GL_BLEND);
     ENGINE_GL_CHECK();
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    // the textures have premultiplied alpha
+    glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
     ENGINE_GL_CHECK();
+
+    mode = read_render_mode();
+    if (mode != render_mode::direct) {
+      // the context is current on one thread at a time
+      SDL_GL_MakeCurrent(window, nullptr);
+      render_thread = std::thread(&Engine_impl::render_frames, this);
+      std::clog << "render thread: "
+                << (mode == render_mode::pipelined ? "a frame behind"
+                                                   : "in step")
+                << std::endl;
+    }
     // The End
 
     return "";
   }
 
-  GLuint load_texture(std::string path, size_t texture_number) {
-    std::vector<unsigned char> png_file_in_memory;
-    std::ifstream ifs(path, std::ios_base::binary);
-    if (!ifs) return false;
-    ifs.seekg(0, std::ios_base::end);
-    size_t pos_in_file = ifs.tellg();
-    png_file_in_memory.resize(pos_in_file);
-    ifs.seekg(0, std::ios_base::beg);
-
-    ifs.read(reinterpret_cast<char*>(png_file_in_memory.data()), pos_in_file);
-    if (!ifs) return false;
-
-    std::vector<unsigned char> image;
-    unsigned long w = 0;
-    unsigned long h = 0;
-    int error = decodePNG(image, w, h, &png_file_in_memory[0],
-                          png_file_in_memory.size());
+  // Loads the textures of many image assets at once. They are decoded on worker
+  // threads, one per core, which also build their mip chains, row by row as the
+  // rows of an image that isn't interlaced are decoded. Those rows are written
+  // straight into a pixel buffer that this thread, the only one that may call
+  // GL, maps for the image once its worker has read its header, and into its
+  // entry of the texture cache. An interlaced image is decoded into the first
+  // level of its chain, which this thread uploads after Adam7 passes 1, 3 and 5
+  // as a coarse texture drawn with GL_NEAREST, and its other levels are built
+  // after the last. Chains from earlier runs are mapped from the texture cache
+  // instead, without reading the images past their headers. An image with a KTX
+  // file made by ktx_encoder is loaded from that, block-compressed as it is if
+  // GL has S3TC, or else decompressed to RGBA8. Each worker reports the size,
+  // format and mipmap levels of its image, and this thread reserves the storage
+  // of the texture and uploads it as soon as the image is ready, in whatever
+  // order they get ready. The textures are returned in the order of the names,
+  // 0 for an image that can't be read or decoded.
+  std::vector<GLuint> load_textures(const std::vector<std::string>& names) {
+    struct decoded_image {
+      bool read = false;
+      int error = 0;
+      unsigned long w = 0;
+      unsigned long h = 0;
+      picopng::Format format = picopng::FORMAT_RGBA8;
+      size_t levels = 0;
+      asset file;
+      mip_chain mips;
+      cached_texture cached;  // mips are empty when it isn't
+      ktx_texture compressed;  // into file, with S3TC only
+      double decode_ms = 0;
+      bool done = false;
+      // A worker that streams an image sets wants_buffer once it knows its
+      // size and waits for this thread to map it a buffer, null if it can't.
+      bool wants_buffer = false;
+      size_t buffer_size = 0;
+      bool buffer_mapped = false;
+      unsigned char* buffer = nullptr;
+      // A worker that decodes an interlaced image sets pass after a pass
+      // and waits for this thread to upload the first level of its chain.
+      int pass = 0;
+      int uploaded_pass = 0;
+      GLuint pixel_buffer = 0;  // this thread's
+      bool uploaded = false;    // this thread's
+    };
+    std::vector<decoded_image> images(names.size());
+    // workers wait on image_served, this thread on image_ready
+    std::mutex mutex;
+    std::condition_variable image_ready;
+    std::condition_variable image_served;
+    std::atomic<size_t> next_image(0);
+
+    const size_t cores = std::max(1u, std::thread::hardware_concurrency());
+    const size_t worker_count = std::min(cores, names.size());
+    // the cores left over when there are fewer images than cores
+    const unsigned mip_threads =
+        static_cast<unsigned>(cores / std::max<size_t>(1, worker_count));
+
+    const texture_cache cache("texture_cache");
+    const bool s3tc = GLEW_EXT_texture_compression_s3tc;
+    auto decode_images = [&]() {
+      for (size_t i = next_image++; i < names.size(); i = next_image++) {
+        decoded_image& image = images[i];
+        const auto start = std::chrono::steady_clock::now();
+        asset& file = image.file;
+        block_format blocks;
+        if (load_ktx(names[i], file, image.compressed, blocks)) {
+          image.read = true;
+          image.w = image.compressed.width;
+          image.h = image.compressed.height;
+          if (!s3tc) {
+            decompress_levels(image.compressed, blocks, image.mips);
+            image.compressed = ktx_texture();
+            file = asset();
+          }
+        } else if (assets.load(names[i], file)) {
+          image.read = true;
+          picopng::Header header;
+          image.error = probePNG(header, file.data(), file.size());
+          if (image.error == 0) {
+            image.format = choose_format(header.colorType);
+          }
+          const pixel_format format = mip_format(image.format);
+          if (image.error != 0) {
+            // not a PNG, or one it can't decode
+          } else if (cache.find(names[i], file, format, image.cached)) {
+            image.w = image.cached.levels[0].width;
+            image.h = image.cached.levels[0].height;
+          } else if (header.interlaceMethod == 0) {
+            mip_chain& chain = image.mips;
+            chain.format = format;
+            chain.levels = mip_levels(header.width, header.height, format);
+            image.w = header.width;
+            image.h = header.height;
+            unsigned char* pixels = nullptr;
+            {
+              std::unique_lock<std::mutex> lock(mutex);
+              image.buffer_size = chain.levels.back().offset +
+                                  pixel_size(format);
+              image.wants_buffer = true;
+              image_ready.notify_all();
+              image_served.wait(lock,
+                                [&image] { return image.buffer_mapped; });
+              pixels = image.buffer;
+            }
+            if (pixels == nullptr) {
+              chain.pixels.resize(image.buffer_size);
+              pixels = chain.pixels.data();
+            }
+            cache_entry entry;
+            cache.begin(names[i], file, format, image.w, image.h, entry);
+            image.error = stream_mip_chain(
+                file, header, image.format,
+                [&](size_t level, size_t y, const unsigned char* row) {
+                  const mip_chain::level& l = chain.levels[level];
+                  const size_t size = l.width * pixel_size(format);
+                  const size_t offset = l.offset + y * size;
+                  std::memcpy(pixels + offset, row, size);
+                  entry.write(offset, row, size);
+                });
+            if (image.error == 0) {
+              entry.commit();
+            }
+          } else {
+            // decoded straight into the first level of the chain, which the
+            // others are then built after
+            mip_chain& chain = image.mips;
+            chain.format = format;
+            chain.levels = mip_levels(header.width, header.height, format);
+            chain.pixels.resize(chain.levels.back().offset +
+                                pixel_size(format));
+            image.w = header.width;
+            image.h = header.height;
+            image.levels = chain.levels.size();
+            // the decoder goes on writing the level once this thread has
+            // uploaded it
+            std::function<void(int)> pass_done = [&](int pass) {
+              if (pass != 1 && pass != 3 && pass != 5) return;
+              std::unique_lock<std::mutex> lock(mutex);
+              image.pass = pass;
+              image_ready.notify_all();
+              image_served.wait(lock, [&image] {
+                return image.uploaded_pass == image.pass;
+              });
+            };
+            picopng::StreamDecoder decoder(nullptr, &pass_done);
+            decoder.setFormat(image.format);
+            // verified, so a corrupt file is an error, not a texture
+            decoder.setVerify(true);
+            set_texture_options(decoder);
+            decoder.setOutput(chain.pixels.data(),
+                              header.width * pixel_size(format));
+            decoder.setProgressive([](void* user, int pass) {
+              (*static_cast<std::function<void(int)>*>(user))(pass);
+            });
+            image.error = stream_png(decoder, file);
+            if (image.error == 0) {
+              build_mip_levels(chain, mip_threads);
+              cache.store(names[i], file, chain);
+            } else {
+              image.mips = mip_chain();
+            }
+          }
+        }
+        image.levels = !image.cached.levels.empty() ? image.cached.levels.size()
+                       : !image.compressed.levels.empty()
+                           ? image.compressed.levels.size()
+                           : image.mips.levels.size();
+        const std::chrono::duration<double, std::milli> time =
+            std::chrono::steady_clock::now() - start;
+        image.decode_ms = time.count();
+        std::lock_guard<std::mutex> lock(mutex);
+        image.done = true;
+        image_ready.notify_all();
+      }
+    };
 
-    if (error != 0) {
-      std::cerr << "error: " << error << std::endl;
-    } else {
-      std::cout << "Loaded image successfull" << std::endl;
+    std::vector<std::thread> workers;
+    for (size_t i = 0; i < worker_count; ++i) {
+      workers.emplace_back(decode_images);
     }
 
-    GLuint texture = 0;
-    glGenTextures(1, &texture);
-    ENGINE_GL_CHECK();
-    glActiveTexture(GL_TEXTURE0 + texture_number);
-    glBindTexture(GL_TEXTURE_2D, texture);
-    ENGINE_GL_CHECK();
-
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    ENGINE_GL_CHECK();
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    ENGINE_GL_CHECK();
-
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, w, h, 0, GL_RGBA, GL_UNSIGNED_BYTE,
-                 &image[0]);
-
-    ENGINE_GL_CHECK();
-
-    //    glGenerateMipmap(GL_TEXTURE_2D);
-    //    ENGINE_GL_CHECK();
-    //    glBindTexture(GL_TEXTURE_2D, 0);
-    //    ENGINE_GL_CHECK();
+    // the images are served as they get ready, so that a slow one holds up
+    // neither the uploads of the others nor the buffers of their workers
+    std::vector<GLuint> textures(names.size(), 0);
+    for (size_t left = names.size(); left > 0;) {
+      size_t i = 0;
+      bool map = false;
+      int pass = 0;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        image_ready.wait(lock, [&] {
+          for (i = 0; i < images.size(); ++i) {
+            const decoded_image& image = images[i];
+            map = image.wants_buffer && !image.buffer_mapped;
+            pass = image.pass != image.uploaded_pass ? image.pass : 0;
+            if (map || pass != 0 || (image.done && !image.uploaded)) {
+              return true;
+            }
+          }
+          return false;
+        });
+      }
+      decoded_image& image = images[i];
+      if (map) {
+        unsigned char* buffer =
+            map_pixel_buffer(image.buffer_size, image.pixel_buffer);
+        std::lock_guard<std::mutex> lock(mutex);
+        image.buffer = buffer;
+        image.buffer_mapped = true;
+        image_served.notify_all();
+        continue;
+      }
+      if (pass != 0) {
+        const texture_format format = gl_format(image.format);
+        if (textures[i] == 0) {
+          // drawn with GL_NEAREST from the first level until the chain is
+          // done
+          textures[i] = create_texture(0);
+          reserve_texture(image.w, image.h, format,
+                          static_cast<GLsizei>(image.levels));
+        } else {
+          glBindTexture(GL_TEXTURE_2D, textures[i]);
+        }
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0,
+                        static_cast<GLsizei>(image.w),
+                        static_cast<GLsizei>(image.h), format.format,
+                        format.type, image.mips.pixels.data());
+        ENGINE_GL_CHECK();
+        std::lock_guard<std::mutex> lock(mutex);
+        image.uploaded_pass = pass;
+        image_served.notify_all();
+        continue;
+      }
+      image.uploaded = true;
+      --left;
+      const bool lost =
+          image.pixel_buffer != 0 && !unmap_pixel_buffer(image.pixel_buffer);
+      if (!image.read || image.error != 0 || lost) {
+        if (image.pixel_buffer != 0) {
+          glDeleteBuffers(1, &image.pixel_buffer);
+          ENGINE_GL_CHECK();
+        }
+        if (textures[i] != 0) {
+          glDeleteTextures(1, &textures[i]);
+          ENGINE_GL_CHECK();
+          textures[i] = 0;
+        }
+        if (!image.read) {
+          std::cerr << "error: can't read " << names[i] << std::endl;
+        } else if (image.error != 0) {
+          std::cerr << "error: " << image.error << " in " << names[i]
+                    << std::endl;
+        } else {
+          std::cerr << "error: the pixels of " << names[i] << " were lost"
+                    << std::endl;
+        }
+        continue;
+      }
+      const bool cached = !image.cached.levels.empty();
+      const bool compressed = !image.compressed.levels.empty();
+      ++loaded_textures;
+      cached_textures += cached;
+      std::clog << names[i] << ": " << image.w << 'x' << image.h
+                << (cached       ? " mapped from the cache in "
+                    : compressed ? " mapped from its KTX file in "
+                                 : " decoded and mipmapped in ")
+                << image.decode_ms << " ms" << std::endl;
+
+      const texture_format format = compressed
+                                        ? compressed_format(image.compressed)
+                                        : gl_format(image.format);
+      if (textures[i] == 0) {
+        textures[i] = create_texture(0);
+        reserve_texture(image.w, image.h, format,
+                        static_cast<GLsizei>(image.levels));
+      } else {
+        glBindTexture(GL_TEXTURE_2D, textures[i]);
+        ENGINE_GL_CHECK();
+      }
+      if (compressed) {
+        upload_compressed(image.compressed);
+        image.compressed = ktx_texture();
+        image.file = asset();
+      } else if (cached) {
+        upload_mip_chain(image.cached, format);
+        image.cached = cached_texture();
+      } else if (image.pixel_buffer != 0) {
+        upload_pixel_buffer(image.pixel_buffer,
+                            buffered_chain{image.mips.levels}, format);
+        image.mips = mip_chain();
+      } else {
+        upload_mip_chain(image.mips, format);
+        image.mips = mip_chain();
+      }
+    }
 
-    return texture;
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+    return textures;
   }
 
   void render_triangle(Vertex const* vertex, Vertex const* textur,
                        GLuint texture) {
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), &vertex[0]);
-    ENGINE_GL_CHECK();
-    glEnableVertexAttribArray(0);
-    ENGINE_GL_CHECK();
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), &textur[0]);
-    ENGINE_GL_CHECK();
-    glEnableVertexAttribArray(1);
-    ENGINE_GL_CHECK();
-
-    glBindTexture(GL_TEXTURE_2D, texture);
-    ENGINE_GL_CHECK();
-    glDrawArrays(GL_TRIANGLES, 0, 3);
-    ENGINE_GL_CHECK();
+    if (mode == render_mode::direct) {
+      add_triangle(vertex, textur, texture);
+      return;
+    }
+    recording.write(command_list::op::triangle);
+    recording.write(vertex, 3);
+    recording.write(textur, 3);
+    recording.write(texture);
+  }
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    ENGINE_GL_CHECK();
+  // The background, the model and the clouds over it in one pass.
+  void render_layers(Vertex const* vertex, Vertex const* back,
+                     Vertex const* model) {
+    if (mode == render_mode::direct) {
+      add_layers(vertex, back, model);
+      return;
+    }
+    recording.write(command_list::op::layers);
+    recording.write(vertex, 3);
+    recording.write(back, 3);
+    recording.write(model, 3);
   }
 
   void render_triangle(const Triangle& t) final {
-    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), &t.v[0]);
-    ENGINE_GL_CHECK();
-    glEnableVertexAttribArray(0);
-    ENGINE_GL_CHECK();
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), &t.t[0]);
-    ENGINE_GL_CHECK();
-    glEnableVertexAttribArray(1);
-    ENGINE_GL_CHECK();
+    render_layers(t.v, t.t, t.t);
+  }
 
-    glBindTexture(GL_TEXTURE_2D, texture_back);
-    ENGINE_GL_CHECK();
-    glDrawArrays(GL_TRIANGLES, 0, 3);
-    ENGINE_GL_CHECK();
-    glBindTexture(GL_TEXTURE_2D, texture_model);
-    ENGINE_GL_CHECK();
-    glDrawArrays(GL_TRIANGLES, 0, 3);
-    ENGINE_GL_CHECK();
-    glBindTexture(GL_TEXTURE_2D, texture_up);
-    ENGINE_GL_CHECK();
-    glDrawArrays(GL_TRIANGLES, 0, 3);
-    ENGINE_GL_CHECK();
+  void render_triangle(const Triangle_2& t) final {
+    render_layers(t.v, t.t_back, t.t_model);
+  }
 
-    glDisableVertexAttribArray(0);
-    glDisableVertexAttribArray(1);
-    ENGINE_GL_CHECK();
+  size_t create_mesh(const Triangle* triangles, size_t count) final {
+    std::vector<mesh_vertex> vertices;
+    for (size_t i = 0; i < count; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        vertices.push_back({triangles[i].v[j], triangles[i].t[j]});
+      }
+    }
+    if (mode == render_mode::direct) {
+      upload_mesh(vertices);
+    } else {
+      recording.write(command_list::op::create_mesh);
+      recording.write(vertices.size());
+      for (const mesh_vertex& vertex : vertices) {
+        recording.write(&vertex.position, 1);
+        recording.write(&vertex.texture, 1);
+      }
+    }
+    return mesh_count++;
   }
 
-  void render_triangle(const Triangle_2& t) final {
-    render_triangle(t.v, t.t_back, texture_back);
+  // Drawn right away, after the triangles rendered before it, which keeps
+  // the order blending depends on.
+  void render_mesh(size_t index, Texture texture,
+                   const Mesh_transform& transform) final {
+    if (mode == render_mode::direct) {
+      draw_mesh(index, texture, transform);
+      return;
+    }
+    recording.write(command_list::op::mesh);
+    recording.write(index);
+    recording.write(texture);
+    recording.write_transform(transform);
+  }
 
-    render_triangle(t.v, t.t_model, texture_model);
+  size_t create_mesh(const Triangle_2* triangles, size_t count) final {
+    std::vector<layer_vertex> vertices;
+    for (size_t i = 0; i < count; ++i) {
+      for (int j = 0; j < 3; ++j) {
+        vertices.push_back({triangles[i].v[j], triangles[i].t_back[j],
+                            triangles[i].t_model[j]});
+      }
+    }
+    if (mode == render_mode::direct) {
+      upload_mesh(vertices);
+    } else {
+      recording.write(command_list::op::create_layered_mesh);
+      recording.write(vertices.size());
+      for (const layer_vertex& vertex : vertices) {
+        recording.write(&vertex.position, 1);
+        recording.write(&vertex.back, 1);
+        recording.write(&vertex.model, 1);
+      }
+    }
+    return mesh_count++;
+  }
 
-    render_triangle(t.v, t.t_back, texture_up);
+  void render_layered_mesh(size_t index,
+                           const Mesh_transform& transform) final {
+    if (mode == render_mode::direct) {
+      draw_layered_mesh(index, transform);
+      return;
+    }
+    recording.write(command_list::op::layered_mesh);
+    recording.write(index);
+    recording.write_transform(transform);
   }
 
   void render_triangle_minimap(const Triangle_2& t) final {
@@ -465,14 +1529,8 @@ class Engine_impl final : public IEngine {
 
   void render_quad(const Triangle_2& tr1, const Triangle_2& tr2,
                    const float koef_minimap) {
-    render_triangle(tr1.v, tr1.t_back, texture_back);
-    render_triangle(tr2.v, tr2.t_back, texture_back);
-
-    render_triangle(tr1.v, tr1.t_model, texture_model);
-    render_triangle(tr2.v, tr2.t_model, texture_model);
-
-    render_triangle(tr1.v, tr1.t_back, texture_up);
-    render_triangle(tr2.v, tr2.t_back, texture_up);
+    render_triangle(tr1);
+    render_triangle(tr2);
 
     Vertex new_v_1[3] = {Vertex(tr1.v[0]), Vertex(tr1.v[1]), Vertex(tr1.v[2])};
     for (Vertex& element : new_v_1) {
@@ -509,12 +1567,13 @@ class Engine_impl final : public IEngine {
   }
 
   void swap_buffers() final {
-    SDL_GL_SwapWindow(window);
-    glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
-    ENGINE_GL_CHECK();
-    glClear(GL_COLOR_BUFFER_BIT);
-    ENGINE_GL_CHECK();
+    if (mode == render_mode::direct) {
+      present();
+    } else {
+      submit_frame();
+    }
   }
+
   bool read_event(Event& e) final {
     SDL_Event sdl_event;
     if (SDL_PollEvent(&sdl_event)) {
@@ -537,8 +1596,17 @@ class Engine_impl final : public IEngine {
   float get_time() final { return SDL_GetTicks() * 0.001f; }
 
   int finish() final {
-    // glDeleteBuffers(1, &vbo);
-    // glDeleteProgram(program);
+    stop_render_thread();
+    batch.destroy();
+    layers.destroy();
+    for (static_mesh& mesh : meshes) {
+      glDeleteBuffers(1, &mesh.vbo);
+      if (mesh.vao != 0) glDeleteVertexArrays(1, &mesh.vao);
+      ENGINE_GL_CHECK();
+    }
+    meshes.clear();
+    glDeleteProgram(program);
+    glDeleteProgram(layered_program);
     SDL_GL_DeleteContext(gl_context);
     SDL_DestroyWindow(window);
     SDL_Quit();
@@ -551,6 +1619,323 @@ class Engine_impl final : public IEngine {
   GLuint texture_back = 0;
   GLuint texture_model = 0;
   GLuint texture_up = 0;
+  std::chrono::steady_clock::time_point start_time;
+  bool first_frame = true;
+  size_t loaded_textures = 0;
+  size_t cached_textures = 0;
+  asset_pack assets;
+  std::map<std::string, asset> loaded_assets;  // by load_asset
+  GLuint program = 0;
+  GLuint layered_program = 0;
+  triangle_batch batch;
+  layer_batch layers;
+  render_mode mode = render_mode::direct;
+  size_t mesh_count = 0;  // created by the game, maybe not yet by GL
+  // The list the game records into and the one the render thread draws,
+  // swapped by swap_buffers once the thread is done with the one before.
+  command_list recording;
+  command_list submitted;
+  std::thread render_thread;
+  std::mutex frame_mutex;
+  std::condition_variable frame_ready;
+  std::condition_variable frame_done;
+  bool frame_pending = false;  // submitted isn't drawn yet
+  bool stopping = false;
+  std::vector<static_mesh> meshes;  // by create_mesh
+  frame_stats stats;  // of this frame so far
+  size_t draw_calls = 0;  // of the last frame that was reported
+  transform_uniforms mesh_uniforms;  // of program
+  transform_uniforms layer_uniforms;  // of layered_program
+
+  void add_triangle(Vertex const* vertex, Vertex const* textur,
+                    GLuint texture) {
+    draw_layers();
+    batch.add(vertex, textur, texture);
+  }
+
+  void add_layers(Vertex const* vertex, Vertex const* back,
+                  Vertex const* model) {
+    if (!batch.vertices.empty()) draw_batch();
+    layers.add(vertex, back, model);
+  }
+
+  void upload_mesh(const std::vector<mesh_vertex>& vertices) {
+    upload_mesh(vertices.data(), vertices.size() * sizeof(mesh_vertex),
+                vertices.size(), false);
+  }
+
+  void upload_mesh(const std::vector<layer_vertex>& vertices) {
+    upload_mesh(vertices.data(), vertices.size() * sizeof(layer_vertex),
+                vertices.size(), true);
+  }
+
+  void upload_mesh(const void* vertices, size_t size, size_t count,
+                   bool layered) {
+    static_mesh mesh;
+    mesh.vertex_count = static_cast<GLsizei>(count);
+    mesh.layered = layered;
+    if (GLEW_VERSION_3_0 || GLEW_ARB_vertex_array_object) {
+      glGenVertexArrays(1, &mesh.vao);
+      ENGINE_GL_CHECK();
+      glBindVertexArray(mesh.vao);
+      ENGINE_GL_CHECK();
+    }
+    glGenBuffers(1, &mesh.vbo);
+    ENGINE_GL_CHECK();
+    glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+    ENGINE_GL_CHECK();
+    glBufferData(GL_ARRAY_BUFFER, size, vertices, GL_STATIC_DRAW);
+    ENGINE_GL_CHECK();
+    if (mesh.vao != 0) {
+      layered ? enable_layer_layout() : enable_vertex_layout();
+      glBindVertexArray(0);
+      ENGINE_GL_CHECK();
+    }
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    ENGINE_GL_CHECK();
+    meshes.push_back(mesh);
+  }
+
+  void draw_mesh(size_t index, Texture texture,
+                 const Mesh_transform& transform) {
+    const static_mesh& mesh = meshes.at(index);
+    draw_batch();
+    mesh_uniforms.set(transform);
+    glBindTexture(GL_TEXTURE_2D, texture_of(texture));
+    ENGINE_GL_CHECK();
+    draw_static_mesh(mesh);
+  }
+
+  void draw_layered_mesh(size_t index, const Mesh_transform& transform) {
+    const static_mesh& mesh = meshes.at(index);
+    draw_batch();
+    use_layered_program();
+    layer_uniforms.set(transform);
+    draw_static_mesh(mesh);
+    glUseProgram(program);
+    ENGINE_GL_CHECK();
+  }
+
+  // with its program in use and its textures bound
+  void draw_static_mesh(const static_mesh& mesh) {
+    if (mesh.vao != 0) {
+      glBindVertexArray(mesh.vao);
+      ENGINE_GL_CHECK();
+    } else {
+      glBindBuffer(GL_ARRAY_BUFFER, mesh.vbo);
+      ENGINE_GL_CHECK();
+      mesh.layered ? enable_layer_layout() : enable_vertex_layout();
+    }
+    glDrawArrays(GL_TRIANGLES, 0, mesh.vertex_count);
+    ENGINE_GL_CHECK();
+    if (mesh.vao != 0) {
+      glBindVertexArray(0);
+      ENGINE_GL_CHECK();
+    } else {
+      mesh.layered ? disable_layer_layout() : disable_vertex_layout();
+      glBindBuffer(GL_ARRAY_BUFFER, 0);
+      ENGINE_GL_CHECK();
+    }
+    ++stats.draw_calls;
+    stats.triangles += mesh.vertex_count / 3;
+  }
+
+  // The end of a frame on the thread with the GL context.
+  void present() {
+    draw_batch();
+    if (gl_check_level == gl_check::frame) {
+      check_gl_error("the end of a frame");
+    }
+    if (stats.draw_calls != draw_calls) {
+      // when it changes, not every frame
+      draw_calls = stats.draw_calls;
+      std::clog << "frame: " << draw_calls << " draw calls for "
+                << stats.triangles << " triangles, " << stats.vertex_bytes
+                << " bytes of vertices sent" << std::endl;
+    }
+    stats = frame_stats();
+    SDL_GL_SwapWindow(window);
+    if (first_frame) {
+      // the startup the texture cache saves, a warm start is one with all
+      // textures from it
+      first_frame = false;
+      const std::chrono::duration<double, std::milli> time =
+          std::chrono::steady_clock::now() - start_time;
+      std::clog << "first frame after " << time.count() << " ms, "
+                << (cached_textures == loaded_textures ? "warm" : "cold")
+                << " start with " << cached_textures << " of "
+                << loaded_textures << " textures from the cache"
+                << std::endl;
+    }
+    glClearColor(0.5f, 0.5f, 0.5f, 1.0f);
+    ENGINE_GL_CHECK();
+    glClear(GL_COLOR_BUFFER_BIT);
+    ENGINE_GL_CHECK();
+  }
+
+  // Stops the render thread after the frame it has, if any, and takes the
+  // GL context back, by finish or else the destructor.
+  void stop_render_thread() {
+    if (!render_thread.joinable()) return;
+    {
+      std::lock_guard<std::mutex> lock(frame_mutex);
+      stopping = true;
+    }
+    frame_ready.notify_one();
+    render_thread.join();
+    SDL_GL_MakeCurrent(window, gl_context);
+    mode = render_mode::direct;
+  }
+
+  // Hands the recorded frame to the render thread, after the one before.
+  void submit_frame() {
+    {
+      std::unique_lock<std::mutex> lock(frame_mutex);
+      frame_done.wait(lock, [this] { return !frame_pending; });
+      std::swap(recording, submitted);
+      frame_pending = true;
+    }
+    frame_ready.notify_one();
+    recording.bytes.clear();  // drawn already
+    if (mode == render_mode::threaded) {
+      std::unique_lock<std::mutex> lock(frame_mutex);
+      frame_done.wait(lock, [this] { return !frame_pending; });
+    }
+  }
+
+  void render_frames() {
+    SDL_GL_MakeCurrent(window, gl_context);
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(frame_mutex);
+        frame_ready.wait(lock, [this] { return frame_pending || stopping; });
+        if (!frame_pending) break;
+      }
+      replay(submitted);
+      present();
+      std::lock_guard<std::mutex> lock(frame_mutex);
+      frame_pending = false;
+      frame_done.notify_all();
+    }
+    SDL_GL_MakeCurrent(window, nullptr);
+  }
+
+  void replay(const command_list& commands) {
+    Vertex v[3], t[3], u[3];
+    size_t pos = 0;
+    while (pos < commands.bytes.size()) {
+      switch (commands.read<command_list::op>(pos)) {
+        case command_list::op::triangle:
+          commands.read(pos, v, 3);
+          commands.read(pos, t, 3);
+          add_triangle(v, t, commands.read<GLuint>(pos));
+          break;
+        case command_list::op::layers:
+          commands.read(pos, v, 3);
+          commands.read(pos, t, 3);
+          commands.read(pos, u, 3);
+          add_layers(v, t, u);
+          break;
+        case command_list::op::mesh: {
+          const size_t index = commands.read<size_t>(pos);
+          const Texture texture = commands.read<Texture>(pos);
+          draw_mesh(index, texture, commands.read_transform(pos));
+          break;
+        }
+        case command_list::op::create_mesh: {
+          std::vector<mesh_vertex> vertices(commands.read<size_t>(pos));
+          for (mesh_vertex& vertex : vertices) {
+            commands.read(pos, &vertex.position, 1);
+            commands.read(pos, &vertex.texture, 1);
+          }
+          upload_mesh(vertices);
+          break;
+        }
+        case command_list::op::layered_mesh: {
+          const size_t index = commands.read<size_t>(pos);
+          draw_layered_mesh(index, commands.read_transform(pos));
+          break;
+        }
+        case command_list::op::create_layered_mesh: {
+          std::vector<layer_vertex> vertices(commands.read<size_t>(pos));
+          for (layer_vertex& vertex : vertices) {
+            commands.read(pos, &vertex.position, 1);
+            commands.read(pos, &vertex.back, 1);
+            commands.read(pos, &vertex.model, 1);
+          }
+          upload_mesh(vertices);
+          break;
+        }
+      }
+    }
+  }
+
+  GLuint texture_of(Texture texture) const {
+    switch (texture) {
+      case Texture::back:
+        return texture_back;
+      case Texture::model:
+        return texture_model;
+      case Texture::up:
+        return texture_up;
+    }
+    return 0;
+  }
+
+  // The triangles rendered since the last mesh, which aren't transformed.
+  // Only one of the batches has any, the other was drawn when they were
+  // rendered.
+  void draw_batch() {
+    draw_layers();
+    if (batch.vertices.empty()) return;
+    mesh_uniforms.set(Mesh_transform());
+    batch.draw(stats);
+  }
+
+  void draw_layers() {
+    if (layers.vertices.empty()) return;
+    use_layered_program();
+    layer_uniforms.set(Mesh_transform());
+    layers.draw(stats);
+    glUseProgram(program);
+    ENGINE_GL_CHECK();
+  }
+
+  // The model and the clouds stay bound to units 1 and 2.
+  void use_layered_program() {
+    glUseProgram(layered_program);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, texture_back);
+    ENGINE_GL_CHECK();
+  }
+
+  GLuint create_texture(size_t texture_number) {
+    GLuint texture = 0;
+    glGenTextures(1, &texture);
+    ENGINE_GL_CHECK();
+    glActiveTexture(GL_TEXTURE0 + texture_number);
+    glBindTexture(GL_TEXTURE_2D, texture);
+    ENGINE_GL_CHECK();
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    ENGINE_GL_CHECK();
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    ENGINE_GL_CHECK();
+    return texture;
+  }
+
+  // Maps the KTX file of an image, if there is one the engine can use.
+  bool load_ktx(const std::string& name, asset& file, ktx_texture& ktx,
+                block_format& format) const {
+    if (assets.load(ktx_name(name), file) &&
+        parse_ktx(reinterpret_cast<const unsigned char*>(file.data()),
+                  file.size(), ktx) &&
+        check_ktx(ktx, format)) {
+      return true;
+    }
+    ktx = ktx_texture();
+    return false;
+  }
 };
 
 IEngine* create_engine() {
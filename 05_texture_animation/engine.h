@@ -1,4 +1,5 @@
 #pragma once
+#include <cstddef>
 #include <string>
 
 #ifndef NS_DECLSPEC
@@ -69,6 +70,28 @@ struct NS_DECLSPEC Triangle_2 {
   Vertex t_model[3];
 };
 
+// The textures the engine loads in init.
+enum class Texture { back, model, up };
+
+// What changes from one frame to the next when a mesh is drawn: its
+// position and the scale and offset of its texture coordinates, which are
+// multiplied by uv_scale before uv_offset is added.
+struct NS_DECLSPEC Mesh_transform {
+  Mesh_transform() : offset(), uv_offset(), uv_scale(1.f, 1.f) {}
+  Vertex offset;
+  Vertex uv_offset;
+  Vertex uv_scale;
+};
+
+// The bytes of an asset, from the asset pack or its own file. They stay
+// where they are for as long as the engine does.
+struct NS_DECLSPEC Asset_view {
+  Asset_view() : data(nullptr), size(0) {}
+  Asset_view(const char* d, size_t s) : data(d), size(s) {}
+  const char* data;
+  size_t size;
+};
+
 std::ostream& NS_DECLSPEC operator<<(std::ostream& stream, const Event e);
 std::istream& NS_DECLSPEC operator>>(std::istream&, Vertex&);
 std::istream& NS_DECLSPEC operator>>(std::istream&, Triangle&);
@@ -87,10 +110,24 @@ class NS_DECLSPEC IEngine {
   virtual void render_triangle(const Triangle&) = 0;
   virtual void render_triangle(const Triangle_2&) = 0;
   virtual void render_triangle_minimap(const Triangle_2&) = 0;
+  // Uploads triangles into the GPU once, to be drawn by render_mesh every
+  // frame without sending them again. Returns the mesh.
+  virtual size_t create_mesh(const Triangle* triangles, size_t count) = 0;
+  virtual void render_mesh(size_t mesh, Texture texture,
+                           const Mesh_transform& transform) = 0;
+  // The same for the three layers of Triangle_2s: the background, the model
+  // over it and the clouds over both, drawn by render_layered_mesh in one
+  // pass. Its transform moves the texture coordinates of the background and
+  // the clouds, the model's stay as they are.
+  virtual size_t create_mesh(const Triangle_2* triangles, size_t count) = 0;
+  virtual void render_layered_mesh(size_t mesh,
+                                   const Mesh_transform& transform) = 0;
   virtual void swap_buffers() = 0;
   virtual bool read_event(Event& event) = 0;
   virtual std::string init(const std::string& config) = 0;
   virtual float get_time() = 0;
+  // empty when there is no asset of that name
+  virtual Asset_view load_asset(const std::string& name) = 0;
   //  virtual bool load_texture(std::string path) = 0;
 };
 
@@ -3,25 +3,82 @@
 #include <cassert>
 #include <cmath>
 #include <cstdlib>
-#include <fstream>
 #include <iostream>
 #include <memory>
+#include <streambuf>
 
 #include "engine.h"
 
-std::string read_config(const std::string file_name) {
-  std::ifstream mol_file(file_name);
-  std::string mol_string((std::istreambuf_iterator<char>(mol_file)),
-                         std::istreambuf_iterator<char>());
-  return std::string();
+// Reads an asset where the engine keeps it, without a copy.
+struct asset_streambuf : std::streambuf {
+  explicit asset_streambuf(ns::Asset_view view) {
+    char* begin = const_cast<char*>(view.data);
+    setg(begin, begin, begin + view.size);
+  }
+};
+
+std::string read_config(ns::IEngine& engine, const std::string file_name) {
+  const ns::Asset_view config = engine.load_asset(file_name);
+  return config.data ? std::string(config.data, config.size) : std::string();
+}
+
+ns::Triangle make_triangle(const ns::Vertex* v, const ns::Vertex* t) {
+  ns::Triangle triangle;
+  for (int i = 0; i < 3; ++i) {
+    triangle.v[i] = v[i];
+    triangle.t[i] = t[i];
+  }
+  return triangle;
+}
+
+// The layers render_quad draws, as meshes: the background with the model
+// and the clouds over it, the minimap and the model on it, placed as it is
+// when the background doesn't scroll. Returns the first, the others follow
+// it.
+size_t make_meshes(ns::IEngine& engine, const ns::Triangle_2& tr1,
+                   const ns::Triangle_2& tr2, float koef_minimap) {
+  const ns::Triangle_2 layers[2] = {tr1, tr2};
+  ns::Triangle minimap[2] = {make_triangle(tr1.v, tr1.t_model),
+                             make_triangle(tr2.v, tr2.t_model)};
+  ns::Triangle minimodel[2] = {make_triangle(tr1.t_back, tr1.t_model),
+                               make_triangle(tr2.t_back, tr2.t_model)};
+  for (int i = 0; i < 2; ++i) {
+    for (ns::Vertex& v : minimap[i].v) {
+      v.add(0.5f).multiply(koef_minimap).add(-0.5f);
+    }
+    for (ns::Vertex& v : minimodel[i].v) {
+      v.multiply(koef_minimap).add(-0.5f);
+    }
+  }
+  const size_t first = engine.create_mesh(layers, 2);
+  engine.create_mesh(minimap, 2);
+  engine.create_mesh(minimodel, 2);
+  return first;
 }
 
 int main(int /*argc*/, char* /*argv*/ []) {
   std::unique_ptr<ns::IEngine, void (*)(ns::IEngine*)> engine(
       ns::create_engine(), ns::delete_engine);
-  std::string init_result = engine->init(read_config("keys.txt"));
+  std::string init_result = engine->init(read_config(*engine, "keys.txt"));
   if (!init_result.empty()) return EXIT_FAILURE;
 
+  const ns::Asset_view vertexes = engine->load_asset("vertexes.txt");
+  assert(vertexes.data != nullptr);
+  float koef_minimap = (float)(1) / 4;
+  float koef_model = (float)(1) / 5;
+  asset_streambuf buffer(vertexes);
+  std::istream file(&buffer);
+  ns::Triangle_2 tr1;
+  ns::Triangle_2 tr2;
+  file >> koef_minimap >> koef_model >> tr1 >> tr2;
+  tr1.init(koef_model);
+  tr2.init(koef_model);
+  const size_t meshes = make_meshes(*engine, tr1, tr2, koef_minimap);
+  const size_t layers = meshes;
+  const size_t minimap = meshes + 1;
+  const size_t minimodel = meshes + 2;
+  float x = (1 - koef_model) / 2;
+
   bool continue_loop = true;
   while (continue_loop) {
     ns::Event event;
@@ -38,32 +95,20 @@ int main(int /*argc*/, char* /*argv*/ []) {
       }
     }
 
-    float koef_minimap = (float)(1) / 4;
-    float koef_model = (float)(1) / 5;
-
-    std::ifstream file("vertexes.txt");
-    assert(!!file);
-    ns::Triangle_2 tr1;
-    ns::Triangle_2 tr2;
-    file >> koef_minimap >> koef_model >> tr1 >> tr2;
-    float x = (1 - koef_model) / 2;
-
-    tr1.init(koef_model);
-    tr2.init(koef_model);
+    // The meshes stay in the GPU, only the scroll of the background and
+    // the model on the minimap that follows it change.
     float time = engine->get_time();
     float s = sin(time) * x;
     float c = cos(time) * x;
+    ns::Mesh_transform scroll;
+    scroll.uv_offset = ns::Vertex(c, s);
+    ns::Mesh_transform follow;
+    follow.offset = ns::Vertex(c * koef_minimap, s * koef_minimap);
 
-    for (auto& v : tr1.t_back) {
-      v.x += c;
-      v.y += s;
-    }
-    for (auto& v : tr2.t_back) {
-      v.x += c;
-      v.y += s;
-    }
-
-    engine->render_quad(tr1, tr2, koef_minimap);
+    engine->render_layered_mesh(layers, scroll);
+    engine->render_mesh(minimap, ns::Texture::back, ns::Mesh_transform());
+    engine->render_mesh(minimodel, ns::Texture::model, follow);
+    engine->render_mesh(minimap, ns::Texture::up, ns::Mesh_transform());
 
     engine->swap_buffers();
   }
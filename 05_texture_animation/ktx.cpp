@@ -0,0 +1,122 @@
+#include "ktx.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+namespace ns {
+
+namespace {
+
+const unsigned char ktx_identifier[12] = {0xAB, 0x4B, 0x54, 0x58, 0x20, 0x31,
+                                          0x31, 0xBB, 0x0D, 0x0A, 0x1A, 0x0A};
+const uint32_t ktx_endianness = 0x04030201;
+
+struct ktx_header {
+  unsigned char identifier[12];
+  uint32_t endianness;
+  uint32_t gl_type;
+  uint32_t gl_type_size;
+  uint32_t gl_format;
+  uint32_t gl_internal_format;
+  uint32_t gl_base_internal_format;
+  uint32_t pixel_width;
+  uint32_t pixel_height;
+  uint32_t pixel_depth;
+  uint32_t array_elements;
+  uint32_t faces;
+  uint32_t mipmap_levels;
+  uint32_t key_value_size;
+};
+
+size_t padded4(size_t size) { return (size + 3) & ~size_t(3); }
+
+}  // namespace
+
+bool parse_ktx(const unsigned char* data, size_t size, ktx_texture& texture) {
+  ktx_header header;
+  if (size < sizeof(header)) return false;
+  std::memcpy(&header, data, sizeof(header));
+  if (std::memcmp(header.identifier, ktx_identifier,
+                  sizeof(ktx_identifier)) != 0 ||
+      header.endianness != ktx_endianness || header.pixel_width == 0 ||
+      header.pixel_height == 0 || header.pixel_depth != 0 ||
+      header.array_elements != 0 || header.faces != 1 ||
+      header.mipmap_levels > 32) {
+    return false;
+  }
+  texture.gl_type = header.gl_type;
+  texture.gl_format = header.gl_format;
+  texture.gl_internal_format = header.gl_internal_format;
+  texture.gl_base_internal_format = header.gl_base_internal_format;
+  texture.width = header.pixel_width;
+  texture.height = header.pixel_height;
+  texture.levels.clear();
+
+  size_t offset = sizeof(header);
+  if (header.key_value_size > size - offset) return false;
+  offset += header.key_value_size;  // nothing in it is needed
+  // 0 levels asks for them to be generated from the first
+  for (uint32_t i = 0; i < std::max<uint32_t>(header.mipmap_levels, 1);
+       ++i) {
+    uint32_t image_size;
+    if (size - offset < sizeof(image_size)) return false;
+    std::memcpy(&image_size, data + offset, sizeof(image_size));
+    offset += sizeof(image_size);
+    if (image_size > size - offset) return false;
+    ktx_texture::level level;
+    level.data = data + offset;
+    level.size = image_size;
+    texture.levels.push_back(level);
+    offset += padded4(image_size);
+    if (offset > size) offset = size;  // the padding of the last may be cut
+  }
+  return true;
+}
+
+bool write_ktx(const std::string& path, uint32_t gl_internal_format,
+               uint32_t gl_base_internal_format, uint32_t width,
+               uint32_t height,
+               const std::vector<std::vector<unsigned char>>& levels,
+               bool bottom_up) {
+  // KTX assumes the first row at the bottom, as GL does, without the key,
+  // which is written all the same for the tools that don't
+  static const char orientation[] = "KTXorientation\0S=r,T=u";
+  static const char orientation_top_down[] = "KTXorientation\0S=r,T=d";
+  const char* key_value = bottom_up ? orientation : orientation_top_down;
+  const uint32_t key_value_size = sizeof(orientation);  // with the last 0
+  const uint32_t padded_size = static_cast<uint32_t>(padded4(key_value_size));
+
+  ktx_header header;
+  std::memcpy(header.identifier, ktx_identifier, sizeof(ktx_identifier));
+  header.endianness = ktx_endianness;
+  header.gl_type = 0;
+  header.gl_type_size = 1;
+  header.gl_format = 0;
+  header.gl_internal_format = gl_internal_format;
+  header.gl_base_internal_format = gl_base_internal_format;
+  header.pixel_width = width;
+  header.pixel_height = height;
+  header.pixel_depth = 0;
+  header.array_elements = 0;
+  header.faces = 1;
+  header.mipmap_levels = static_cast<uint32_t>(levels.size());
+  header.key_value_size = sizeof(uint32_t) + padded_size;
+
+  std::ofstream ofs(path, std::ios_base::binary);
+  const char padding[4] = {};
+  ofs.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char*>(&key_value_size),
+            sizeof(key_value_size));
+  ofs.write(key_value, key_value_size);
+  ofs.write(padding, padded_size - key_value_size);
+  for (const std::vector<unsigned char>& level : levels) {
+    const uint32_t image_size = static_cast<uint32_t>(level.size());
+    ofs.write(reinterpret_cast<const char*>(&image_size), sizeof(image_size));
+    ofs.write(reinterpret_cast<const char*>(level.data()), level.size());
+    ofs.write(padding, padded4(level.size()) - level.size());
+  }
+  return static_cast<bool>(ofs);
+}
+
+}  // namespace ns
@@ -0,0 +1,40 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ns {
+
+// A 2D texture in a KTX 1 file, the Khronos container of textures ready
+// for GL: its formats are GL enums and its mip levels are what
+// glCompressedTexImage2D or glTexImage2D take. Only files of the byte
+// order of the machine, one face and no array are read.
+struct ktx_texture {
+  struct level {
+    const unsigned char* data = nullptr;  // into the file
+    size_t size = 0;
+  };
+
+  uint32_t gl_type = 0;  // 0 for compressed formats
+  uint32_t gl_format = 0;
+  uint32_t gl_internal_format = 0;
+  uint32_t gl_base_internal_format = 0;
+  uint32_t width = 0;
+  uint32_t height = 0;
+  std::vector<level> levels;
+};
+
+// Reads the header and finds the levels of a KTX file, false if it isn't a
+// 2D texture that fits in size bytes.
+bool parse_ktx(const unsigned char* data, size_t size, ktx_texture& texture);
+
+// Writes a texture of a compressed format, the levels from the largest,
+// with the rows from the bottom up when bottom_up, as GL wants them.
+bool write_ktx(const std::string& path, uint32_t gl_internal_format,
+               uint32_t gl_base_internal_format, uint32_t width,
+               uint32_t height,
+               const std::vector<std::vector<unsigned char>>& levels,
+               bool bottom_up);
+
+}  // namespace ns
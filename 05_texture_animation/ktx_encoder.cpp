@@ -0,0 +1,106 @@
+// Converts PNG images into block-compressed KTX files for the engine, which
+// loads name.ktx in place of name.png when it is there. The pixels are
+// prepared as the engine does for its PNGs: premultiplied alpha, the rows
+// from the bottom up and a mip chain down to 1x1. Opaque images are
+// compressed to BC1, 8 times smaller than RGBA8, the others to BC3, 4
+// times smaller. The blocks of each level are shared by the threads.
+//
+// usage: ktx_encoder [-t threads] image.png...
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "block_compression.h"
+#include "ktx.h"
+#include "mipmap.h"
+#include "picopng.cpp"
+
+namespace {
+
+// GL_RGB and GL_RGBA, the base formats of the compressed ones
+const uint32_t gl_rgb = 0x1907;
+const uint32_t gl_rgba = 0x1908;
+
+bool read_file(const std::string& path, std::vector<unsigned char>& content) {
+  std::ifstream ifs(path, std::ios_base::binary);
+  if (!ifs) return false;
+  ifs.seekg(0, std::ios_base::end);
+  const size_t size = ifs.tellg();
+  content.resize(size);
+  ifs.seekg(0, std::ios_base::beg);
+  ifs.read(reinterpret_cast<char*>(content.data()), size);
+  return static_cast<bool>(ifs);
+}
+
+std::string ktx_path(const std::string& png_path) {
+  return png_path.substr(0, png_path.rfind('.')) + ".ktx";
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int arg = 1;
+  unsigned threads = 0;  // one per core
+  if (arg + 1 < argc && std::strcmp(argv[arg], "-t") == 0) {
+    threads = static_cast<unsigned>(std::atoi(argv[arg + 1]));
+    arg += 2;
+  }
+  if (arg == argc) {
+    std::cerr << "usage: ktx_encoder [-t threads] image.png..." << std::endl;
+    return 1;
+  }
+
+  picopng::PngDecoder decoder;
+  decoder.setPremultiply(true);
+  decoder.setFlip(true);
+  std::vector<unsigned char> file, pixels;
+  for (; arg < argc; ++arg) {
+    const std::string path = argv[arg];
+    unsigned long width, height;
+    int error = 0;
+    if (!read_file(path, file) ||
+        (error = decoder.decode(pixels, width, height, file.data(),
+                                file.size(), true, true)) != 0) {
+      std::cerr << "error: can't decode " << path << ", " << error
+                << std::endl;
+      return 1;
+    }
+
+    const auto start = std::chrono::steady_clock::now();
+    const ns::mip_chain chain = ns::build_mip_chain(
+        pixels.data(), width, height, ns::pixel_format::rgba8, threads);
+    const ns::block_format format =
+        ns::choose_block_format(pixels.data(), width * height);
+    std::vector<std::vector<unsigned char>> levels;
+    size_t size = 0;
+    for (size_t i = 0; i < chain.levels.size(); ++i) {
+      levels.push_back(ns::compress_blocks(chain.data(i),
+                                           chain.levels[i].width,
+                                           chain.levels[i].height, format,
+                                           threads));
+      size += levels.back().size();
+    }
+    const std::chrono::duration<double, std::milli> time =
+        std::chrono::steady_clock::now() - start;
+
+    const bool bc1 = format == ns::block_format::bc1;
+    if (!ns::write_ktx(ktx_path(path),
+                       bc1 ? ns::gl_compressed_rgb_s3tc_dxt1
+                           : ns::gl_compressed_rgba_s3tc_dxt5,
+                       bc1 ? gl_rgb : gl_rgba, width, height, levels, true)) {
+      std::cerr << "error: can't write " << ktx_path(path) << std::endl;
+      return 1;
+    }
+    std::clog << path << ": " << width << 'x' << height << ", "
+              << chain.levels.size() << " levels of "
+              << (bc1 ? "BC1 " : "BC3 ") << size << " bytes, "
+              << static_cast<double>(chain.pixels.size()) / size
+              << "x smaller, in " << time.count() << " ms" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,139 @@
+#include "lz4.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace ns {
+
+namespace {
+
+const size_t min_match = 4;
+const size_t last_literals = 5;  // a block ends with as many literals
+const size_t match_limit = 12;   // and no match starts closer to its end
+const size_t max_offset = 65535;
+const int hash_bits = 16;
+
+uint32_t load32(const unsigned char* p) {
+  uint32_t value;
+  std::memcpy(&value, p, 4);
+  return value;
+}
+
+uint32_t hash32(uint32_t sequence) {
+  return (sequence * 2654435761u) >> (32 - hash_bits);
+}
+
+// The lengths of 15 and more go on in bytes of 255 and one of less.
+unsigned char* write_length(unsigned char* out, size_t length) {
+  for (length -= 15; length >= 255; length -= 255) *out++ = 255;
+  *out++ = static_cast<unsigned char>(length);
+  return out;
+}
+
+bool read_length(const unsigned char*& in, const unsigned char* end,
+                 size_t& length) {
+  unsigned char byte;
+  do {
+    if (in == end) return false;
+    byte = *in++;
+    length += byte;
+  } while (byte == 255);
+  return true;
+}
+
+// A sequence: the literals, then the match that follows them, if any.
+unsigned char* write_sequence(unsigned char* out, const unsigned char* literals,
+                              size_t literal_count, size_t offset,
+                              size_t match_length) {
+  unsigned char* token = out++;
+  *token = static_cast<unsigned char>(std::min<size_t>(literal_count, 15) << 4);
+  if (literal_count >= 15) out = write_length(out, literal_count);
+  std::memcpy(out, literals, literal_count);
+  out += literal_count;
+  if (match_length == 0) return out;  // the last sequence
+  *out++ = static_cast<unsigned char>(offset);
+  *out++ = static_cast<unsigned char>(offset >> 8);
+  const size_t length = match_length - min_match;
+  *token |= static_cast<unsigned char>(std::min<size_t>(length, 15));
+  if (length >= 15) out = write_length(out, length);
+  return out;
+}
+
+}  // namespace
+
+size_t lz4_compress_bound(size_t size) { return size + size / 255 + 16; }
+
+// Greedy: the match taken at each position is the last one seen of its 4
+// bytes, found through a hash table, and is as long as it goes.
+size_t lz4_compress(const unsigned char* in, size_t size, unsigned char* out) {
+  unsigned char* const start = out;
+  size_t anchor = 0;  // the first literal not written
+  if (size > match_limit) {
+    std::vector<uint32_t> table(size_t(1) << hash_bits, 0);  // position + 1
+    const size_t match_end = size - last_literals;
+    for (size_t i = 0; i + match_limit < size;) {
+      const uint32_t sequence = load32(in + i);
+      uint32_t& entry = table[hash32(sequence)];
+      const size_t candidate = entry;
+      entry = static_cast<uint32_t>(i + 1);
+      if (candidate == 0 || i - (candidate - 1) > max_offset ||
+          load32(in + candidate - 1) != sequence) {
+        ++i;
+        continue;
+      }
+      const size_t match = candidate - 1;
+      size_t length = min_match;
+      while (i + length < match_end && in[match + length] == in[i + length]) {
+        ++length;
+      }
+      out = write_sequence(out, in + anchor, i - anchor, i - match, length);
+      i += length;
+      anchor = i;
+    }
+  }
+  out = write_sequence(out, in + anchor, size - anchor, 0, 0);
+  return static_cast<size_t>(out - start);
+}
+
+bool lz4_decompress(const unsigned char* in, size_t in_size,
+                    unsigned char* out, size_t out_size) {
+  const unsigned char* const in_end = in + in_size;
+  unsigned char* const out_start = out;
+  unsigned char* const out_end = out + out_size;
+  for (;;) {
+    if (in == in_end) return false;
+    const unsigned token = *in++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !read_length(in, in_end, literals)) return false;
+    if (literals > static_cast<size_t>(in_end - in) ||
+        literals > static_cast<size_t>(out_end - out)) {
+      return false;
+    }
+    std::memcpy(out, in, literals);
+    in += literals;
+    out += literals;
+    if (in == in_end) return out == out_end;  // the last sequence
+
+    if (in_end - in < 2) return false;
+    const size_t offset = in[0] | in[1] << 8;
+    in += 2;
+    size_t length = token & 15;
+    if (length == 15 && !read_length(in, in_end, length)) return false;
+    length += min_match;
+    if (offset == 0 || offset > static_cast<size_t>(out - out_start) ||
+        length > static_cast<size_t>(out_end - out)) {
+      return false;
+    }
+    const unsigned char* match = out - offset;
+    if (offset >= length) {
+      std::memcpy(out, match, length);
+      out += length;
+    } else {  // overlapping, it repeats the last offset bytes
+      for (size_t i = 0; i < length; ++i) *out++ = *match++;
+    }
+  }
+}
+
+}  // namespace ns
@@ -0,0 +1,21 @@
+#pragma once
+#include <cstddef>
+
+namespace ns {
+
+// The LZ4 block format, without the frame around it: what the reference
+// LZ4_compress_default and LZ4_decompress_safe make and read.
+
+// The most bytes compressing size bytes can take.
+size_t lz4_compress_bound(size_t size);
+
+// Compresses size bytes into out, which has room for lz4_compress_bound of
+// them, and returns how many it took.
+size_t lz4_compress(const unsigned char* in, size_t size, unsigned char* out);
+
+// Decompresses a block into exactly out_size bytes, false if it is corrupt
+// or doesn't make that many.
+bool lz4_decompress(const unsigned char* in, size_t in_size,
+                    unsigned char* out, size_t out_size);
+
+}  // namespace ns
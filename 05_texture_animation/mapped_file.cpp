@@ -0,0 +1,95 @@
+#include "mapped_file.h"
+
+#include <utility>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ns {
+
+mapped_file::mapped_file(const std::string& path) {
+#ifdef _WIN32
+  HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr);
+  if (file == INVALID_HANDLE_VALUE) return;
+  LARGE_INTEGER size;
+  FILETIME write_time;
+  if (GetFileSizeEx(file, &size) && size.QuadPart > 0 &&
+      GetFileTime(file, nullptr, nullptr, &write_time)) {
+    HANDLE mapping =
+        CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (mapping != nullptr) {
+      void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      if (view != nullptr) {
+        address = static_cast<const unsigned char*>(view);
+        length = static_cast<size_t>(size.QuadPart);
+        time = static_cast<int64_t>(
+            (static_cast<uint64_t>(write_time.dwHighDateTime) << 32) |
+            write_time.dwLowDateTime);
+      }
+      CloseHandle(mapping);  // the view keeps it
+    }
+  }
+  CloseHandle(file);
+#else
+  const int file = open(path.c_str(), O_RDONLY);
+  if (file < 0) return;
+  struct stat info;
+  if (fstat(file, &info) == 0 && info.st_size > 0) {
+    void* view = mmap(nullptr, static_cast<size_t>(info.st_size), PROT_READ,
+                      MAP_PRIVATE, file, 0);
+    if (view != MAP_FAILED) {
+      address = static_cast<const unsigned char*>(view);
+      length = static_cast<size_t>(info.st_size);
+      // in nanoseconds, so that a file written twice in a second differs
+#ifdef __APPLE__
+      const struct timespec& write_time = info.st_mtimespec;
+#else
+      const struct timespec& write_time = info.st_mtim;
+#endif
+      time = static_cast<int64_t>(write_time.tv_sec) * 1000000000 +
+             write_time.tv_nsec;
+    }
+  }
+  close(file);  // the mapping keeps it
+#endif
+}
+
+mapped_file::mapped_file(mapped_file&& other) noexcept
+    : address(other.address), length(other.length), time(other.time) {
+  other.address = nullptr;
+  other.length = 0;
+}
+
+mapped_file& mapped_file::operator=(mapped_file&& other) noexcept {
+  if (this != &other) {
+    unmap();
+    std::swap(address, other.address);
+    std::swap(length, other.length);
+    std::swap(time, other.time);
+  }
+  return *this;
+}
+
+mapped_file::~mapped_file() { unmap(); }
+
+void mapped_file::unmap() {
+  if (address == nullptr) return;
+#ifdef _WIN32
+  UnmapViewOfFile(address);
+#else
+  munmap(const_cast<unsigned char*>(address), length);
+#endif
+  address = nullptr;
+  length = 0;
+}
+
+}  // namespace ns
@@ -0,0 +1,34 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ns {
+
+// A file mapped read-only into memory for as long as the object lives. Its
+// pages are read from the disk, or the page cache, as they are touched.
+class mapped_file {
+ public:
+  mapped_file() = default;
+  explicit mapped_file(const std::string& path);  // empty if it can't be
+  mapped_file(mapped_file&& other) noexcept;
+  mapped_file& operator=(mapped_file&& other) noexcept;
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+  ~mapped_file();
+
+  bool empty() const { return address == nullptr; }
+  const unsigned char* data() const { return address; }
+  size_t size() const { return length; }
+  // when it was last written, in units that only compare with each other
+  int64_t mtime() const { return time; }
+
+ private:
+  void unmap();
+
+  const unsigned char* address = nullptr;
+  size_t length = 0;
+  int64_t time = 0;
+};
+
+}  // namespace ns
@@ -0,0 +1,245 @@
+#include "mipmap.h"
+
+#include <algorithm>
+#include <cstring>
+#include <thread>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define MIPMAP_SSE2
+#endif
+
+namespace ns {
+
+size_t pixel_size(pixel_format format) {
+  switch (format) {
+    case pixel_format::rgba8:
+      return 4;
+    case pixel_format::r8:
+      return 1;
+    default:
+      return 2;
+  }
+}
+
+size_t mip_level_count(size_t width, size_t height) {
+  size_t count = 1;
+  for (size_t size = std::max(width, height); size > 1; size /= 2) {
+    ++count;
+  }
+  return count;
+}
+
+std::vector<mip_chain::level> mip_levels(size_t width, size_t height,
+                                         pixel_format format) {
+  std::vector<mip_chain::level> levels(mip_level_count(width, height));
+  size_t offset = 0;
+  for (mip_chain::level& level : levels) {
+    level.width = width;
+    level.height = height;
+    level.offset = offset;
+    offset += width * height * pixel_size(format);
+    width = std::max<size_t>(1, width / 2);
+    height = std::max<size_t>(1, height / 2);
+  }
+  return levels;
+}
+
+namespace {
+
+// The average of the 2x2 blocks of 8-bit channels, 16 bytes of each of the
+// two rows at a time: the sums are taken in 16 bits, down the columns first
+// and then of the pixel pairs, which sit in even and odd positions.
+#ifdef MIPMAP_SSE2
+size_t reduce_bytes_sse2(unsigned char* out, const unsigned char* row0,
+                         const unsigned char* row1, size_t out_bytes,
+                         size_t channels) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i ones = _mm_set1_epi16(1);
+  const __m128i two = _mm_set1_epi16(2);
+  size_t i = 0;
+  for (; i + 8 <= out_bytes; i += 8) {
+    const __m128i a = _mm_loadu_si128((const __m128i*)(row0 + 2 * i));
+    const __m128i b = _mm_loadu_si128((const __m128i*)(row1 + 2 * i));
+    __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero),
+                               _mm_unpacklo_epi8(b, zero));
+    __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero),
+                               _mm_unpackhi_epi8(b, zero));
+    __m128i sum;
+    if (channels == 4) {  // 64 bits per pixel
+      sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+                          _mm_unpackhi_epi64(lo, hi));
+    } else if (channels == 2) {  // 32 bits per pixel
+      lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+      hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+      sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi),
+                          _mm_unpackhi_epi64(lo, hi));
+    } else {  // 16 bits per pixel, pairs added by madd
+      sum = _mm_packs_epi32(_mm_madd_epi16(lo, ones),
+                            _mm_madd_epi16(hi, ones));
+    }
+    sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+    _mm_storel_epi64((__m128i*)(out + i), _mm_packus_epi16(sum, sum));
+  }
+  return i;
+}
+#endif
+
+// The fields of the 16-bit formats, from the highest.
+struct packed_fields {
+  int count;
+  int shift[4];
+  unsigned mask[4];
+};
+
+const packed_fields rgb565_fields = {3, {11, 5, 0, 0}, {31, 63, 31, 0}};
+const packed_fields rgba4444_fields = {4, {12, 8, 4, 0}, {15, 15, 15, 15}};
+
+unsigned short load16(const unsigned char* p) {
+  unsigned short value;
+  std::memcpy(&value, p, 2);
+  return value;
+}
+
+// Makes a row of the next level from rows 2y and 2y + 1 of the level before,
+// which has src_width pixels per row. A level 1 pixel wide or high averages
+// its single column or row with itself.
+void reduce_row(unsigned char* out, const unsigned char* row0,
+                const unsigned char* row1, size_t width, size_t src_width,
+                pixel_format format) {
+  const size_t size = pixel_size(format);
+  const size_t right = src_width > 1 ? size : 0;  // of the second column
+  if (format == pixel_format::rgb565 || format == pixel_format::rgba4444) {
+    const packed_fields& fields =
+        format == pixel_format::rgb565 ? rgb565_fields : rgba4444_fields;
+    for (size_t x = 0; x < width; ++x) {
+      const unsigned char* p0 = row0 + 2 * x * size;
+      const unsigned char* p1 = row1 + 2 * x * size;
+      const unsigned short block[4] = {load16(p0), load16(p0 + right),
+                                       load16(p1), load16(p1 + right)};
+      unsigned value = 0;
+      for (int f = 0; f < fields.count; ++f) {
+        unsigned sum = 2;
+        for (unsigned short pixel : block) {
+          sum += (pixel >> fields.shift[f]) & fields.mask[f];
+        }
+        value |= (sum >> 2) << fields.shift[f];
+      }
+      const unsigned short word = static_cast<unsigned short>(value);
+      std::memcpy(out + x * size, &word, 2);
+    }
+    return;
+  }
+
+  size_t i = 0;
+  const size_t out_bytes = width * size;
+#ifdef MIPMAP_SSE2
+  if (src_width > 1) {
+    i = reduce_bytes_sse2(out, row0, row1, out_bytes, size);
+  }
+#endif
+  for (; i < out_bytes; ++i) {
+    const size_t x = i / size, c = i % size;
+    const size_t left = 2 * x * size + c;
+    out[i] = static_cast<unsigned char>(
+        (row0[left] + row0[left + right] + row1[left] + row1[left + right] +
+         2) >>
+        2);
+  }
+}
+
+void reduce_rows(const mip_chain& chain, unsigned char* pixels, size_t level,
+                 size_t begin, size_t end) {
+  const mip_chain::level& src = chain.levels[level - 1];
+  const mip_chain::level& dst = chain.levels[level];
+  const size_t size = pixel_size(chain.format);
+  const size_t src_row = src.width * size;
+  for (size_t y = begin; y < end; ++y) {
+    const unsigned char* row0 = pixels + src.offset + 2 * y * src_row;
+    const unsigned char* row1 = src.height > 1 ? row0 + src_row : row0;
+    reduce_row(pixels + dst.offset + y * dst.width * size, row0, row1,
+               dst.width, src.width, chain.format);
+  }
+}
+
+// in mip_row_builder::pending_y, for a level with no row waiting
+const size_t no_row = static_cast<size_t>(-1);
+
+}  // namespace
+
+mip_chain build_mip_chain(const unsigned char* pixels, size_t width,
+                          size_t height, pixel_format format,
+                          unsigned threads) {
+  mip_chain chain;
+  chain.format = format;
+  chain.levels = mip_levels(width, height, format);
+  const mip_chain::level& last = chain.levels.back();
+  const size_t size = pixel_size(format);
+  chain.pixels.resize(last.offset + size);  // the last level is 1x1
+  std::memcpy(chain.pixels.data(), pixels, width * height * size);
+  build_mip_levels(chain, threads);
+  return chain;
+}
+
+void build_mip_levels(mip_chain& chain, unsigned threads) {
+  if (threads == 0) {
+    threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+  // a thread is only worth starting for a share of some 64K pixels
+  const size_t min_share = 1 << 16;
+  for (size_t level = 1; level < chain.levels.size(); ++level) {
+    const mip_chain::level& dst = chain.levels[level];
+    const size_t shares = std::min<size_t>(
+        threads, std::max<size_t>(1, dst.width * dst.height / min_share));
+    std::vector<std::thread> workers;
+    for (size_t share = 1; share < shares; ++share) {
+      workers.emplace_back(reduce_rows, std::cref(chain), chain.pixels.data(),
+                           level, dst.height * share / shares,
+                           dst.height * (share + 1) / shares);
+    }
+    reduce_rows(chain, chain.pixels.data(), level, 0, dst.height / shares);
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
+  }
+}
+
+mip_row_builder::mip_row_builder(size_t width, size_t height,
+                                 pixel_format format, row_sink sink)
+    : format(format),
+      sink(std::move(sink)),
+      chain(mip_levels(width, height, format)),
+      pending(chain.size()),
+      pending_y(chain.size(), no_row),
+      reduced(chain.size()) {
+  for (size_t level = 0; level + 1 < chain.size(); ++level) {
+    pending[level].resize(chain[level].width * pixel_size(format));
+    reduced[level].resize(chain[level + 1].width * pixel_size(format));
+  }
+}
+
+void mip_row_builder::add(size_t level, size_t y, const unsigned char* row) {
+  sink(level, y, row);
+  if (level + 1 == chain.size()) return;
+  const mip_chain::level& src = chain[level];
+  const mip_chain::level& dst = chain[level + 1];
+  const unsigned char* row0 = row;
+  const unsigned char* row1 = row;
+  if (src.height > 1) {
+    // the last row of an odd height has no pair and is left out, as
+    // build_mip_chain does
+    if (y / 2 >= dst.height) return;
+    if (pending_y[level] != (y ^ 1)) {
+      std::memcpy(pending[level].data(), row, pending[level].size());
+      pending_y[level] = y;
+      return;
+    }
+    pending_y[level] = no_row;
+    (y % 2 == 0 ? row1 : row0) = pending[level].data();
+  }
+  reduce_row(reduced[level].data(), row0, row1, dst.width, src.width, format);
+  add(level + 1, y / 2, reduced[level].data());
+}
+
+}  // namespace ns
@@ -0,0 +1,90 @@
+#pragma once
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+namespace ns {
+
+// How the pixels of a texture are stored, as the PNG decoder gives them.
+enum class pixel_format {
+  rgba8,     // 4 bytes
+  rgb565,    // 16-bit words in native byte order
+  rgba4444,  // 16-bit words in native byte order
+  rg8,       // 2 bytes, luminance and alpha
+  r8         // 1 byte, luminance
+};
+
+size_t pixel_size(pixel_format format);
+
+// The number of levels from width x height down to 1x1.
+size_t mip_level_count(size_t width, size_t height);
+
+// The mipmap levels of an image, each half the size of the one before,
+// rounded down, to 1x1. They are kept one after the other in one buffer, so
+// that the chain can be stored and uploaded as it is.
+struct mip_chain {
+  struct level {
+    size_t width = 0;
+    size_t height = 0;
+    size_t offset = 0;  // of its first pixel in pixels
+  };
+
+  const unsigned char* data(size_t i) const {
+    return pixels.data() + levels[i].offset;
+  }
+
+  pixel_format format = pixel_format::rgba8;
+  std::vector<level> levels;  // level 0 is the image itself
+  std::vector<unsigned char> pixels;
+};
+
+// The sizes of the levels of a mip chain of an image and where they are in
+// its buffer, which ends where the last one does.
+std::vector<mip_chain::level> mip_levels(size_t width, size_t height,
+                                         pixel_format format);
+
+// Builds the mip chain of an image whose rows of width pixels follow each
+// other without padding. Each pixel of a level is the rounded average of a
+// block of 2x2 pixels of the level before, which keeps the colors right for
+// premultiplied alpha. The rows of large levels are shared by threads, 0
+// for one per core.
+mip_chain build_mip_chain(const unsigned char* pixels, size_t width,
+                          size_t height, pixel_format format,
+                          unsigned threads = 0);
+
+// Builds the levels after the first of a chain laid out by mip_levels, in
+// place, from its first level already in its pixels, so that an image can
+// be decoded straight into the chain.
+void build_mip_levels(mip_chain& chain, unsigned threads = 0);
+
+// Builds the same mip chain from the rows of an image as they are decoded,
+// from the top down or from the bottom up, without the image or the chain
+// in memory. A row of a level is only kept until the row it is averaged
+// with comes, and each finished row of every level is passed to the sink,
+// which is called with the level, the row and its pixels.
+class mip_row_builder {
+ public:
+  typedef std::function<void(size_t, size_t, const unsigned char*)> row_sink;
+
+  mip_row_builder(size_t width, size_t height, pixel_format format,
+                  row_sink sink);
+
+  // Row y of the image, of width pixels.
+  void add_row(size_t y, const unsigned char* row) { add(0, y, row); }
+
+  const std::vector<mip_chain::level>& levels() const { return chain; }
+
+ private:
+  void add(size_t level, size_t y, const unsigned char* row);
+
+  pixel_format format;
+  row_sink sink;
+  std::vector<mip_chain::level> chain;
+  // For each level, a row waiting for the other one of its pair and the
+  // row of the next level made of them.
+  std::vector<std::vector<unsigned char>> pending;
+  std::vector<size_t> pending_y;
+  std::vector<std::vector<unsigned char>> reduced;
+};
+
+}  // namespace ns
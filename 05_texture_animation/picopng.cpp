@@ -1,919 +1,2945 @@
+// picoPNG version 20101224
+// Copyright (c) 2005-2010 Lode Vandevenne
+//
+// This software is provided 'as-is', without any express or implied
+// warranty. In no event will the authors be held liable for any damages
+// arising from the use of this software.
+//
+// Permission is granted to anyone to use this software for any purpose,
+// including commercial applications, and to alter it and redistribute it
+// freely, subject to the following restrictions:
+//
+//     1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software
+//     in a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//     2. Altered source versions must be plainly marked as such, and must not
+//     be misrepresented as being the original software.
+//     3. This notice may not be removed or altered from any source
+//     distribution.
+//
+// This is an altered version of picoPNG, modified for the engine. See the
+// version control history for the list of changes.
+
+// picoPNG is a small PNG decoder in a single source file. Use picoPNG for
+// programs that need only 1 .cpp file. It's very limited, it can convert a PNG
+// to raw pixel data either converted to 32-bit RGBA color or with no color
+// conversion at all. For anything more complex, another tiny library is
+// available: LodePNG (lodepng.c(pp)), which is a single source and header
+// file. Apologies for the compact code style, it's to make this tiny.
+
+#include <cstring>
 #include <vector>
 
-/*
-decodePNG: The picoPNG function, decodes a PNG file buffer in memory, into a raw
-pixel buffer. out_image: output parameter, this will contain the raw pixels
-after decoding. By default the output is 32-bit RGBA color. The std::vector is
-automatically resized to the correct size. image_width: output_parameter, this
-will contain the width of the image in pixels. image_height: output_parameter,
-this will contain the height of the image in pixels. in_png: pointer to the
-buffer of the PNG file in memory. To get it from a file on disk, load it and
-store it in a memory buffer yourself first. in_size: size of the input PNG file
-in bytes. convert_to_rgba32: optional parameter, true by default. Set to true to
-get the output in RGBA 32-bit (8 bit per channel) color format no matter what
-color type the original PNG image had. This gives predictable, useable data from
-any random input PNG. Set to false to do no color conversion at all. The result
-then has the same data type as the PNG image, which can range from 1 bit to 64
-bits per pixel. Information about the color type or palette colors are not
-provided. You need to know this information yourself to be able to use the data
-so this only works for trusted PNG files. Use LodePNG instead of picoPNG if you
-need this information. return: 0 if success, not 0 if some error occured.
-*/
-int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
-              unsigned long& image_height, const unsigned char* in_png,
-              size_t in_size, bool convert_to_rgba32 = true) {
-  // picoPNG version 20101224
-  // Copyright (c) 2005-2010 Lode Vandevenne
-  //
-  // This software is provided 'as-is', without any express or implied
-  // warranty. In no event will the authors be held liable for any damages
-  // arising from the use of this software.
-  //
-  // Permission is granted to anyone to use this software for any purpose,
-  // including commercial applications, and to alter it and redistribute it
-  // freely, subject to the following restrictions:
-  //
-  //     1. The origin of this software must not be misrepresented; you must not
-  //     claim that you wrote the original software. If you use this software
-  //     in a product, an acknowledgment in the product documentation would be
-  //     appreciated but is not required.
-  //     2. Altered source versions must be plainly marked as such, and must not
-  //     be misrepresented as being the original software.
-  //     3. This notice may not be removed or altered from any source
-  //     distribution.
-
-  // picoPNG is a PNG decoder in one C++ function of around 500 lines. Use
-  // picoPNG for programs that need only 1 .cpp file. Since it's a single
-  // function, it's very limited, it can convert a PNG to raw pixel data either
-  // converted to 32-bit RGBA color or with no color conversion at all. For
-  // anything more complex, another tiny library is available: LodePNG
-  // (lodepng.c(pp)), which is a single source and header file. Apologies for
-  // the compact code style, it's to make this tiny.
-
-  static const unsigned long LENBASE[29] = {
-      3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
-      31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
-  static const unsigned long LENEXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
-                                             1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
-                                             4, 4, 4, 4, 5, 5, 5, 5, 0};
-  static const unsigned long DISTBASE[30] = {
-      1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
-      33,   49,   65,   97,   129,  193,  257,  385,   513,   769,
-      1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
-  static const unsigned long DISTEXTRA[30] = {
-      0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
-      6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
-  static const unsigned long CLCL[19] = {
-      16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
-      11, 4,  12, 3, 13, 2, 14, 1, 15};  //code length code lengths
-  struct Zlib  // nested functions for zlib decompression
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || \
+    defined(_M_IX86)
+#define PICOPNG_X86
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define PICOPNG_TARGET(x)
+#else
+#define PICOPNG_TARGET(x) __attribute__((target(x)))
+#endif
+#endif
+
+namespace picopng {
+
+// Scanline unfiltering. The scalar code handles every filter type and pixel
+// size. SIMD kernels, selected at runtime from what the CPU supports, take
+// over filter types 1 to 4 for 3 and 4 bytes per pixel (8-bit RGB and RGBA),
+// where most of the decode time after inflate goes.
+
+enum SimdLevel { SIMD_NONE, SIMD_SSE2, SIMD_SSSE3, SIMD_AVX2 };
+
+typedef void (*UnfilterKernel)(unsigned char* recon,
+                               const unsigned char* scanline,
+                               const unsigned char* precon, size_t length);
+
+unsigned char paethPredictor(short a, short b,
+                             short c)  // Paeth predicter, used by PNG filter
+                                       // type 4
+{
+  short p = a + b - c, pa = p > a ? (p - a) : (a - p),
+        pb = p > b ? (p - b) : (b - p), pc = p > c ? (p - c) : (c - p);
+  return (unsigned char)((pa <= pb && pa <= pc) ? a : pb <= pc ? b : c);
+}
+
+void unfilterSubTail(unsigned char* recon, const unsigned char* scanline,
+                     size_t bytewidth, size_t i,
+                     size_t length) {  // scalar Sub from byte i to the end
+  for (; i < bytewidth && i < length; i++) recon[i] = scanline[i];
+  for (; i < length; i++) recon[i] = scanline[i] + recon[i - bytewidth];
+}
+
+#ifdef PICOPNG_X86
+// The kernels work in place (recon == scanline) and never touch memory
+// outside [0, length) of the three lines.
+
+PICOPNG_TARGET("sse2")
+static inline __m128i loadPixel(const unsigned char* p, size_t bytewidth) {
+  int v = 0;
+  std::memcpy(&v, p, bytewidth);
+  return _mm_cvtsi32_si128(v);
+}
+
+PICOPNG_TARGET("sse2")
+static inline void storePixel(unsigned char* p, __m128i v, size_t bytewidth) {
+  int t = _mm_cvtsi128_si32(v);
+  std::memcpy(p, &t, bytewidth);
+}
+
+PICOPNG_TARGET("sse2")
+static void unfilterUpSSE2(unsigned char* recon, const unsigned char* scanline,
+                           const unsigned char* precon, size_t length) {
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    __m128i b = _mm_loadu_si128((const __m128i*)(precon + i));
+    _mm_storeu_si128((__m128i*)(recon + i), _mm_add_epi8(x, b));
+  }
+  for (; i < length; i++) recon[i] = scanline[i] + precon[i];
+}
+
+PICOPNG_TARGET("sse2")
+static void unfilterSub4SSE2(unsigned char* recon,
+                             const unsigned char* scanline,
+                             const unsigned char*, size_t length) {
+  // prefix sum of the 4 pixels of each 16 byte block, plus the last pixel of
+  // the previous block
+  __m128i a = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(scanline + i));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 4));
+    x = _mm_add_epi8(x, _mm_slli_si128(x, 8));
+    x = _mm_add_epi8(x, a);
+    _mm_storeu_si128((__m128i*)(recon + i), x);
+    a = _mm_shuffle_epi32(x, 0xFF);
+  }
+  unfilterSubTail(recon, scanline, 4, i, length);
+}
+
+PICOPNG_TARGET("sse2")
+static inline __m128i unfilterSub3Block(const unsigned char* scanline,
+                                        __m128i a) {
+  // prefix sum of the 5 pixels in the first 15 bytes, byte 15 belongs to the
+  // next block and is passed through unchanged
+  const __m128i last = _mm_set_epi8(-1, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+                                    0, 0);
+  __m128i orig = _mm_loadu_si128((const __m128i*)scanline), x = orig;
+  x = _mm_add_epi8(x, _mm_slli_si128(x, 3));
+  x = _mm_add_epi8(x, _mm_slli_si128(x, 6));
+  x = _mm_add_epi8(x, _mm_slli_si128(x, 12));
+  x = _mm_add_epi8(x, a);
+  return _mm_or_si128(_mm_andnot_si128(last, x), _mm_and_si128(last, orig));
+}
+
+PICOPNG_TARGET("sse2")
+static void unfilterSub3SSE2(unsigned char* recon,
+                             const unsigned char* scanline,
+                             const unsigned char*, size_t length) {
+  __m128i a = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 15) {
+    __m128i x = unfilterSub3Block(scanline + i, a);
+    _mm_storeu_si128((__m128i*)(recon + i), x);
+    // broadcast the last pixel (bytes 12-14) to all 5 pixels
+    a = _mm_and_si128(_mm_srli_si128(x, 12), _mm_cvtsi32_si128(0xFFFFFF));
+    a = _mm_or_si128(a, _mm_slli_si128(a, 3));
+    a = _mm_or_si128(a, _mm_slli_si128(a, 6));
+    a = _mm_or_si128(a, _mm_slli_si128(a, 12));
+  }
+  unfilterSubTail(recon, scanline, 3, i, length);
+}
+
+PICOPNG_TARGET("ssse3")
+static void unfilterSub3SSSE3(unsigned char* recon,
+                              const unsigned char* scanline,
+                              const unsigned char*, size_t length) {
+  const __m128i broadcast = _mm_setr_epi8(12, 13, 14, 12, 13, 14, 12, 13, 14,
+                                          12, 13, 14, 12, 13, 14, -128);
+  __m128i a = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= length; i += 15) {
+    __m128i x = unfilterSub3Block(scanline + i, a);
+    _mm_storeu_si128((__m128i*)(recon + i), x);
+    a = _mm_shuffle_epi8(x, broadcast);
+  }
+  unfilterSubTail(recon, scanline, 3, i, length);
+}
+
+PICOPNG_TARGET("sse2")
+static inline void unfilterAvgSSE2(unsigned char* recon,
+                                   const unsigned char* scanline,
+                                   const unsigned char* precon, size_t length,
+                                   size_t bytewidth) {
+  // each pixel depends on the one before it, so this goes pixel by pixel
+  // with all channels at once. avg_epu8 rounds up, the low bit of a ^ b
+  // corrects it to the floor the filter uses.
+  const __m128i one = _mm_set1_epi8(1);
+  __m128i a = _mm_setzero_si128();
+  for (size_t i = 0; i < length; i += bytewidth) {
+    __m128i b = loadPixel(precon + i, bytewidth);
+    __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+                               _mm_and_si128(_mm_xor_si128(a, b), one));
+    a = _mm_add_epi8(loadPixel(scanline + i, bytewidth), avg);
+    storePixel(recon + i, a, bytewidth);
+  }
+}
+
+PICOPNG_TARGET("sse2")
+static void unfilterAvg3SSE2(unsigned char* recon,
+                             const unsigned char* scanline,
+                             const unsigned char* precon, size_t length) {
+  unfilterAvgSSE2(recon, scanline, precon, length, 3);
+}
+
+PICOPNG_TARGET("sse2")
+static void unfilterAvg4SSE2(unsigned char* recon,
+                             const unsigned char* scanline,
+                             const unsigned char* precon, size_t length) {
+  unfilterAvgSSE2(recon, scanline, precon, length, 4);
+}
+
+PICOPNG_TARGET("sse2")
+static inline __m128i paethNearest(__m128i a, __m128i b, __m128i c, __m128i pa,
+                                   __m128i pb, __m128i pc) {
+  // same choice as paethPredictor, on 16-bit lanes
+  __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+  __m128i isa = _mm_cmpeq_epi16(smallest, pa),
+          isb = _mm_cmpeq_epi16(smallest, pb);
+  __m128i borc =
+      _mm_or_si128(_mm_and_si128(isb, b), _mm_andnot_si128(isb, c));
+  return _mm_or_si128(_mm_and_si128(isa, a), _mm_andnot_si128(isa, borc));
+}
+
+PICOPNG_TARGET("sse2")
+static inline void unfilterPaethSSE2(unsigned char* recon,
+                                     const unsigned char* scanline,
+                                     const unsigned char* precon,
+                                     size_t length, size_t bytewidth) {
+  // a, b and c are widened to 16 bits: p - a = b - c, p - b = a - c and
+  // p - c = (b - c) + (a - c)
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  for (size_t i = 0; i < length; i += bytewidth) {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(precon + i, bytewidth), zero);
+    __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_add_epi16(pa, pb);
+    pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+    pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+    pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+    __m128i nearest = paethNearest(a, b, c, pa, pb, pc);
+    a = _mm_add_epi8(loadPixel(scanline + i, bytewidth),
+                     _mm_packus_epi16(nearest, nearest));
+    storePixel(recon + i, a, bytewidth);
+    a = _mm_unpacklo_epi8(a, zero);
+    c = b;
+  }
+}
+
+PICOPNG_TARGET("sse2")
+static void unfilterPaeth3SSE2(unsigned char* recon,
+                               const unsigned char* scanline,
+                               const unsigned char* precon, size_t length) {
+  unfilterPaethSSE2(recon, scanline, precon, length, 3);
+}
+
+PICOPNG_TARGET("sse2")
+static void unfilterPaeth4SSE2(unsigned char* recon,
+                               const unsigned char* scanline,
+                               const unsigned char* precon, size_t length) {
+  unfilterPaethSSE2(recon, scanline, precon, length, 4);
+}
+
+PICOPNG_TARGET("ssse3")
+static inline void unfilterPaethSSSE3(unsigned char* recon,
+                                      const unsigned char* scanline,
+                                      const unsigned char* precon,
+                                      size_t length, size_t bytewidth) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i a = zero, c = zero;
+  for (size_t i = 0; i < length; i += bytewidth) {
+    __m128i b = _mm_unpacklo_epi8(loadPixel(precon + i, bytewidth), zero);
+    __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c);
+    __m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+    __m128i nearest =
+        paethNearest(a, b, c, _mm_abs_epi16(pa), _mm_abs_epi16(pb), pc);
+    a = _mm_add_epi8(loadPixel(scanline + i, bytewidth),
+                     _mm_packus_epi16(nearest, nearest));
+    storePixel(recon + i, a, bytewidth);
+    a = _mm_unpacklo_epi8(a, zero);
+    c = b;
+  }
+}
+
+PICOPNG_TARGET("ssse3")
+static void unfilterPaeth3SSSE3(unsigned char* recon,
+                                const unsigned char* scanline,
+                                const unsigned char* precon, size_t length) {
+  unfilterPaethSSSE3(recon, scanline, precon, length, 3);
+}
+
+PICOPNG_TARGET("ssse3")
+static void unfilterPaeth4SSSE3(unsigned char* recon,
+                                const unsigned char* scanline,
+                                const unsigned char* precon, size_t length) {
+  unfilterPaethSSSE3(recon, scanline, precon, length, 4);
+}
+
+PICOPNG_TARGET("avx2")
+static void unfilterUpAVX2(unsigned char* recon, const unsigned char* scanline,
+                           const unsigned char* precon, size_t length) {
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*)(precon + i));
+    _mm256_storeu_si256((__m256i*)(recon + i), _mm256_add_epi8(x, b));
+  }
+  for (; i < length; i++) recon[i] = scanline[i] + precon[i];
+}
+
+PICOPNG_TARGET("avx2")
+static void unfilterSub4AVX2(unsigned char* recon,
+                             const unsigned char* scanline,
+                             const unsigned char*, size_t length) {
+  // prefix sum within each 128-bit lane, then the last pixel of the low lane
+  // is carried into the high lane
+  __m256i a = _mm256_setzero_si256();
+  size_t i = 0;
+  for (; i + 32 <= length; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(scanline + i));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi8(x, _mm256_slli_si256(x, 8));
+    __m256i last = _mm256_shuffle_epi32(x, 0xFF);
+    x = _mm256_add_epi8(x, _mm256_permute2x128_si256(last, last, 0x08));
+    x = _mm256_add_epi8(x, a);
+    _mm256_storeu_si256((__m256i*)(recon + i), x);
+    last = _mm256_shuffle_epi32(x, 0xFF);
+    a = _mm256_permute2x128_si256(last, last, 0x11);
+  }
+  unfilterSubTail(recon, scanline, 4, i, length);
+}
+
+static SimdLevel cpuSimdLevel() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 0);
+  int maxleaf = info[0];
+  __cpuid(info, 1);
+  bool sse2 = (info[3] & (1 << 26)) != 0, ssse3 = (info[2] & (1 << 9)) != 0;
+  bool osxsave = (info[2] & (1 << 27)) != 0, avx2 = false;
+  if (maxleaf >= 7 && osxsave && (_xgetbv(0) & 6) == 6) {
+    __cpuidex(info, 7, 0);
+    avx2 = (info[1] & (1 << 5)) != 0;
+  }
+#else
+  __builtin_cpu_init();
+  bool sse2 = __builtin_cpu_supports("sse2"),
+       ssse3 = __builtin_cpu_supports("ssse3"),
+       avx2 = __builtin_cpu_supports("avx2");
+#endif
+  return avx2 ? SIMD_AVX2 : ssse3 ? SIMD_SSSE3 : sse2 ? SIMD_SSE2 : SIMD_NONE;
+}
+#else
+static SimdLevel cpuSimdLevel() { return SIMD_NONE; }
+#endif
+
+SimdLevel simdLevel() {  // the best level the CPU supports, checked once
+  static const SimdLevel level = cpuSimdLevel();
+  return level;
+}
+
+UnfilterKernel unfilterKernel(SimdLevel level, size_t bytewidth,
+                              unsigned long filterType) {  // 0 if there is no
+                                                           // kernel for it
+#ifdef PICOPNG_X86
+  if (level == SIMD_NONE || (bytewidth != 3 && bytewidth != 4)) return 0;
+  bool rgba = bytewidth == 4;
+  switch (filterType) {
+    case 1:
+      if (rgba)
+        return level >= SIMD_AVX2 ? unfilterSub4AVX2 : unfilterSub4SSE2;
+      return level >= SIMD_SSSE3 ? unfilterSub3SSSE3 : unfilterSub3SSE2;
+    case 2:
+      return level >= SIMD_AVX2 ? unfilterUpAVX2 : unfilterUpSSE2;
+    case 3:
+      return rgba ? unfilterAvg4SSE2 : unfilterAvg3SSE2;
+    case 4:
+      if (level >= SIMD_SSSE3)
+        return rgba ? unfilterPaeth4SSSE3 : unfilterPaeth3SSSE3;
+      return rgba ? unfilterPaeth4SSE2 : unfilterPaeth3SSE2;
+  }
+#else
+  (void)level;
+  (void)bytewidth;
+  (void)filterType;
+#endif
+  return 0;
+}
+
+int unfilterScanline(unsigned char* recon, const unsigned char* scanline,
+                     const unsigned char* precon, size_t bytewidth,
+                     unsigned long filterType, size_t length,
+                     SimdLevel level) {  // recon may be scanline itself.
+                                         // return value = LodePNG error code
+  if (filterType >= 1 && filterType <= 4 && (precon || filterType == 1)) {
+    UnfilterKernel kernel = unfilterKernel(level, bytewidth, filterType);
+    if (kernel) {
+      kernel(recon, scanline, precon, length);
+      return 0;
+    }
+  }
+  switch (filterType) {
+    case 0:
+      if (recon != scanline) std::memcpy(recon, scanline, length);
+      break;
+    case 1:
+      unfilterSubTail(recon, scanline, bytewidth, 0, length);
+      break;
+    case 2:
+      if (precon)
+        for (size_t i = 0; i < length; i++) recon[i] = scanline[i] + precon[i];
+      else if (recon != scanline)
+        std::memcpy(recon, scanline, length);
+      break;
+    case 3:
+      if (precon) {
+        for (size_t i = 0; i < bytewidth; i++)
+          recon[i] = scanline[i] + precon[i] / 2;
+        for (size_t i = bytewidth; i < length; i++)
+          recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
+      } else {
+        for (size_t i = 0; i < bytewidth; i++) recon[i] = scanline[i];
+        for (size_t i = bytewidth; i < length; i++)
+          recon[i] = scanline[i] + recon[i - bytewidth] / 2;
+      }
+      break;
+    case 4:
+      if (precon) {
+        for (size_t i = 0; i < bytewidth; i++)
+          recon[i] = scanline[i] + paethPredictor(0, precon[i], 0);
+        for (size_t i = bytewidth; i < length; i++)
+          recon[i] = scanline[i] + paethPredictor(recon[i - bytewidth],
+                                                  precon[i],
+                                                  precon[i - bytewidth]);
+      } else {
+        for (size_t i = 0; i < bytewidth; i++) recon[i] = scanline[i];
+        for (size_t i = bytewidth; i < length; i++)
+          recon[i] = scanline[i] + paethPredictor(recon[i - bytewidth], 0, 0);
+      }
+      break;
+    default:
+      return 36;  // error: unexisting filter type given
+  }
+  return 0;
+}
+
+// Conversion of 8-bit lines to RGBA, and of 16-bit samples to 8 bits. Each
+// function handles a whole line: the SIMD part does the bulk, the scalar
+// code the remaining pixels, or everything when level is SIMD_NONE.
+
+#ifdef PICOPNG_X86
+PICOPNG_TARGET("sse2")
+static size_t expandGrey8SSE2(unsigned char* out, const unsigned char* in,
+                              size_t numpixels, int key) {
+  const __m128i ones = _mm_set1_epi8(-1), k = _mm_set1_epi8((char)key);
+  size_t i = 0;
+  for (; i + 16 <= numpixels; i += 16) {
+    __m128i g = _mm_loadu_si128((const __m128i*)(in + i));
+    __m128i a = key < 0 ? ones : _mm_andnot_si128(_mm_cmpeq_epi8(g, k), ones);
+    __m128i gg = _mm_unpacklo_epi8(g, g), ga = _mm_unpacklo_epi8(g, a);
+    _mm_storeu_si128((__m128i*)(out + 4 * i), _mm_unpacklo_epi16(gg, ga));
+    _mm_storeu_si128((__m128i*)(out + 4 * i + 16), _mm_unpackhi_epi16(gg, ga));
+    gg = _mm_unpackhi_epi8(g, g);
+    ga = _mm_unpackhi_epi8(g, a);
+    _mm_storeu_si128((__m128i*)(out + 4 * i + 32), _mm_unpacklo_epi16(gg, ga));
+    _mm_storeu_si128((__m128i*)(out + 4 * i + 48), _mm_unpackhi_epi16(gg, ga));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static size_t expandGrey8AVX2(unsigned char* out, const unsigned char* in,
+                              size_t numpixels, int key) {
+  const __m256i alpha = _mm256_set1_epi32((int)0xFF000000),
+                k = _mm256_set1_epi32(key);
+  size_t i = 0;
+  for (; i + 8 <= numpixels; i += 8) {
+    __m256i g = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)));
+    __m256i rgb = _mm256_or_si256(
+        g, _mm256_or_si256(_mm256_slli_epi32(g, 8), _mm256_slli_epi32(g, 16)));
+    __m256i a =
+        key < 0 ? alpha : _mm256_andnot_si256(_mm256_cmpeq_epi32(g, k), alpha);
+    _mm256_storeu_si256((__m256i*)(out + 4 * i), _mm256_or_si256(rgb, a));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("ssse3")
+static size_t expandGreyAlpha8SSSE3(unsigned char* out, const unsigned char* in,
+                                    size_t numpixels) {
+  const __m128i lo = _mm_setr_epi8(0, 0, 0, 1, 2, 2, 2, 3, 4, 4, 4, 5, 6, 6, 6,
+                                   7),
+                hi = _mm_setr_epi8(8, 8, 8, 9, 10, 10, 10, 11, 12, 12, 12, 13,
+                                   14, 14, 14, 15);
+  size_t i = 0;
+  for (; i + 8 <= numpixels; i += 8) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+    _mm_storeu_si128((__m128i*)(out + 4 * i), _mm_shuffle_epi8(x, lo));
+    _mm_storeu_si128((__m128i*)(out + 4 * i + 16), _mm_shuffle_epi8(x, hi));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static size_t expandGreyAlpha8AVX2(unsigned char* out, const unsigned char* in,
+                                   size_t numpixels) {
+  // widen each grey/alpha pair to 32 bits, then spread it inside the lane
+  const __m256i spread = _mm256_setr_epi8(
+      0, 0, 0, 1, 4, 4, 4, 5, 8, 8, 8, 9, 12, 12, 12, 13, 0, 0, 0, 1, 4, 4, 4,
+      5, 8, 8, 8, 9, 12, 12, 12, 13);
+  size_t i = 0;
+  for (; i + 8 <= numpixels; i += 8) {
+    __m256i x = _mm256_cvtepu16_epi32(
+        _mm_loadu_si128((const __m128i*)(in + 2 * i)));
+    _mm256_storeu_si256((__m256i*)(out + 4 * i),
+                        _mm256_shuffle_epi8(x, spread));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("ssse3")
+static size_t expandRGB8SSSE3(unsigned char* out, const unsigned char* in,
+                              size_t numpixels, int key) {
+  // key is the color key as a 0x00BBGGRR pixel, or -1
+  const __m128i spread = _mm_setr_epi8(0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8,
+                                       -128, 9, 10, 11, -128),
+                alpha = _mm_set1_epi32((int)0xFF000000),
+                k = _mm_set1_epi32(key);
+  size_t i = 0;
+  for (; 3 * i + 16 <= 3 * numpixels; i += 4) {
+    __m128i rgb = _mm_shuffle_epi8(
+        _mm_loadu_si128((const __m128i*)(in + 3 * i)), spread);
+    __m128i a =
+        key < 0 ? alpha : _mm_andnot_si128(_mm_cmpeq_epi32(rgb, k), alpha);
+    _mm_storeu_si128((__m128i*)(out + 4 * i), _mm_or_si128(rgb, a));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static size_t expandRGB8AVX2(unsigned char* out, const unsigned char* in,
+                             size_t numpixels, int key) {
+  // move bytes 12-27 of the 32 loaded ones to the high lane, so each lane
+  // holds 4 pixels to spread
+  const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6),
+                spread = _mm256_setr_epi8(
+                    0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10, 11,
+                    -128, 0, 1, 2, -128, 3, 4, 5, -128, 6, 7, 8, -128, 9, 10,
+                    11, -128),
+                alpha = _mm256_set1_epi32((int)0xFF000000),
+                k = _mm256_set1_epi32(key);
+  size_t i = 0;
+  for (; 3 * i + 32 <= 3 * numpixels; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(in + 3 * i));
+    __m256i rgb =
+        _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(x, lanes), spread);
+    __m256i a = key < 0
+                    ? alpha
+                    : _mm256_andnot_si256(_mm256_cmpeq_epi32(rgb, k), alpha);
+    _mm256_storeu_si256((__m256i*)(out + 4 * i), _mm256_or_si256(rgb, a));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static size_t expandPalette8AVX2(unsigned char* out, const unsigned char* in,
+                                 size_t numpixels,
+                                 const unsigned char* palette) {
+  size_t i = 0;
+  for (; i + 8 <= numpixels; i += 8) {
+    __m256i index =
+        _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(in + i)));
+    _mm256_storeu_si256(
+        (__m256i*)(out + 4 * i),
+        _mm256_i32gather_epi32((const int*)palette, index, 4));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("sse2")
+static size_t maxByteSSE2(const unsigned char* in, size_t size,
+                          unsigned char& result) {
+  __m128i m = _mm_setzero_si128();
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16)
+    m = _mm_max_epu8(m, _mm_loadu_si128((const __m128i*)(in + i)));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 8));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 4));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 2));
+  m = _mm_max_epu8(m, _mm_srli_si128(m, 1));
+  result = (unsigned char)_mm_cvtsi128_si32(m);
+  return i;
+}
+
+PICOPNG_TARGET("sse2")
+static size_t truncate16SSE2(unsigned char* out, const unsigned char* in,
+                             size_t numsamples) {
+  // samples are big endian, so the byte to keep is the low byte of each
+  // 16-bit lane
+  const __m128i mask = _mm_set1_epi16(0xFF);
+  size_t i = 0;
+  for (; i + 16 <= numsamples; i += 16) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + 2 * i));
+    __m128i y = _mm_loadu_si128((const __m128i*)(in + 2 * i + 16));
+    _mm_storeu_si128((__m128i*)(out + i),
+                     _mm_packus_epi16(_mm_and_si128(x, mask),
+                                      _mm_and_si128(y, mask)));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static size_t truncate16AVX2(unsigned char* out, const unsigned char* in,
+                             size_t numsamples) {
+  const __m256i mask = _mm256_set1_epi16(0xFF);
+  size_t i = 0;
+  for (; i + 32 <= numsamples; i += 32) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(in + 2 * i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(in + 2 * i + 32));
+    __m256i packed = _mm256_packus_epi16(_mm256_and_si256(x, mask),
+                                         _mm256_and_si256(y, mask));
+    _mm256_storeu_si256((__m256i*)(out + i),
+                        _mm256_permute4x64_epi64(packed, 0xD8));
+  }
+  return i;
+}
+#endif
+
+void expandGrey8(unsigned char* out, const unsigned char* in,
+                 size_t numpixels, int key,
+                 SimdLevel level) {  // key: grey value that is transparent,
+                                     // or -1
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2)
+    i = expandGrey8AVX2(out, in, numpixels, key);
+  else if (level >= SIMD_SSE2)
+    i = expandGrey8SSE2(out, in, numpixels, key);
+#else
+  (void)level;
+#endif
+  for (; i < numpixels; i++) {
+    out[4 * i + 0] = out[4 * i + 1] = out[4 * i + 2] = in[i];
+    out[4 * i + 3] = (int)in[i] == key ? 0 : 255;
+  }
+}
+
+void expandGreyAlpha8(unsigned char* out, const unsigned char* in,
+                      size_t numpixels, SimdLevel level) {
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2)
+    i = expandGreyAlpha8AVX2(out, in, numpixels);
+  else if (level >= SIMD_SSSE3)
+    i = expandGreyAlpha8SSSE3(out, in, numpixels);
+#else
+  (void)level;
+#endif
+  for (; i < numpixels; i++) {
+    out[4 * i + 0] = out[4 * i + 1] = out[4 * i + 2] = in[2 * i + 0];
+    out[4 * i + 3] = in[2 * i + 1];
+  }
+}
+
+void expandRGB8(unsigned char* out, const unsigned char* in, size_t numpixels,
+                int key, SimdLevel level) {  // key: transparent color as
+                                             // 0x00BBGGRR, or -1
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2)
+    i = expandRGB8AVX2(out, in, numpixels, key);
+  else if (level >= SIMD_SSSE3)
+    i = expandRGB8SSSE3(out, in, numpixels, key);
+#else
+  (void)level;
+#endif
+  for (; i < numpixels; i++) {
+    int pixel = in[3 * i] | in[3 * i + 1] << 8 | in[3 * i + 2] << 16;
+    for (size_t c = 0; c < 3; c++) out[4 * i + c] = in[3 * i + c];
+    out[4 * i + 3] = pixel == key ? 0 : 255;
+  }
+}
+
+void expandPalette8(unsigned char* out, const unsigned char* in,
+                    size_t numpixels, const unsigned char* palette,
+                    SimdLevel level) {  // palette: 256 RGBA entries, every
+                                        // index in the line must be valid
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2) i = expandPalette8AVX2(out, in, numpixels, palette);
+#else
+  (void)level;
+#endif
+  for (; i < numpixels; i++) std::memcpy(&out[4 * i], &palette[4 * in[i]], 4);
+}
+
+unsigned char maxByte(const unsigned char* in, size_t size, SimdLevel level) {
+  unsigned char result = 0;
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_SSE2) i = maxByteSSE2(in, size, result);
+#else
+  (void)level;
+#endif
+  for (; i < size; i++)
+    if (in[i] > result) result = in[i];
+  return result;
+}
+
+void truncate16(unsigned char* out, const unsigned char* in,
+                size_t numsamples, SimdLevel level) {  // keep the most
+                                                       // significant byte of
+                                                       // each 16-bit sample
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2)
+    i = truncate16AVX2(out, in, numsamples);
+  else if (level >= SIMD_SSE2)
+    i = truncate16SSE2(out, in, numsamples);
+#else
+  (void)level;
+#endif
+  for (; i < numsamples; i++) out[i] = in[2 * i];
+}
+
+// Packed formats, for textures that don't need 8 bits per channel or all four
+// channels. The decoder converts the pixels to RGBA a few hundred at a time and
+// packs them while they are in the cache, in the same pass over the image.
+enum Format {
+  FORMAT_RGBA8,     // 4 bytes R, G, B, A, as with convert_to_rgba32
+  FORMAT_RGB565,    // 16-bit words in native byte order, R in the top 5 bits,
+                    // the alpha dropped: GL_UNSIGNED_SHORT_5_6_5
+  FORMAT_RGBA4444,  // 16-bit words, R in the top 4 bits and A in the lowest:
+                    // GL_UNSIGNED_SHORT_4_4_4_4
+  FORMAT_RG8,       // 2 bytes luminance and alpha: GL_LUMINANCE_ALPHA
+  FORMAT_R8         // 1 byte luminance: GL_LUMINANCE
+};
+
+size_t formatSize(Format format) {  // bytes per pixel
+  return format == FORMAT_RGBA8 ? 4 : format == FORMAT_R8 ? 1 : 2;
+}
+
+static inline unsigned reduceBits(unsigned value,
+                                  unsigned max) {  // 0..255 to 0..max,
+                                                   // rounded to nearest
+  return (value * max + 127) / 255;
+}
+
+static inline unsigned char luminance(
+    const unsigned char* rgba) {  // the weights of Rec. 601 scaled to a sum
+                                  // of 256, so that grey stays the same
+  return (unsigned char)((77 * rgba[0] + 150 * rgba[1] + 29 * rgba[2]) >> 8);
+}
+
+void packRGBA(unsigned char* out, size_t step, const unsigned char* rgba,
+              size_t numpixels, Format format) {  // RGBA pixels to format,
+                                                  // the out pixels are step
+                                                  // bytes apart
+  switch (format) {
+    case FORMAT_RGBA8:
+      for (size_t i = 0; i < numpixels; i++)
+        std::memcpy(&out[step * i], &rgba[4 * i], 4);
+      break;
+    case FORMAT_RGB565:
+      for (size_t i = 0; i < numpixels; i++) {
+        const unsigned char* p = &rgba[4 * i];
+        unsigned short v = (unsigned short)(reduceBits(p[0], 31) << 11 |
+                                             reduceBits(p[1], 63) << 5 |
+                                             reduceBits(p[2], 31));
+        std::memcpy(&out[step * i], &v, 2);
+      }
+      break;
+    case FORMAT_RGBA4444:
+      for (size_t i = 0; i < numpixels; i++) {
+        const unsigned char* p = &rgba[4 * i];
+        unsigned short v = (unsigned short)(
+            reduceBits(p[0], 15) << 12 | reduceBits(p[1], 15) << 8 |
+            reduceBits(p[2], 15) << 4 | reduceBits(p[3], 15));
+        std::memcpy(&out[step * i], &v, 2);
+      }
+      break;
+    case FORMAT_RG8:
+      for (size_t i = 0; i < numpixels; i++) {
+        out[step * i] = luminance(&rgba[4 * i]);
+        out[step * i + 1] = rgba[4 * i + 3];
+      }
+      break;
+    case FORMAT_R8:
+      for (size_t i = 0; i < numpixels; i++)
+        out[step * i] = luminance(&rgba[4 * i]);
+      break;
+  }
+}
+
+// Finishing of converted RGBA pixels, on each piece of a row right after its
+// conversion while it is in the cache: alpha premultiplication, and a change
+// of the order of the channels.
+
+#ifdef PICOPNG_X86
+PICOPNG_TARGET("sse2")
+static inline __m128i premultiply16SSE2(__m128i x, __m128i alphalanes) {
+  // two pixels of 16-bit channels times their alpha, and the alpha times
+  // 255, divided by 255 with rounding: (t + (t >> 8)) >> 8, t = x * a + 128
+  __m128i a = _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xFF), 0xFF);
+  __m128i t = _mm_add_epi16(_mm_mullo_epi16(x, _mm_or_si128(a, alphalanes)),
+                            _mm_set1_epi16(128));
+  return _mm_srli_epi16(_mm_add_epi16(t, _mm_srli_epi16(t, 8)), 8);
+}
+
+PICOPNG_TARGET("sse2")
+static size_t premultiplySSE2(unsigned char* pixels, size_t numpixels) {
+  const __m128i zero = _mm_setzero_si128(),
+                alphalanes = _mm_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255);
+  size_t i = 0;
+  for (; i + 4 <= numpixels; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(pixels + 4 * i));
+    __m128i lo = premultiply16SSE2(_mm_unpacklo_epi8(x, zero), alphalanes),
+            hi = premultiply16SSE2(_mm_unpackhi_epi8(x, zero), alphalanes);
+    _mm_storeu_si128((__m128i*)(pixels + 4 * i), _mm_packus_epi16(lo, hi));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static inline __m256i premultiply16AVX2(__m256i x, __m256i alphalanes) {
+  __m256i a = _mm256_shufflehi_epi16(_mm256_shufflelo_epi16(x, 0xFF), 0xFF);
+  __m256i t = _mm256_add_epi16(
+      _mm256_mullo_epi16(x, _mm256_or_si256(a, alphalanes)),
+      _mm256_set1_epi16(128));
+  return _mm256_srli_epi16(_mm256_add_epi16(t, _mm256_srli_epi16(t, 8)), 8);
+}
+
+PICOPNG_TARGET("avx2")
+static size_t premultiplyAVX2(unsigned char* pixels, size_t numpixels) {
+  // unpacking and packing work within the 128-bit lanes, so the pixels
+  // come back in their order
+  const __m256i zero = _mm256_setzero_si256(),
+                alphalanes = _mm256_setr_epi16(0, 0, 0, 255, 0, 0, 0, 255, 0,
+                                               0, 0, 255, 0, 0, 0, 255);
+  size_t i = 0;
+  for (; i + 8 <= numpixels; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(pixels + 4 * i));
+    __m256i lo =
+                premultiply16AVX2(_mm256_unpacklo_epi8(x, zero), alphalanes),
+            hi =
+                premultiply16AVX2(_mm256_unpackhi_epi8(x, zero), alphalanes);
+    _mm256_storeu_si256((__m256i*)(pixels + 4 * i),
+                        _mm256_packus_epi16(lo, hi));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("ssse3")
+static size_t swizzleSSSE3(unsigned char* pixels, size_t numpixels,
+                           const unsigned char* order) {
+  char shuffle[16];
+  for (int b = 0; b < 16; b++) shuffle[b] = (char)(b / 4 * 4 + order[b % 4]);
+  const __m128i mask = _mm_loadu_si128((const __m128i*)shuffle);
+  size_t i = 0;
+  for (; i + 4 <= numpixels; i += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(pixels + 4 * i));
+    _mm_storeu_si128((__m128i*)(pixels + 4 * i), _mm_shuffle_epi8(x, mask));
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static size_t swizzleAVX2(unsigned char* pixels, size_t numpixels,
+                          const unsigned char* order) {
+  char shuffle[16];
+  for (int b = 0; b < 16; b++) shuffle[b] = (char)(b / 4 * 4 + order[b % 4]);
+  const __m256i mask = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128((const __m128i*)shuffle));
+  size_t i = 0;
+  for (; i + 8 <= numpixels; i += 8) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(pixels + 4 * i));
+    _mm256_storeu_si256((__m256i*)(pixels + 4 * i),
+                        _mm256_shuffle_epi8(x, mask));
+  }
+  return i;
+}
+#endif
+
+void premultiplyAlpha(unsigned char* pixels, size_t numpixels,
+                      SimdLevel level) {  // scale the color of RGBA pixels
+                                          // by their alpha, rounded
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2)
+    i = premultiplyAVX2(pixels, numpixels);
+  else if (level >= SIMD_SSE2)
+    i = premultiplySSE2(pixels, numpixels);
+#else
+  (void)level;
+#endif
+  for (; i < numpixels; i++) {
+    unsigned a = pixels[4 * i + 3];
+    for (size_t c = 0; c < 3; c++) {
+      unsigned t = pixels[4 * i + c] * a + 128;
+      pixels[4 * i + c] = (unsigned char)((t + (t >> 8)) >> 8);
+    }
+  }
+}
+
+void swizzleChannels(unsigned char* pixels, size_t numpixels,
+                     const unsigned char* order,
+                     SimdLevel level) {  // channel c of each pixel becomes
+                                         // its channel order[c], 0 to 3
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2)
+    i = swizzleAVX2(pixels, numpixels, order);
+  else if (level >= SIMD_SSSE3)
+    i = swizzleSSSE3(pixels, numpixels, order);
+#else
+  (void)level;
+#endif
+  for (; i < numpixels; i++) {
+    unsigned char p[4];
+    std::memcpy(p, &pixels[4 * i], 4);
+    for (size_t c = 0; c < 4; c++) pixels[4 * i + c] = p[order[c]];
+  }
+}
+
+// Checksums, for decoding with verification. The CRC32 of the chunks is folded
+// 64 bytes at a time with carry-less multiplication where the CPU has it, and
+// otherwise taken eight bytes at a time with the slice-by-8 tables. The
+// Adler-32 of the zlib data is summed 32 bytes at a time with SSSE3 or AVX2.
+
+#ifdef PICOPNG_X86
+static bool cpuHasPclmul() {
+#if defined(_MSC_VER) && !defined(__clang__)
+  int info[4];
+  __cpuid(info, 1);
+  return (info[2] & (1 << 1)) != 0;
+#else
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("pclmul");
+#endif
+}
+
+PICOPNG_TARGET("sse2,pclmul")
+static inline __m128i crcFold(__m128i x, __m128i k,
+                              __m128i next) {  // x moved 128 bits on, plus next
+  return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00),
+                                     _mm_clmulepi64_si128(x, k, 0x11)),
+                       next);
+}
+
+PICOPNG_TARGET("sse2,pclmul")
+static unsigned crc32PCLMUL(unsigned crc, const unsigned char* data,
+                            size_t size) {  // size: a multiple of 16, at least
+                                            // 64. crc: the inverted value
+                                            // that crc32 works with
+  // Folds four 128-bit lanes over the data, then the lanes and the rest into
+  // one, and reduces that to 32 bits, with the constants of "Fast CRC
+  // Computation for Generic Polynomials Using PCLMULQDQ Instruction" for the
+  // bit-reflected polynomial
+  const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4),
+                k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0),
+                k5 = _mm_set_epi64x(0, 0x0163cd6124),
+                poly = _mm_set_epi64x(0x01f7011641, 0x01db710641),
+                low32 = _mm_setr_epi32(-1, 0, -1, 0);
+  __m128i x1 = _mm_loadu_si128((const __m128i*)(data + 0)),
+          x2 = _mm_loadu_si128((const __m128i*)(data + 16)),
+          x3 = _mm_loadu_si128((const __m128i*)(data + 32)),
+          x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+  x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128((int)crc));
+  size_t i = 64;
+  for (; i + 64 <= size; i += 64) {
+    x1 = crcFold(x1, k1k2, _mm_loadu_si128((const __m128i*)(data + i)));
+    x2 = crcFold(x2, k1k2, _mm_loadu_si128((const __m128i*)(data + i + 16)));
+    x3 = crcFold(x3, k1k2, _mm_loadu_si128((const __m128i*)(data + i + 32)));
+    x4 = crcFold(x4, k1k2, _mm_loadu_si128((const __m128i*)(data + i + 48)));
+  }
+  x1 = crcFold(x1, k3k4, x2);
+  x1 = crcFold(x1, k3k4, x3);
+  x1 = crcFold(x1, k3k4, x4);
+  for (; i < size; i += 16)
+    x1 = crcFold(x1, k3k4, _mm_loadu_si128((const __m128i*)(data + i)));
+  // 128 bits to 64, then Barrett reduction to 32
+  x1 = _mm_xor_si128(_mm_srli_si128(x1, 8),
+                     _mm_clmulepi64_si128(x1, k3k4, 0x10));
+  x1 = _mm_xor_si128(
+      _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00),
+      _mm_srli_si128(x1, 4));
+  __m128i t = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+  t = _mm_clmulepi64_si128(_mm_and_si128(t, low32), poly, 0x00);
+  return (unsigned)_mm_cvtsi128_si32(_mm_srli_si128(_mm_xor_si128(x1, t), 4));
+}
+#endif
+
+unsigned readChecksum(const unsigned char* in) {  // big endian, as stored
+  return (unsigned)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+}
+
+unsigned crc32(unsigned crc, const unsigned char* data,
+               size_t size) {  // update crc, 0 to start, with size bytes
+  struct Tables {
+    Tables() {
+      for (unsigned i = 0; i < 256; i++) {
+        unsigned c = i;
+        for (size_t k = 0; k < 8; k++)
+          c = c & 1 ? 0xEDB88320u ^ c >> 1 : c >> 1;  // reflected polynomial
+        table[0][i] = c;
+      }
+      for (size_t k = 1; k < 8; k++)
+        for (size_t i = 0; i < 256; i++)
+          table[k][i] = table[k - 1][i] >> 8 ^ table[0][table[k - 1][i] & 255];
+    }
+    unsigned table[8][256];  // table[k]: the byte followed by k zero bytes
+  };
+  static const Tables tables;
+  const unsigned(*t)[256] = tables.table;
+  crc = ~crc;
+#ifdef PICOPNG_X86
+  static const bool pclmul = cpuHasPclmul();
+  if (pclmul && size >= 64) {
+    size_t n = size & ~(size_t)15;
+    crc = crc32PCLMUL(crc, data, n);
+    data += n;
+    size -= n;
+  }
+#endif
+  for (; size >= 8; size -= 8, data += 8) {
+    unsigned a = crc ^ (data[0] | data[1] << 8 | data[2] << 16 |
+                        (unsigned)data[3] << 24);
+    crc = t[7][a & 255] ^ t[6][a >> 8 & 255] ^ t[5][a >> 16 & 255] ^
+          t[4][a >> 24] ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^
+          t[0][data[7]];
+  }
+  for (; size != 0; size--) crc = t[0][(crc ^ *data++) & 255] ^ crc >> 8;
+  return ~crc;
+}
+
+#ifdef PICOPNG_X86
+PICOPNG_TARGET("ssse3")
+static size_t adler32SSSE3(const unsigned char* in, size_t size, unsigned& s1,
+                           unsigned& s2) {
+  // per block of 32 bytes: s2 gains 32 times s1 plus the bytes weighted 32
+  // down to 1, s1 gains the sum of the bytes. Blocks are reduced modulo 65521
+  // every 5536 bytes, before the sums can overflow
+  const __m128i weights1 = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24,
+                                         23, 22, 21, 20, 19, 18, 17),
+                weights2 = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7,
+                                         6, 5, 4, 3, 2, 1),
+                ones = _mm_set1_epi16(1), zero = _mm_setzero_si128();
+  size_t i = 0;
+  while (size - i >= 32) {
+    size_t blocks = (size - i) / 32 < 173 ? (size - i) / 32 : 173;
+    __m128i sum1 = zero, sum2 = _mm_cvtsi32_si128((int)s2),
+            prev = _mm_cvtsi32_si128((int)(s1 * blocks));
+    for (size_t b = 0; b < blocks; b++, i += 32) {
+      __m128i x = _mm_loadu_si128((const __m128i*)(in + i)),
+              y = _mm_loadu_si128((const __m128i*)(in + i + 16));
+      prev = _mm_add_epi32(prev, sum1);
+      sum1 = _mm_add_epi32(sum1, _mm_sad_epu8(x, zero));
+      sum1 = _mm_add_epi32(sum1, _mm_sad_epu8(y, zero));
+      sum2 = _mm_add_epi32(
+          sum2, _mm_madd_epi16(_mm_maddubs_epi16(x, weights1), ones));
+      sum2 = _mm_add_epi32(
+          sum2, _mm_madd_epi16(_mm_maddubs_epi16(y, weights2), ones));
+    }
+    sum2 = _mm_add_epi32(sum2, _mm_slli_epi32(prev, 5));
+    sum1 = _mm_add_epi32(sum1, _mm_shuffle_epi32(sum1, 0x4E));
+    sum2 = _mm_add_epi32(sum2, _mm_shuffle_epi32(sum2, 0xB1));
+    sum2 = _mm_add_epi32(sum2, _mm_shuffle_epi32(sum2, 0x4E));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(sum1)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(sum2) % 65521;
+  }
+  return i;
+}
+
+PICOPNG_TARGET("avx2")
+static size_t adler32AVX2(const unsigned char* in, size_t size, unsigned& s1,
+                          unsigned& s2) {  // as adler32SSSE3, with each block
+                                           // in one register
+  const __m256i weights = _mm256_setr_epi8(
+      32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17, 16, 15,
+      14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+  const __m256i ones = _mm256_set1_epi16(1), zero = _mm256_setzero_si256();
+  size_t i = 0;
+  while (size - i >= 32) {
+    size_t blocks = (size - i) / 32 < 173 ? (size - i) / 32 : 173;
+    __m256i sum1 = zero, sum2 = _mm256_setr_epi32((int)s2, 0, 0, 0, 0, 0, 0, 0),
+            prev = _mm256_setr_epi32((int)(s1 * blocks), 0, 0, 0, 0, 0, 0, 0);
+    for (size_t b = 0; b < blocks; b++, i += 32) {
+      __m256i x = _mm256_loadu_si256((const __m256i*)(in + i));
+      prev = _mm256_add_epi32(prev, sum1);
+      sum1 = _mm256_add_epi32(sum1, _mm256_sad_epu8(x, zero));
+      sum2 = _mm256_add_epi32(
+          sum2, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+    }
+    sum2 = _mm256_add_epi32(sum2, _mm256_slli_epi32(prev, 5));
+    __m128i a = _mm_add_epi32(_mm256_castsi256_si128(sum1),
+                              _mm256_extracti128_si256(sum1, 1)),
+            b = _mm_add_epi32(_mm256_castsi256_si128(sum2),
+                              _mm256_extracti128_si256(sum2, 1));
+    a = _mm_add_epi32(a, _mm_shuffle_epi32(a, 0x4E));
+    b = _mm_add_epi32(b, _mm_shuffle_epi32(b, 0xB1));
+    b = _mm_add_epi32(b, _mm_shuffle_epi32(b, 0x4E));
+    s1 = (s1 + (unsigned)_mm_cvtsi128_si32(a)) % 65521;
+    s2 = (unsigned)_mm_cvtsi128_si32(b) % 65521;
+  }
+  return i;
+}
+#endif
+
+unsigned adler32(unsigned adler, const unsigned char* data, size_t size,
+                 SimdLevel level) {  // update adler, 1 to start
+  unsigned s1 = adler & 65535, s2 = adler >> 16;
+  size_t i = 0;
+#ifdef PICOPNG_X86
+  if (level >= SIMD_AVX2)
+    i = adler32AVX2(data, size, s1, s2);
+  else if (level >= SIMD_SSSE3)
+    i = adler32SSSE3(data, size, s1, s2);
+#else
+  (void)level;
+#endif
+  while (i < size) {
+    size_t end = size - i > 5552 ? i + 5552 : size;  // no overflow before it
+    for (; i < end; i++) {
+      s1 += data[i];
+      s2 += s1;
+    }
+    s1 %= 65521;
+    s2 %= 65521;
+  }
+  return s2 << 16 | s1;
+}
+
+// The decoder. Zlib inflates the image data, PNG reads the chunks and turns
+// the inflated scanlines into pixels. decodePNG below decodes a whole file in
+// memory with them.
+
+static const unsigned long LENBASE[29] = {
+    3,  4,  5,  6,  7,  8,  9,  10, 11,  13,  15,  17,  19,  23, 27,
+    31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned long LENEXTRA[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                           1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                           4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned long DISTBASE[30] = {
+    1,    2,    3,    4,    5,    7,    9,    13,    17,    25,
+    33,   49,   65,   97,   129,  193,  257,  385,   513,   769,
+    1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const unsigned long DISTEXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2,  3,  3,  4,  4,  5,  5,  6,
+    6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+static const unsigned long CLCL[19] = {
+    16, 17, 18, 0, 8,  7, 9,  6, 10, 5,
+    11, 4,  12, 3, 13, 2, 14, 1, 15};  //code length code lengths
+static const unsigned long FIRSTBITS =
+    9;  // bits resolved by the root table of a HuffmanTree
+struct Zlib  // nested functions for zlib decompression
+{
+  struct BitReader  // LSB-first bit reader over a 64-bit bit buffer
   {
-    static unsigned long readBitFromStream(size_t& bitp,
-                                           const unsigned char* bits) {
-      unsigned long result = (bits[bitp >> 3] >> (bitp & 0x7)) & 1;
-      bitp++;
+    BitReader(const unsigned char* data, size_t size)
+        : data(data), size(size), pos(0), buffer(0), count(0) {}
+    void refill() {  // make sure at least 56 bits are buffered
+      if (pos + 8 <= size) {
+        buffer |= load64(&data[pos]) << count;
+        pos += (63 - count) >> 3;
+        count |= 56;
+      } else  // near the end: bytes past the end of the data read as zero
+        for (; count <= 56; count += 8, pos++)
+          buffer |= (unsigned long long)(pos < size ? data[pos] : 0)
+                    << count;
+    }
+    unsigned long peek(size_t nbits) const {
+      return (unsigned long)(buffer & ((1ULL << nbits) - 1));
+    }
+    void consume(size_t nbits) {
+      buffer >>= nbits;
+      count -= nbits;
+    }
+    unsigned long read(size_t nbits) {  // needs nbits buffered
+      unsigned long result = peek(nbits);
+      consume(nbits);
       return result;
     }
-    static unsigned long readBitsFromStream(size_t& bitp,
-                                            const unsigned char* bits,
-                                            size_t nbits) {
-      unsigned long result = 0;
-      for (size_t i = 0; i < nbits; i++)
-        result += (readBitFromStream(bitp, bits)) << i;
+    size_t bitpos() const { return pos * 8 - count; }
+    bool overrun() const {  // more bits were consumed than the data has
+      return bitpos() > size * 8;
+    }
+    void seek(size_t bytepos) {  // drop the buffer, continue at bytepos
+      pos = bytepos;
+      buffer = 0;
+      count = 0;
+    }
+    static unsigned long long load64(const unsigned char* p) {
+      unsigned long long result;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+      result = 0;
+      for (size_t i = 0; i < 8; i++)
+        result |= (unsigned long long)p[i] << (8 * i);
+#else
+      std::memcpy(&result, p, 8);  // unaligned little-endian load
+#endif
       return result;
     }
-    struct HuffmanTree {
-      int makeFromLengths(
-          const std::vector<unsigned long>& bitlen,
-          unsigned long maxbitlen) {  // make tree given the lengths
-        unsigned long numcodes = (unsigned long)(bitlen.size()), treepos = 0,
-                      nodefilled = 0;
-        std::vector<unsigned long> tree1d(numcodes), blcount(maxbitlen + 1, 0),
-            nextcode(maxbitlen + 1, 0);
-        for (unsigned long bits = 0; bits < numcodes; bits++)
-          blcount[bitlen[bits]]++;  // count number of instances of each code
-                                    // length
-        for (unsigned long bits = 1; bits <= maxbitlen; bits++)
-          nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
-        for (unsigned long n = 0; n < numcodes; n++)
-          if (bitlen[n] != 0)
-            tree1d[n] = nextcode[bitlen[n]]++;  // generate all the codes
-        tree2d.clear();
-        tree2d.resize(
-            numcodes * 2,
-            32767);  // 32767 here means the tree2d isn't filled there yet
-        for (unsigned long n = 0; n < numcodes; n++)  // the codes
-          for (unsigned long i = 0; i < bitlen[n];
-               i++)  // the bits for this code
-          {
-            unsigned long bit = (tree1d[n] >> (bitlen[n] - i - 1)) & 1;
-            if (treepos > numcodes - 2) return 55;
-            if (tree2d[2 * treepos + bit] == 32767)  // not yet filled in
-            {
-              if (i + 1 == bitlen[n]) {
-                tree2d[2 * treepos + bit] = n;
-                treepos = 0;
-              }  // last bit
-              else {
-                tree2d[2 * treepos + bit] = ++nodefilled + numcodes;
-                treepos = nodefilled;
-              }  // addresses are encoded as values > numcodes
-            } else
-              treepos = tree2d[2 * treepos + bit] - numcodes;  // subtract
-                                                               // numcodes from
-                                                               // address to get
-                                                               // address value
-          }
-        return 0;
+    const unsigned char* data;
+    size_t size, pos;  // pos: next byte to load into the buffer
+    unsigned long long buffer;
+    size_t count;  // number of valid bits in the buffer
+  };
+  struct HuffmanTree {
+    HuffmanTree() : allocations(0) {}
+    int makeFromLengths(const unsigned long* bitlen, unsigned long numcodes,
+                        unsigned long maxbitlen) {  // make tables given the
+                                                    // lengths, at most 288
+                                                    // codes of 15 bits
+      unsigned long tree1d[288], blcount[16] = {0}, nextcode[16] = {0};
+      for (unsigned long bits = 0; bits < numcodes; bits++)
+        blcount[bitlen[bits]]++;  // count number of instances of each code
+                                  // length
+      long left = 1;  // detect over-subscribed code lengths
+      for (unsigned long bits = 1; bits <= maxbitlen; bits++) {
+        left = (left << 1) - (long)blcount[bits];
+        if (left < 0) return 55;
       }
-      int decode(bool& decoded, unsigned long& result, size_t& treepos,
-                 unsigned long bit) const {  // Decodes a symbol from the tree
-        unsigned long numcodes = (unsigned long)tree2d.size() / 2;
-        if (treepos >= numcodes)
-          return 11;  // error: you appeared outside the codetree
-        result = tree2d[2 * treepos + bit];
-        decoded = (result < numcodes);
-        treepos = decoded ? 0 : result - numcodes;
-        return 0;
+      for (unsigned long bits = 1; bits <= maxbitlen; bits++)
+        nextcode[bits] = (nextcode[bits - 1] + blcount[bits - 1]) << 1;
+      for (unsigned long n = 0; n < numcodes; n++)
+        if (bitlen[n] != 0)
+          tree1d[n] = nextcode[bitlen[n]]++;  // generate all the codes
+      // The table is indexed by the next FIRSTBITS bits of the stream. Codes
+      // that are not longer than FIRSTBITS fill every root entry that starts
+      // with them, longer codes share a root entry that points to a
+      // subtable indexed by the remaining bits. Entries are packed as
+      // (value << 4) | length, a zero entry means no code ends there.
+      unsigned long maxlens[1u << FIRSTBITS] = {0};
+      for (unsigned long n = 0; n < numcodes; n++) {
+        unsigned long l = bitlen[n];
+        if (l <= FIRSTBITS) continue;
+        unsigned long index = reverseBits(tree1d[n] >> (l - FIRSTBITS),
+                                          FIRSTBITS);
+        if (l > maxlens[index]) maxlens[index] = l;
       }
-      std::vector<unsigned long> tree2d;  // 2D representation of a huffman
-                                          // tree: The one dimension is "0" or
-                                          // "1", the other contains all nodes
-                                          // and leaves of the tree.
-    };
-    struct Inflator {
-      int error;
-      void inflate(std::vector<unsigned char>& out,
-                   const std::vector<unsigned char>& in, size_t inpos = 0) {
-        size_t bp = 0, pos = 0;  // bit pointer and byte pointer
-        error = 0;
-        unsigned long BFINAL = 0;
-        while (!BFINAL && !error) {
-          if (bp >> 3 >= in.size()) {
-            error = 52;
-            return;
-          }  // error, bit pointer will jump past memory
-          BFINAL = readBitFromStream(bp, &in[inpos]);
-          unsigned long BTYPE = readBitFromStream(bp, &in[inpos]);
-          BTYPE += 2 * readBitFromStream(bp, &in[inpos]);
-          if (BTYPE == 3) {
-            error = 20;
-            return;
-          }  // error: invalid BTYPE
-          else if (BTYPE == 0)
-            inflateNoCompression(out, &in[inpos], bp, pos, in.size());
-          else
-            inflateHuffmanBlock(out, &in[inpos], bp, pos, in.size(), BTYPE);
+      size_t size = 1u << FIRSTBITS;
+      for (size_t i = 0; i < (1u << FIRSTBITS); i++)
+        if (maxlens[i] > FIRSTBITS) size += 1u << (maxlens[i] - FIRSTBITS);
+      if (size > table.capacity()) allocations++;
+      table.assign(size, 0);
+      for (size_t i = 0, pointer = 1u << FIRSTBITS; i < (1u << FIRSTBITS);
+           i++)
+        if (maxlens[i] > FIRSTBITS) {
+          table[i] = (unsigned)((pointer << 4) | maxlens[i]);
+          pointer += 1u << (maxlens[i] - FIRSTBITS);
         }
-        if (!error)
-          out.resize(
-              pos);  // Only now we know the true size of out, resize it to that
-      }
-      void generateFixedTrees(HuffmanTree& tree,
-                              HuffmanTree& treeD)  // get the tree of a deflated
-                                                   // block with fixed tree
-      {
-        std::vector<unsigned long> bitlen(288, 8), bitlenD(32, 5);
-        ;
-        for (size_t i = 144; i <= 255; i++) bitlen[i] = 9;
-        for (size_t i = 256; i <= 279; i++) bitlen[i] = 7;
-        tree.makeFromLengths(bitlen, 15);
-        treeD.makeFromLengths(bitlenD, 15);
-      }
-      HuffmanTree codetree, codetreeD,
-          codelengthcodetree;  // the code tree for Huffman codes, dist codes,
-                               // and code length codes
-      unsigned long huffmanDecodeSymbol(
-          const unsigned char* in, size_t& bp, const HuffmanTree& codetree,
-          size_t
-              inlength) {  // decode a single symbol from given list of bits
-                           // with given code tree. return value is the symbol
-        bool decoded;
-        unsigned long ct;
-        for (size_t treepos = 0;;) {
-          if ((bp & 0x07) == 0 && (bp >> 3) > inlength) {
-            error = 10;
-            return 0;
-          }  // error: end reached without endcode
-          error =
-              codetree.decode(decoded, ct, treepos, readBitFromStream(bp, in));
-          if (error) return 0;  // stop, an error happened
-          if (decoded) return ct;
+      for (unsigned long n = 0; n < numcodes; n++) {
+        unsigned long l = bitlen[n];
+        if (l == 0) continue;
+        unsigned long reverse = reverseBits(tree1d[n], l);
+        if (l <= FIRSTBITS) {
+          for (size_t i = reverse; i < (1u << FIRSTBITS); i += 1u << l)
+            table[i] = (unsigned)((n << 4) | l);
+        } else {
+          unsigned long index = reverse & ((1u << FIRSTBITS) - 1);
+          size_t start = table[index] >> 4,
+                 sublen = (table[index] & 15) - FIRSTBITS;
+          for (size_t i = reverse >> FIRSTBITS; i < (1u << sublen);
+               i += 1u << (l - FIRSTBITS))
+            table[start + i] = (unsigned)((n << 4) | (l - FIRSTBITS));
         }
       }
-      void getTreeInflateDynamic(
-          HuffmanTree& tree, HuffmanTree& treeD, const unsigned char* in,
-          size_t& bp,
-          size_t
-              inlength) {  // get the tree of a deflated block with dynamic
-                           // tree, the tree itself is also Huffman compressed
-                           // with a known tree
-        std::vector<unsigned long> bitlen(288, 0), bitlenD(32, 0);
-        if (bp >> 3 >= inlength - 2) {
-          error = 49;
-          return;
-        }  // the bit pointer is or will go past the memory
-        size_t HLIT = readBitsFromStream(bp, in, 5) +
-                      257;  // number of literal/length codes + 257
-        size_t HDIST =
-            readBitsFromStream(bp, in, 5) + 1;  // number of dist codes + 1
-        size_t HCLEN = readBitsFromStream(bp, in, 4) +
-                       4;  // number of code length codes + 4
-        std::vector<unsigned long> codelengthcode(
-            19);  // lengths of tree to decode the lengths of the dynamic tree
-        for (size_t i = 0; i < 19; i++)
-          codelengthcode[CLCL[i]] =
-              (i < HCLEN) ? readBitsFromStream(bp, in, 3) : 0;
-        error = codelengthcodetree.makeFromLengths(codelengthcode, 7);
-        if (error) return;
-        size_t i = 0, replength;
-        while (i < HLIT + HDIST) {
-          unsigned long code =
-              huffmanDecodeSymbol(in, bp, codelengthcodetree, inlength);
-          if (error) return;
-          if (code <= 15) {
-            if (i < HLIT)
-              bitlen[i++] = code;
-            else
-              bitlenD[i++ - HLIT] = code;
-          }                     // a length code
-          else if (code == 16)  // repeat previous
-          {
-            if (bp >> 3 >= inlength) {
-              error = 50;
-              return;
-            }  // error, bit pointer jumps past memory
-            replength = 3 + readBitsFromStream(bp, in, 2);
-            unsigned long value;  // set value to the previous code
-            if ((i - 1) < HLIT)
-              value = bitlen[i - 1];
-            else
-              value = bitlenD[i - HLIT - 1];
-            for (size_t n = 0; n < replength;
-                 n++)  // repeat this value in the next lengths
-            {
-              if (i >= HLIT + HDIST) {
-                error = 13;
-                return;
-              }  // error: i is larger than the amount of codes
-              if (i < HLIT)
-                bitlen[i++] = value;
-              else
-                bitlenD[i++ - HLIT] = value;
-            }
-          } else if (code == 17)  // repeat "0" 3-10 times
-          {
-            if (bp >> 3 >= inlength) {
-              error = 50;
-              return;
-            }  // error, bit pointer jumps past memory
-            replength = 3 + readBitsFromStream(bp, in, 3);
-            for (size_t n = 0; n < replength;
-                 n++)  // repeat this value in the next lengths
-            {
-              if (i >= HLIT + HDIST) {
-                error = 14;
-                return;
-              }  // error: i is larger than the amount of codes
-              if (i < HLIT)
-                bitlen[i++] = 0;
-              else
-                bitlenD[i++ - HLIT] = 0;
-            }
-          } else if (code == 18)  // repeat "0" 11-138 times
-          {
-            if (bp >> 3 >= inlength) {
-              error = 50;
-              return;
-            }  // error, bit pointer jumps past memory
-            replength = 11 + readBitsFromStream(bp, in, 7);
-            for (size_t n = 0; n < replength;
-                 n++)  // repeat this value in the next lengths
-            {
-              if (i >= HLIT + HDIST) {
-                error = 15;
-                return;
-              }  // error: i is larger than the amount of codes
-              if (i < HLIT)
-                bitlen[i++] = 0;
-              else
-                bitlenD[i++ - HLIT] = 0;
-            }
-          } else {
-            error = 16;
-            return;
-          }  // error: somehow an unexisting code appeared. This can never
-             // happen.
-        }
-        if (bitlen[256] == 0) {
-          error = 64;
-          return;
-        }  // the length of the end code 256 must be larger than 0
-        error = tree.makeFromLengths(bitlen, 15);
-        if (error)
-          return;  // now we've finally got HLIT and HDIST, so generate the code
-                   // trees, and the function is done
-        error = treeD.makeFromLengths(bitlenD, 15);
-        if (error) return;
+      return 0;
+    }
+    static unsigned long reverseBits(unsigned long bits, unsigned long num) {
+      unsigned long result = 0;
+      for (unsigned long i = 0; i < num; i++)
+        result |= ((bits >> (num - i - 1)) & 1) << i;
+      return result;
+    }
+    std::vector<unsigned> table;  // root table of 2^FIRSTBITS entries,
+                                  // followed by the subtables for long codes
+    size_t allocations;  // times the table had to grow, it is kept and
+                         // reused by the next trees
+  };
+  struct Inflator {
+    // The inflator can stop between two symbols when it runs out of input or
+    // of room in the out buffer, and go on from there in the next call, so a
+    // zlib stream can be decompressed while it arrives.
+    enum State { HEADER, BLOCK, STORED, HUFFMAN, DONE };
+    static const size_t MAXSYMBOLBITS = 48;    // a length/distance pair
+    static const size_t MAXHEADERBITS = 4608;  // a dynamic block header
+    static const size_t SLACK = 16;  // room the out buffer needs after outsize,
+                                     // back references are copied in whole
+                                     // blocks of up to 16 bytes that may run
+                                     // past their end
+    int error;
+    State state;
+    unsigned long BFINAL, BTYPE;  // of the current block
+    size_t storedleft;            // bytes left in the current stored block
+    size_t skipbits;  // bits of the first input byte that were already used
+    unsigned char* out;
+    size_t outsize;   // bytes the out buffer can hold
+    size_t outlimit;  // stop before the next symbol once outpos reaches this
+    bool outfinal;    // the decompressed data has to end exactly at outsize
+    size_t outpos;    // byte pointer in out
+    void reset(unsigned char* out_,
+               size_t outsize_) {  // start a new stream, the whole of it is
+                                   // decompressed into out_, which holds
+                                   // outsize_ + SLACK bytes
+      error = 0;
+      state = HEADER;
+      skipbits = 0;
+      out = out_;
+      outsize = outsize_;
+      outlimit = (size_t)(-1);
+      outfinal = true;
+      outpos = 0;
+    }
+    size_t inflate(const unsigned char* in, size_t insize,
+                   bool final) {  // decompress what it can of in, returns the
+                                  // number of bytes used up. Unless final, more
+                                  // input may follow: it stops before a symbol
+                                  // that could run past the end of in, and the
+                                  // unused bytes have to be passed again
+      if (state == HEADER && insize < 2) {
+        if (final) error = 53;  // error, size of zlib data too small
+        return 0;
       }
-      void inflateHuffmanBlock(std::vector<unsigned char>& out,
-                               const unsigned char* in, size_t& bp, size_t& pos,
-                               size_t inlength, unsigned long btype) {
-        if (btype == 1) {
-          generateFixedTrees(codetree, codetreeD);
-        } else if (btype == 2) {
-          getTreeInflateDynamic(codetree, codetreeD, in, bp, inlength);
-          if (error) return;
-        }
-        for (;;) {
-          unsigned long code = huffmanDecodeSymbol(in, bp, codetree, inlength);
-          if (error) return;
-          if (code == 256)
-            return;              // end code
-          else if (code <= 255)  // literal symbol
-          {
-            if (pos >= out.size())
-              out.resize((pos + 1) * 2);  // reserve more room
-            out[pos++] = (unsigned char)(code);
-          } else if (code >= 257 && code <= 285)  // length code
-          {
-            size_t length = LENBASE[code - 257],
-                   numextrabits = LENEXTRA[code - 257];
-            if ((bp >> 3) >= inlength) {
-              error = 51;
-              return;
-            }  // error, bit pointer will jump past memory
-            length += readBitsFromStream(bp, in, numextrabits);
-            unsigned long codeD =
-                huffmanDecodeSymbol(in, bp, codetreeD, inlength);
-            if (error) return;
-            if (codeD > 29) {
-              error = 18;
-              return;
-            }  // error: invalid dist code (30-31 are never used)
-            unsigned long dist = DISTBASE[codeD],
-                          numextrabitsD = DISTEXTRA[codeD];
-            if ((bp >> 3) >= inlength) {
-              error = 51;
-              return;
-            }  // error, bit pointer will jump past memory
-            dist += readBitsFromStream(bp, in, numextrabitsD);
-            size_t start = pos, back = start - dist;  // backwards
-            if (pos + length >= out.size())
-              out.resize((pos + length) * 2);  // reserve more room
-            for (size_t i = 0; i < length; i++) {
-              out[pos++] = out[back++];
-              if (back >= start) back = start - dist;
-            }
+      BitReader reader(in, insize);
+      size_t inbits = final ? (size_t)(-1) - MAXHEADERBITS : insize * 8;
+      size_t pos = outpos;
+      reader.refill();
+      reader.consume(skipbits);
+      if (state == HEADER) readZlibHeader(reader);
+      while (!error && state != DONE) {
+        if (state == BLOCK) {
+          if (reader.bitpos() + MAXHEADERBITS > inbits)
+            break;  // wait for enough input to hold any block header
+          reader.refill();
+          if (reader.bitpos() >= reader.size * 8) {
+            error = 52;
+            break;
+          }  // error, bit pointer will jump past memory
+          BFINAL = reader.read(1);
+          BTYPE = reader.read(2);
+          if (BTYPE == 3)
+            error = 20;  // error: invalid BTYPE
+          else if (BTYPE == 0)
+            readStoredHeader(reader);
+          else {
+            if (BTYPE == 2) getTreeInflateDynamic(codetree, codetreeD, reader);
+            state = HUFFMAN;
           }
-        }
+        } else if (state == STORED) {
+          if (!inflateNoCompression(reader, pos, final)) break;
+        } else if (!inflateHuffmanBlock(reader, pos, inbits))
+          break;
       }
-      void inflateNoCompression(std::vector<unsigned char>& out,
-                                const unsigned char* in, size_t& bp,
-                                size_t& pos, size_t inlength) {
-        while ((bp & 0x7) != 0) bp++;  // go to first boundary of byte
-        size_t p = bp / 8;
-        if (p >= inlength - 4) {
-          error = 52;
-          return;
-        }  // error, bit pointer will jump past memory
-        unsigned long LEN = in[p] + 256 * in[p + 1],
-                      NLEN = in[p + 2] + 256 * in[p + 3];
-        p += 4;
-        if (LEN + NLEN != 65535) {
-          error = 21;
-          return;
-        }  // error: NLEN is not one's complement of LEN
-        if (pos + LEN >= out.size()) out.resize(pos + LEN);
-        if (p + LEN > inlength) {
-          error = 23;
-          return;
-        }  // error: reading outside of in buffer
-        for (unsigned long n = 0; n < LEN; n++)
-          out[pos++] = in[p++];  // read LEN bytes of literal data
-        bp = p * 8;
-      }
-    };
-    int decompress(std::vector<unsigned char>& out,
-                   const std::vector<unsigned char>& in)  // returns error value
-    {
-      Inflator inflator;
-      if (in.size() < 2) {
-        return 53;
-      }  // error, size of zlib data too small
-      if ((in[0] * 256 + in[1]) % 31 != 0) {
-        return 24;
+      outpos = pos;
+      if (!error && state == DONE && (!outfinal || pos != outsize))
+        error = 91;  // error: less data than the size given by the header
+      size_t bitpos = reader.bitpos();
+      skipbits = bitpos & 7;
+      return bitpos / 8;
+    }
+    void readZlibHeader(BitReader& reader) {
+      unsigned long CMF = reader.read(8), FLG = reader.read(8);
+      if ((CMF * 256 + FLG) % 31 != 0) {
+        error = 24;
+        return;
       }  // error: 256 * in[0] + in[1] must be a multiple of 31, the FCHECK
          // value is supposed to be made that way
-      unsigned long CM = in[0] & 15, CINFO = (in[0] >> 4) & 15,
-                    FDICT = (in[1] >> 5) & 1;
+      unsigned long CM = CMF & 15, CINFO = (CMF >> 4) & 15,
+                    FDICT = (FLG >> 5) & 1;
       if (CM != 8 || CINFO > 7) {
-        return 25;
-      }  // error: only compression method 8: inflate with sliding window of 32k
-         // is supported by the PNG spec
+        error = 25;
+        return;
+      }  // error: only compression method 8: inflate with sliding window of
+         // 32k is supported by the PNG spec
       if (FDICT != 0) {
-        return 26;
+        error = 26;
+        return;
       }  // error: the specification of PNG says about the zlib stream: "The
          // additional flags shall not specify a preset dictionary."
-      inflator.inflate(out, in, 2);
-      return inflator.error;  // note: adler32 checksum was skipped and ignored
+      state = BLOCK;
     }
-  };
-  struct PNG  // nested functions for PNG decoding
-  {
-    struct Info {
-      unsigned long width, height, colorType, bitDepth, compressionMethod,
-          filterMethod, interlaceMethod, key_r, key_g, key_b;
-      bool key_defined;  // is a transparent color key given?
-      std::vector<unsigned char> palette;
-    } info;
-    int error;
-    void decode(std::vector<unsigned char>& out, const unsigned char* in,
-                size_t size, bool convert_to_rgba32) {
-      error = 0;
-      if (size == 0 || in == 0) {
-        error = 48;
+    static const HuffmanTree& fixedTree(bool distance) {
+      // the trees of a deflated block with fixed tree never change, so
+      // they are built once and shared by every BTYPE=1 block
+      struct FixedTrees {
+        FixedTrees() {
+          unsigned long bitlen[288], bitlenD[32];
+          for (size_t i = 0; i <= 143; i++) bitlen[i] = 8;
+          for (size_t i = 144; i <= 255; i++) bitlen[i] = 9;
+          for (size_t i = 256; i <= 279; i++) bitlen[i] = 7;
+          for (size_t i = 280; i <= 287; i++) bitlen[i] = 8;
+          for (size_t i = 0; i < 32; i++) bitlenD[i] = 5;
+          tree.makeFromLengths(bitlen, 288, 15);
+          treeD.makeFromLengths(bitlenD, 32, 15);
+        }
+        HuffmanTree tree, treeD;
+      };
+      static const FixedTrees fixed;
+      return distance ? fixed.treeD : fixed.tree;
+    }
+    HuffmanTree codetree, codetreeD,
+        codelengthcodetree;  // the code tree for Huffman codes, dist codes,
+                             // and code length codes
+    size_t allocations() const {  // heap allocations of the trees so far
+      return codetree.allocations + codetreeD.allocations +
+             codelengthcodetree.allocations;
+    }
+    unsigned long huffmanDecodeSymbol(
+        BitReader& reader,
+        const HuffmanTree& codetree) {  // decode a single symbol with given
+                                        // code tree, the reader must have at
+                                        // least 15 bits buffered. return
+                                        // value is the symbol
+      unsigned entry = codetree.table[reader.peek(FIRSTBITS)];
+      unsigned long length = entry & 15;
+      if (length > FIRSTBITS) {  // long code, look it up in the subtable
+        reader.consume(FIRSTBITS);
+        entry = codetree.table[(entry >> 4) +
+                               reader.peek(length - FIRSTBITS)];
+        length = entry & 15;
+      }
+      if (length == 0) {
+        error = 11;
+        return 0;
+      }  // error: no code in the tree matches the bits in the stream
+      reader.consume(length);
+      return entry >> 4;
+    }
+    void getTreeInflateDynamic(
+        HuffmanTree& tree, HuffmanTree& treeD,
+        BitReader& reader) {  // get the tree of a deflated block with
+                              // dynamic tree, the tree itself is also
+                              // Huffman compressed with a known tree
+      unsigned long bitlen[288] = {0}, bitlenD[32] = {0};
+      reader.refill();
+      size_t HLIT = reader.read(5) + 257;  // number of literal/length codes +
+                                           // 257
+      size_t HDIST = reader.read(5) + 1;   // number of dist codes + 1
+      size_t HCLEN = reader.read(4) + 4;  // number of code length codes + 4
+      unsigned long codelengthcode[19];  // lengths of tree to decode the
+                                         // lengths of the dynamic tree
+      for (size_t i = 0; i < 19; i++) {
+        if (i == 14) reader.refill();  // 19 * 3 bits don't fit at once
+        codelengthcode[CLCL[i]] = (i < HCLEN) ? reader.read(3) : 0;
+      }
+      if (reader.overrun()) {
+        error = 49;
         return;
-      }  // the given data is empty
-      readPngHeader(&in[0], size);
+      }  // the bit pointer is or will go past the memory
+      error = codelengthcodetree.makeFromLengths(codelengthcode, 19, 7);
       if (error) return;
-      size_t pos = 33;  // first byte of the first chunk after the header
-      std::vector<unsigned char> idat;  // the data from idat chunks
-      bool IEND = false;
-      //      bool known_type = true;
-      info.key_defined = false;
-      while (!IEND)  // loop through the chunks, ignoring unknown chunks and
-                     // stopping at IEND chunk. IDAT data is put at the start of
-                     // the in buffer
-      {
-        if (pos + 8 >= size) {
-          error = 30;
-          return;
-        }  // error: size of the in buffer too small to contain next chunk
-        size_t chunkLength = read32bitInt(&in[pos]);
-        pos += 4;
-        if (chunkLength > 2147483647) {
-          error = 63;
-          return;
-        }
-        if (pos + chunkLength >= size) {
-          error = 35;
-          return;
-        }  // error: size of the in buffer too small to contain next chunk
-        if (in[pos + 0] == 'I' && in[pos + 1] == 'D' && in[pos + 2] == 'A' &&
-            in[pos + 3] == 'T')  // IDAT chunk, containing compressed image data
-        {
-          idat.insert(idat.end(), &in[pos + 4], &in[pos + 4 + chunkLength]);
-          pos += (4 + chunkLength);
-        } else if (in[pos + 0] == 'I' && in[pos + 1] == 'E' &&
-                   in[pos + 2] == 'N' && in[pos + 3] == 'D') {
-          pos += 4;
-          IEND = true;
-        } else if (in[pos + 0] == 'P' && in[pos + 1] == 'L' &&
-                   in[pos + 2] == 'T' &&
-                   in[pos + 3] == 'E')  // palette chunk (PLTE)
+      size_t i = 0, replength;
+      while (i < HLIT + HDIST) {
+        reader.refill();  // at most 7 bits of code and 7 extra bits
+        unsigned long code = huffmanDecodeSymbol(reader, codelengthcodetree);
+        if (error) return;
+        if (code <= 15) {
+          if (i < HLIT)
+            bitlen[i++] = code;
+          else
+            bitlenD[i++ - HLIT] = code;
+        }                     // a length code
+        else if (code == 16)  // repeat previous
         {
-          pos += 4;  // go after the 4 letters
-          info.palette.resize(4 * (chunkLength / 3));
-          if (info.palette.size() > (4 * 256)) {
-            error = 38;
+          if (i == 0) {
+            error = 54;
             return;
-          }  // error: palette too big
-          for (size_t i = 0; i < info.palette.size(); i += 4) {
-            for (size_t j = 0; j < 3; j++)
-              info.palette[i + j] = in[pos++];  // RGB
-            info.palette[i + 3] = 255;          // alpha
+          }  // error: there is no previous code to repeat
+          replength = 3 + reader.read(2);
+          unsigned long value;  // set value to the previous code
+          if ((i - 1) < HLIT)
+            value = bitlen[i - 1];
+          else
+            value = bitlenD[i - HLIT - 1];
+          for (size_t n = 0; n < replength;
+               n++)  // repeat this value in the next lengths
+          {
+            if (i >= HLIT + HDIST) {
+              error = 13;
+              return;
+            }  // error: i is larger than the amount of codes
+            if (i < HLIT)
+              bitlen[i++] = value;
+            else
+              bitlenD[i++ - HLIT] = value;
           }
-        } else if (in[pos + 0] == 't' && in[pos + 1] == 'R' &&
-                   in[pos + 2] == 'N' &&
-                   in[pos + 3] == 'S')  // palette transparency chunk (tRNS)
+        } else if (code == 17)  // repeat "0" 3-10 times
         {
-          pos += 4;  // go after the 4 letters
-          if (info.colorType == 3) {
-            if (4 * chunkLength > info.palette.size()) {
-              error = 39;
-              return;
-            }  // error: more alpha values given than there are palette entries
-            for (size_t i = 0; i < chunkLength; i++)
-              info.palette[4 * i + 3] = in[pos++];
-          } else if (info.colorType == 0) {
-            if (chunkLength != 2) {
-              error = 40;
-              return;
-            }  // error: this chunk must be 2 bytes for greyscale image
-            info.key_defined = 1;
-            info.key_r = info.key_g = info.key_b = 256 * in[pos] + in[pos + 1];
-            pos += 2;
-          } else if (info.colorType == 2) {
-            if (chunkLength != 6) {
-              error = 41;
+          replength = 3 + reader.read(3);
+          for (size_t n = 0; n < replength;
+               n++)  // repeat this value in the next lengths
+          {
+            if (i >= HLIT + HDIST) {
+              error = 14;
               return;
-            }  // error: this chunk must be 6 bytes for RGB image
-            info.key_defined = 1;
-            info.key_r = 256 * in[pos] + in[pos + 1];
-            pos += 2;
-            info.key_g = 256 * in[pos] + in[pos + 1];
-            pos += 2;
-            info.key_b = 256 * in[pos] + in[pos + 1];
-            pos += 2;
-          } else {
-            error = 42;
-            return;
-          }     // error: tRNS chunk not allowed for other color models
-        } else  // it's not an implemented chunk type, so ignore it: skip over
-                // the data
-        {
-          if (!(in[pos + 0] & 32)) {
-            error = 69;
-            return;
-          }  // error: unknown critical chunk (5th bit of first byte of chunk
-             // type is 0)
-          pos += (chunkLength + 4);  // skip 4 letters and uninterpreted data of
-                                     // unimplemented chunk
-          // known_type = false;
-        }
-        pos += 4;  // step over CRC (which is ignored)
-      }
-      unsigned long bpp = getBpp(info);
-      std::vector<unsigned char> scanlines(
-          ((info.width * (info.height * bpp + 7)) / 8) +
-          info.height);  // now the out buffer will be filled
-      Zlib zlib;         // decompress with the Zlib decompressor
-      error = zlib.decompress(scanlines, idat);
-      if (error) return;  // stop if the zlib decompressor returned an error
-      size_t bytewidth = (bpp + 7) / 8,
-             outlength = (info.height * info.width * bpp + 7) / 8;
-      out.resize(outlength);  // time to fill the out buffer
-      unsigned char* out_ = outlength ? &out[0] : 0;  // use a regular pointer
-                                                      // to the std::vector for
-                                                      // faster code if compiled
-                                                      // without optimization
-      if (info.interlaceMethod == 0)  // no interlace, just filter
-      {
-        size_t linestart = 0, linelength = (info.width * bpp + 7) /
-                                           8;  // length in bytes of a scanline,
-                                               // excluding the filtertype byte
-        if (bpp >= 8)                          // byte per byte
-          for (unsigned long y = 0; y < info.height; y++) {
-            unsigned long filterType = scanlines[linestart];
-            const unsigned char* prevline =
-                (y == 0) ? 0 : &out_[(y - 1) * info.width * bytewidth];
-            unFilterScanline(&out_[linestart - y], &scanlines[linestart + 1],
-                             prevline, bytewidth, filterType, linelength);
-            if (error) return;
-            linestart += (1 + linelength);  // go to start of next scanline
+            }  // error: i is larger than the amount of codes
+            if (i < HLIT)
+              bitlen[i++] = 0;
+            else
+              bitlenD[i++ - HLIT] = 0;
           }
-        else  // less than 8 bits per pixel, so fill it up bit per bit
+        } else if (code == 18)  // repeat "0" 11-138 times
         {
-          std::vector<unsigned char> templine((info.width * bpp + 7) >>
-                                              3);  // only used if bpp < 8
-          for (size_t y = 0, obp = 0; y < info.height; y++) {
-            unsigned long filterType = scanlines[linestart];
-            const unsigned char* prevline =
-                (y == 0) ? 0 : &out_[(y - 1) * info.width * bytewidth];
-            unFilterScanline(&templine[0], &scanlines[linestart + 1], prevline,
-                             bytewidth, filterType, linelength);
-            if (error) return;
-            for (size_t bp = 0; bp < info.width * bpp;)
-              setBitOfReversedStream(
-                  obp, out_, readBitFromReversedStream(bp, &templine[0]));
-            linestart += (1 + linelength);  // go to start of next scanline
+          replength = 11 + reader.read(7);
+          for (size_t n = 0; n < replength;
+               n++)  // repeat this value in the next lengths
+          {
+            if (i >= HLIT + HDIST) {
+              error = 15;
+              return;
+            }  // error: i is larger than the amount of codes
+            if (i < HLIT)
+              bitlen[i++] = 0;
+            else
+              bitlenD[i++ - HLIT] = 0;
           }
+        } else {
+          error = 16;
+          return;
+        }  // error: somehow an unexisting code appeared. This can never
+           // happen.
+        if (reader.overrun()) {
+          error = 50;
+          return;
+        }  // error, bit pointer jumps past memory
+      }
+      if (bitlen[256] == 0) {
+        error = 64;
+        return;
+      }  // the length of the end code 256 must be larger than 0
+      error = tree.makeFromLengths(bitlen, 288, 15);
+      if (error)
+        return;  // now we've finally got HLIT and HDIST, so generate the code
+                 // trees, and the function is done
+      error = treeD.makeFromLengths(bitlenD, 32, 15);
+      if (error) return;
+    }
+    bool inflateHuffmanBlock(BitReader& reader, size_t& pos,
+                             size_t inbits) {  // false if it stopped before
+                                               // the end code
+      const HuffmanTree *tree = &codetree, *treeD = &codetreeD;
+      if (BTYPE == 1) {
+        tree = &fixedTree(false);
+        treeD = &fixedTree(true);
+      }
+      for (;;) {
+        if (reader.bitpos() + MAXSYMBOLBITS > inbits || pos >= outlimit)
+          return false;  // the symbol may be cut off or not fit, stop here
+        // one refill covers the longest length/distance pair: 15 bits of
+        // code, 5 extra bits, 15 bits of distance code and 13 extra bits
+        reader.refill();
+        unsigned long code = huffmanDecodeSymbol(reader, *tree);
+        if (error) return true;
+        if (reader.overrun()) {
+          error = 10;
+          return true;
+        }  // error: end reached without endcode
+        if (code == 256) {  // end code
+          state = BFINAL ? DONE : BLOCK;
+          return true;
+        } else if (code <= 255)  // literal symbol
+        {
+          if (pos >= outsize) {
+            error = 91;
+            return true;
+          }  // error: more data than the size given by the header
+          out[pos++] = (unsigned char)(code);
+        } else if (code >= 257 && code <= 285)  // length code
+        {
+          size_t length =
+              LENBASE[code - 257] + reader.read(LENEXTRA[code - 257]);
+          unsigned long codeD = huffmanDecodeSymbol(reader, *treeD);
+          if (error) return true;
+          if (codeD > 29) {
+            error = 18;
+            return true;
+          }  // error: invalid dist code (30-31 are never used)
+          unsigned long dist =
+              DISTBASE[codeD] + reader.read(DISTEXTRA[codeD]);
+          if (dist > pos) {
+            error = 93;
+            return true;
+          }  // error: distance reaches back before the start of the data
+          if (length > outsize - pos) {
+            error = 91;
+            return true;
+          }  // error: more data than the size given by the header
+          copyMatch(&out[pos], dist, length);
+          pos += length;
         }
-      } else  // interlaceMethod is 1 (Adam7)
-      {
-        size_t passw[7] = {(info.width + 7) / 8, (info.width + 3) / 8,
-                           (info.width + 3) / 4, (info.width + 1) / 4,
-                           (info.width + 1) / 2, (info.width + 0) / 2,
-                           (info.width + 0) / 1};
-        size_t passh[7] = {(info.height + 7) / 8, (info.height + 7) / 8,
-                           (info.height + 3) / 8, (info.height + 3) / 4,
-                           (info.height + 1) / 4, (info.height + 1) / 2,
-                           (info.height + 0) / 2};
-        size_t passstart[7] = {0};
-        size_t pattern[28] =
-            {0, 4, 0, 2, 0, 1, 0, 0, 0, 4, 0, 2, 0, 1,
-             8, 8, 4, 4, 2, 2, 1, 8, 8, 8, 4, 4, 2, 2};  // values
-                                                         // for the
-                                                         // adam7
-                                                         // passes
-        for (int i = 0; i < 6; i++)
-          passstart[i + 1] =
-              passstart[i] +
-              passh[i] * ((passw[i] ? 1 : 0) + (passw[i] * bpp + 7) / 8);
-        std::vector<unsigned char> scanlineo((info.width * bpp + 7) / 8),
-            scanlinen((info.width * bpp + 7) / 8);  //"old" and "new" scanline
-        for (int i = 0; i < 7; i++)
-          adam7Pass(&out_[0], &scanlinen[0], &scanlineo[0],
-                    &scanlines[passstart[i]], info.width, pattern[i],
-                    pattern[i + 7], pattern[i + 14], pattern[i + 21], passw[i],
-                    passh[i], bpp);
-      }
-      if (convert_to_rgba32 &&
-          (info.colorType != 6 || info.bitDepth != 8))  // conversion needed
-      {
-        std::vector<unsigned char> data = out;
-        error = convert(out, &data[0], info, info.width, info.height);
       }
     }
-    void readPngHeader(const unsigned char* in,
-                       size_t inlength)  // read the information from the header
-                                         // and store it in the Info
+    static void copyMatch(unsigned char* dst, size_t dist,
+                          size_t length) {  // copy length bytes from dist
+                                            // bytes back, writing up to 15
+                                            // bytes past the end
+      const unsigned char* src = dst - dist;
+      unsigned char* end = dst + length;
+      if (dist >= 16) {  // blocks of 16 bytes don't overlap their source
+        do {
+          std::memcpy(dst, src, 16);
+          dst += 16;
+          src += 16;
+        } while (dst < end);
+      } else if (dist >= 8) {
+        do {
+          std::memcpy(dst, src, 8);
+          dst += 8;
+          src += 8;
+        } while (dst < end);
+      } else {  // a short pattern that repeats, as in runs of one color:
+                // replicate it into 16 bytes, written a whole number of
+                // periods apart
+        unsigned char pattern[16];
+        for (size_t i = 0; i < 16; i++) pattern[i] = src[i % dist];
+        size_t step = 16 - 16 % dist;
+        do {
+          std::memcpy(dst, pattern, 16);
+          dst += step;
+        } while (dst < end);
+      }
+    }
+    void readStoredHeader(BitReader& reader) {
+      reader.consume(reader.count & 7);  // go to first boundary of byte
+      unsigned long LEN = reader.read(16), NLEN = reader.read(16);
+      if (reader.overrun()) {
+        error = 52;
+        return;
+      }  // error, bit pointer will jump past memory
+      if (LEN + NLEN != 65535) {
+        error = 21;
+        return;
+      }  // error: NLEN is not one's complement of LEN
+      storedleft = LEN;
+      state = STORED;
+    }
+    bool inflateNoCompression(BitReader& reader, size_t& pos,
+                              bool final) {  // copy what there is of the
+                                             // stored data, false if it
+                                             // stopped before the end of it
+      if (outfinal && storedleft > outsize - pos) {
+        error = 91;
+        return true;
+      }  // error: more data than the size given by the header
+      size_t p = reader.bitpos() / 8, n = storedleft;
+      if (n > reader.size - p) n = reader.size - p;
+      if (n > outsize - pos) n = outsize - pos;
+      if (n != 0) std::memcpy(&out[pos], &reader.data[p], n);
+      pos += n;
+      storedleft -= n;
+      reader.seek(p + n);
+      if (storedleft == 0) {
+        state = BFINAL ? DONE : BLOCK;
+        return true;
+      }
+      if (final && p + n == reader.size) {
+        error = 23;
+        return true;
+      }  // error: reading outside of in buffer
+      return false;
+    }
+  };
+  int decompress(Inflator& inflator, unsigned char* out, size_t outsize,
+                 const unsigned char* in, size_t insize,
+                 unsigned* adler)  // returns error value, out must have
+                                   // Inflator::SLACK bytes of room after
+                                   // outsize. If adler isn't 0, it gets the
+                                   // adler32 checksum that follows the data,
+                                   // for the caller to check. The inflator
+                                   // keeps its trees for the next stream
+  {
+    inflator.reset(out, outsize);
+    size_t used = inflator.inflate(in, insize, true);
+    if (inflator.error || !adler) return inflator.error;
+    used += inflator.skipbits != 0;  // the checksum starts at a whole byte
+    if (insize - used < 4) return 58;  // error: the checksum is missing
+    *adler = readChecksum(&in[used]);
+    return 0;
+  }
+};
+struct PNG  // nested functions for PNG decoding
+{
+  struct Info {
+    unsigned long width, height, colorType, bitDepth, compressionMethod,
+        filterMethod, interlaceMethod, key_r, key_g, key_b;
+    bool key_defined;  // is a transparent color key given?
+    unsigned char palette[4 * 256];  // RGBA palette entries
+    size_t palettesize;              // in bytes, 4 per entry
+  } info;
+  int error;
+  bool verify;  // check the CRC of each chunk and the adler32 of the zlib data
+  const unsigned char* idat;    // the data of the first idat chunk
+  size_t idatsize, idatchunks;  // total size and number of the idat chunks
+  struct Pass {  // a reduced image of an Adam7 pass, or the whole image
+    size_t left, top, spacex, spacey, w, h;
+  };
+  // The buffers of decodeImage are kept from one image to the next, so that
+  // a PNG that decodes many images stops allocating once they are as large as
+  // the largest image needs.
+  std::vector<unsigned char> scanlines, gathered;
+  Zlib::Inflator inflator;
+  size_t allocations;  // times scanlines or gathered had to grow
+  Format format;  // of the converted pixels
+  bool premultiply;  // scale the color of converted pixels by their alpha
+  bool flip;         // the last row of the image comes first in the output
+  unsigned char swizzle[4];  // converted channel c is RGBA channel
+                             // swizzle[c], before packing
+  PNG()
+      : error(0),
+        verify(false),
+        allocations(0),
+        format(FORMAT_RGBA8),
+        premultiply(false),
+        flip(false) {
+    for (unsigned char c = 0; c < 4; c++) swizzle[c] = c;
+  }
+  bool setSwizzle(const char* order) {  // order names the RGBA channel of
+                                        // each output channel, e.g. "BGRA".
+                                        // false if it isn't 4 of R, G, B, A
+    static const char names[] = "RGBA";
+    unsigned char channels[4];
+    for (size_t c = 0; c < 4; c++) {
+      const char* name = order[c] ? std::strchr(names, order[c]) : 0;
+      if (!name) return false;
+      channels[c] = (unsigned char)(name - names);
+    }
+    std::memcpy(swizzle, channels, 4);
+    return true;
+  }
+  bool swizzled() const {
+    return swizzle[0] != 0 || swizzle[1] != 1 || swizzle[2] != 2 ||
+           swizzle[3] != 3;
+  }
+  void decode(std::vector<unsigned char>& out, const unsigned char* in,
+              size_t size, bool convert_to_rgba32) {
+    readChunks(in, size);
+    if (error) return;
+    bool convert = needsConversion(convert_to_rgba32);
+    // The header gives the exact size of the output, so it is allocated once
+    // with its final size. Rows of less than 8 bits per pixel follow each
+    // other without padding.
+    out.resize(convert ? info.height * getRowSize(true)
+                       : (info.height * info.width * getBpp(info) + 7) / 8);
+    decodeImage(out.data(), 0, out.size(), in, size, convert);
+  }
+  void decode(unsigned char* out, size_t stride, size_t outsize,
+              const unsigned char* in, size_t size,
+              bool convert_to_rgba32) {  // decode into a buffer of the
+                                         // caller, row y starts at
+                                         // out + y * stride
+    readChunks(in, size);
+    if (error) return;
+    bool convert = needsConversion(convert_to_rgba32);
+    size_t rowsize = getRowSize(convert), h = info.height;
+    if (stride < rowsize || stride == 0 ||
+        (h != 0 &&
+         (outsize < rowsize || (outsize - rowsize) / stride < h - 1))) {
+      error = 94;
+      return;
+    }  // error: the given buffer is too small for the image
+    decodeImage(out, stride, 0, in, size, convert);
+  }
+  void readChunks(const unsigned char* in,
+                  size_t size) {  // read the header and the chunks, and find
+                                  // the image data
+    error = 0;
+    if (size == 0 || in == 0) {
+      error = 48;
+      return;
+    }  // the given data is empty
+    readPngHeader(&in[0], size);
+    if (error) return;
+    size_t pos = 33;  // first byte of the first chunk after the header
+    idat = 0;
+    idatsize = 0;
+    idatchunks = 0;
+    bool IEND = false;
+    while (!IEND)  // loop through the chunks, ignoring unknown chunks and
+                   // stopping at IEND chunk
     {
-      if (inlength < 29) {
-        error = 27;
+      if (pos + 8 >= size) {
+        error = 30;
         return;
-      }  // error: the data length is smaller than the length of the header
-      if (in[0] != 137 || in[1] != 80 || in[2] != 78 || in[3] != 71 ||
-          in[4] != 13 || in[5] != 10 || in[6] != 26 || in[7] != 10) {
-        error = 28;
+      }  // error: size of the in buffer too small to contain next chunk
+      size_t chunkLength = read32bitInt(&in[pos]);
+      pos += 4;
+      if (chunkLength > 2147483647) {
+        error = 63;
         return;
-      }  // no PNG signature
-      if (in[12] != 'I' || in[13] != 'H' || in[14] != 'D' || in[15] != 'R') {
-        error = 29;
+      }
+      if (size - pos < 8 || chunkLength > size - pos - 8) {
+        error = 35;
         return;
-      }  // error: it doesn't start with a IHDR chunk!
-      info.width = read32bitInt(&in[16]);
-      info.height = read32bitInt(&in[20]);
-      info.bitDepth = in[24];
-      info.colorType = in[25];
-      info.compressionMethod = in[26];
-      if (in[26] != 0) {
-        error = 32;
+      }  // error: size of the in buffer too small to contain the type, data
+         // and CRC of the chunk
+      bool IENDchunk = in[pos + 0] == 'I' && in[pos + 1] == 'E' &&
+                       in[pos + 2] == 'N' && in[pos + 3] == 'D';
+      if (verify && !IENDchunk) {  // IEND has no data to protect
+        checkCrc(&in[pos], chunkLength);
+        if (error) return;
+      }
+      if (in[pos + 0] == 'I' && in[pos + 1] == 'D' && in[pos + 2] == 'A' &&
+          in[pos + 3] == 'T')  // IDAT chunk, containing compressed image data
+      {
+        if (idatchunks++ == 0) idat = &in[pos + 4];
+        idatsize += chunkLength;
+      } else if (IENDchunk)
+        IEND = true;
+      else {
+        readChunk(&in[pos], &in[pos + 4], chunkLength);
+        if (error) return;
+      }
+      pos += 4 + chunkLength;  // go after the 4 letters and the data
+      pos += 4;                // step over CRC (checked above if verifying)
+    }
+    checkImageSize();
+  }
+  void checkImageSize() {
+    size_t w = info.width, h = info.height;
+    if (h != 0 && w > (size_t)(-1) / 8 / h) {
+      error = 92;
+      return;
+    }  // error: the image is too large to address its pixels in memory
+  }
+  void decodeImage(unsigned char* out, size_t stride, size_t scratchsize,
+                   const unsigned char* in, size_t size,
+                   bool convert) {  // decompress the image data and write the
+                                    // pixels, row y at out + y * stride. A
+                                    // stride of 0 packs the rows without
+                                    // padding. If scratchsize isn't 0, out
+                                    // is ours: it can be read back and its
+                                    // first scratchsize bytes used meanwhile
+    unsigned long bpp = getBpp(info);
+    size_t w = info.width;
+    Pass passes[7];
+    size_t numpasses = getPasses(passes), scanlinessize = 0;
+    for (size_t i = 0; i < numpasses; i++)
+      if (passes[i].w != 0)
+        scanlinessize += passes[i].h * (1 + (passes[i].w * bpp + 7) / 8);
+    // The image is decompressed into the scanlines buffer and unfiltered in
+    // place.
+    grow(scanlines, scanlinessize + Zlib::Inflator::SLACK);
+    if (idatchunks > 1) {  // the zlib stream must be contiguous: gather it
+                           // in the out buffer, which is free until the
+                           // scanlines get unfiltered
+      unsigned char* dst = out;
+      if (idatsize > scratchsize) {  // or else in a buffer of our own
+        grow(gathered, idatsize);
+        dst = &gathered[0];
+      }
+      gatherIdat(dst, in, size);
+      idat = dst;
+    }
+    Zlib zlib;  // decompress with the Zlib decompressor
+    unsigned adler = 1, expected = 0;  // the checksum is taken per row below,
+                                       // while the row is in the cache
+    error = zlib.decompress(inflator, scanlines.data(), scanlinessize, idat,
+                            idatsize, verify ? &expected : 0);
+    if (error) return;  // stop if the zlib decompressor returned an error
+    size_t bytewidth = (bpp + 7) / 8;
+    bool packed = stride == 0 && !convert && bpp < 8;
+    if (stride == 0) stride = getRowSize(convert);
+    for (size_t i = 0, passstart = 0; i < numpasses; i++) {
+      const Pass& pass = passes[i];
+      if (pass.w == 0) continue;
+      size_t passlinelength = (pass.w * bpp + 7) / 8;
+      const unsigned char* prevline = 0;
+      for (size_t y = 0; y < pass.h; y++) {
+        unsigned char* line = &scanlines[passstart + y * (1 + passlinelength)];
+        size_t outy = pass.top + pass.spacey * y;
+        if (flip) outy = info.height - 1 - outy;
+        if (verify)
+          adler = adler32(adler, line, 1 + passlinelength,
+                          picopng::simdLevel());
+        if (!convert && bpp >= 8 && numpasses == 1 && scratchsize != 0) {
+          // unfilter straight into the out buffer
+          unsigned char* recon = &out[outy * stride];
+          unFilterScanline(recon, line + 1, prevline, bytewidth, line[0],
+                           passlinelength);
+          prevline = recon;
+        } else {
+          unFilterScanline(line + 1, line + 1, prevline, bytewidth, line[0],
+                           passlinelength);
+          prevline = line + 1;
+          unsigned char* row = packed ? out : &out[outy * stride];
+          size_t outpixel = packed ? outy * w + pass.left : pass.left;
+          if (!error)
+            writeLine(row, line + 1, pass.w, outpixel, pass.spacex, bpp,
+                      convert);
+        }
+        if (error) return;
+      }
+      passstart += pass.h * (1 + passlinelength);
+    }
+    if (verify && adler != expected)
+      error = 58;  // error: the adler32 checksum doesn't match the data
+  }
+  void grow(std::vector<unsigned char>& buffer,
+            size_t size) {  // make buffer hold at least size bytes, its
+                            // memory is only ever replaced by more
+    if (size > buffer.capacity()) allocations++;
+    if (size > buffer.size()) buffer.resize(size);
+  }
+  bool needsConversion(bool convert_to_rgba32) const {
+    return convert_to_rgba32 &&
+           (format != FORMAT_RGBA8 || premultiply || swizzled() ||
+            info.colorType != 6 || info.bitDepth != 8);
+  }
+  size_t getRowSize(bool convert) const {  // bytes in a row of the output
+    return convert ? formatSize(format) * info.width
+                   : (info.width * getBpp(info) + 7) / 8;
+  }
+  size_t getPasses(Pass* passes) {  // fill in the passes of the image and
+                                    // return their number. A non-interlaced
+                                    // image is handled as a single pass
+                                    // covering all the pixels, an Adam7 image
+                                    // as seven passes of reduced images
+    static const size_t pattern[28] = {
+        0, 4, 0, 2, 0, 1, 0, 0, 0, 4, 0, 2, 0, 1,
+        8, 8, 4, 4, 2, 2, 1, 8, 8, 8, 4, 4, 2, 2};  // left, top, spacex,
+                                                    // spacey of the passes
+    size_t numpasses = info.interlaceMethod == 0 ? 1 : 7;
+    for (size_t i = 0; i < numpasses; i++) {
+      bool adam7 = numpasses == 7;
+      Pass& pass = passes[i];
+      pass.left = adam7 ? pattern[i] : 0;
+      pass.top = adam7 ? pattern[i + 7] : 0;
+      pass.spacex = adam7 ? pattern[i + 14] : 1;
+      pass.spacey = adam7 ? pattern[i + 21] : 1;
+      pass.w = (info.width + pass.spacex - pass.left - 1) / pass.spacex;
+      pass.h = (info.height + pass.spacey - pass.top - 1) / pass.spacey;
+    }
+    return numpasses;
+  }
+  void readChunk(const unsigned char* type, const unsigned char* data,
+                 size_t chunkLength) {  // read a PLTE or tRNS chunk, or
+                                        // check that an unknown chunk can be
+                                        // ignored. Only reads the data once
+                                        // the length was found valid
+    if (type[0] == 'P' && type[1] == 'L' && type[2] == 'T' &&
+        type[3] == 'E')  // palette chunk (PLTE)
+    {
+      if (chunkLength / 3 > 256) {
+        error = 38;
         return;
-      }  // error: only compression method 0 is allowed in the specification
-      info.filterMethod = in[27];
-      if (in[27] != 0) {
-        error = 33;
+      }  // error: palette too big
+      info.palettesize = 4 * (chunkLength / 3);
+      for (size_t i = 0; i < info.palettesize; i += 4) {
+        for (size_t j = 0; j < 3; j++)
+          info.palette[i + j] = *data++;  // RGB
+        info.palette[i + 3] = 255;        // alpha
+      }
+    } else if (type[0] == 't' && type[1] == 'R' && type[2] == 'N' &&
+               type[3] == 'S')  // palette transparency chunk (tRNS)
+    {
+      if (info.colorType == 3) {
+        if (4 * chunkLength > info.palettesize) {
+          error = 39;
+          return;
+        }  // error: more alpha values given than there are palette entries
+        for (size_t i = 0; i < chunkLength; i++)
+          info.palette[4 * i + 3] = data[i];
+      } else if (info.colorType == 0) {
+        if (chunkLength != 2) {
+          error = 40;
+          return;
+        }  // error: this chunk must be 2 bytes for greyscale image
+        info.key_defined = 1;
+        info.key_r = info.key_g = info.key_b = 256 * data[0] + data[1];
+      } else if (info.colorType == 2) {
+        if (chunkLength != 6) {
+          error = 41;
+          return;
+        }  // error: this chunk must be 6 bytes for RGB image
+        info.key_defined = 1;
+        info.key_r = 256 * data[0] + data[1];
+        info.key_g = 256 * data[2] + data[3];
+        info.key_b = 256 * data[4] + data[5];
+      } else {
+        error = 42;
         return;
-      }  // error: only filter method 0 is allowed in the specification
-      info.interlaceMethod = in[28];
-      if (in[28] > 1) {
-        error = 34;
+      }  // error: tRNS chunk not allowed for other color models
+    } else if (!(type[0] & 32)) {
+      error = 69;
+      return;
+    }  // error: unknown critical chunk (5th bit of first byte of chunk type
+       // is 0)
+  }
+  void gatherIdat(unsigned char* dst, const unsigned char* in,
+                  size_t size) {  // copy the data of all idat chunks to dst,
+                                  // the chunks were already validated
+    for (size_t pos = 33; pos + 8 < size;) {
+      size_t chunkLength = read32bitInt(&in[pos]);
+      if (in[pos + 4] == 'I' && in[pos + 5] == 'D' && in[pos + 6] == 'A' &&
+          in[pos + 7] == 'T') {
+        std::memcpy(dst, &in[pos + 8], chunkLength);
+        dst += chunkLength;
+      } else if (in[pos + 4] == 'I' && in[pos + 5] == 'E' &&
+                 in[pos + 6] == 'N' && in[pos + 7] == 'D')
+        break;
+      pos += 12 + chunkLength;
+    }
+  }
+  void writeLine(unsigned char* out, const unsigned char* line,
+                 size_t numpixels, size_t outpixel, size_t spacex,
+                 unsigned long bpp,
+                 bool convert) {  // put the pixels of an unfiltered line in
+                                  // the out buffer, starting at pixel index
+                                  // outpixel and spacex pixels apart
+    if (convert) {
+      size_t size = formatSize(format);
+      error = convertPixels(&out[size * outpixel], size * spacex, line,
+                            numpixels);
+    }
+    else if (bpp >= 8) {
+      size_t bytewidth = bpp / 8;
+      if (spacex == 1)
+        std::memcpy(&out[bytewidth * outpixel], line, numpixels * bytewidth);
+      else
+        for (size_t i = 0; i < numpixels; i++)
+          std::memcpy(&out[bytewidth * (outpixel + spacex * i)],
+                      &line[bytewidth * i], bytewidth);
+    } else  // less than 8 bits per pixel, so fill it up bit per bit
+      for (size_t i = 0, bp = 0; i < numpixels; i++) {
+        size_t obp = bpp * (outpixel + spacex * i);
+        for (size_t b = 0; b < bpp; b++)
+          setBitOfReversedStream(obp, out,
+                                 readBitFromReversedStream(bp, line));
+      }
+  }
+  void readPngHeader(const unsigned char* in,
+                     size_t inlength)  // read the information from the header
+                                       // and store it in the Info
+  {
+    if (inlength < 29) {
+      error = 27;
+      return;
+    }  // error: the data length is smaller than the length of the header
+    if (in[0] != 137 || in[1] != 80 || in[2] != 78 || in[3] != 71 ||
+        in[4] != 13 || in[5] != 10 || in[6] != 26 || in[7] != 10) {
+      error = 28;
+      return;
+    }  // no PNG signature
+    if (in[12] != 'I' || in[13] != 'H' || in[14] != 'D' || in[15] != 'R') {
+      error = 29;
+      return;
+    }  // error: it doesn't start with a IHDR chunk!
+    if (verify) {
+      if (inlength < 33) {
+        error = 27;
         return;
-      }  // error: only interlace methods 0 and 1 exist in the specification
-      error = checkColorValidity(info.colorType, info.bitDepth);
-    }
-    void unFilterScanline(unsigned char* recon, const unsigned char* scanline,
-                          const unsigned char* precon, size_t bytewidth,
-                          unsigned long filterType, size_t length) {
-      switch (filterType) {
-        case 0:
-          for (size_t i = 0; i < length; i++) recon[i] = scanline[i];
-          break;
-        case 1:
-          for (size_t i = 0; i < bytewidth; i++) recon[i] = scanline[i];
-          for (size_t i = bytewidth; i < length; i++)
-            recon[i] = scanline[i] + recon[i - bytewidth];
+      }  // error: the data length is smaller than the header with its CRC
+      checkCrc(&in[12], 13);
+      if (error) return;
+    }
+    info.width = read32bitInt(&in[16]);
+    info.height = read32bitInt(&in[20]);
+    info.bitDepth = in[24];
+    info.colorType = in[25];
+    info.compressionMethod = in[26];
+    if (in[26] != 0) {
+      error = 32;
+      return;
+    }  // error: only compression method 0 is allowed in the specification
+    info.filterMethod = in[27];
+    if (in[27] != 0) {
+      error = 33;
+      return;
+    }  // error: only filter method 0 is allowed in the specification
+    info.interlaceMethod = in[28];
+    if (in[28] > 1) {
+      error = 34;
+      return;
+    }  // error: only interlace methods 0 and 1 exist in the specification
+    info.key_defined = false;  // until a tRNS chunk gives a color key
+    info.palettesize = 0;
+    error = checkColorValidity(info.colorType, info.bitDepth);
+  }
+  void checkCrc(const unsigned char* type,
+                size_t length) {  // of the chunk with this type and data
+                                  // length, the CRC follows the data
+    unsigned crc = picopng::crc32(0, type, 4 + length);
+    if (crc != readChecksum(&type[4 + length]))
+      error = 57;  // error: the CRC doesn't match the chunk
+  }
+  void unFilterScanline(unsigned char* recon, const unsigned char* scanline,
+                        const unsigned char* precon, size_t bytewidth,
+                        unsigned long filterType, size_t length) {
+    error = picopng::unfilterScanline(recon, scanline, precon, bytewidth,
+                                      filterType, length,
+                                      picopng::simdLevel());
+  }
+  static unsigned long readBitFromReversedStream(size_t& bitp,
+                                                 const unsigned char* bits) {
+    unsigned long result = (bits[bitp >> 3] >> (7 - (bitp & 0x7))) & 1;
+    bitp++;
+    return result;
+  }
+  static unsigned long readBitsFromReversedStream(size_t& bitp,
+                                                  const unsigned char* bits,
+                                                  unsigned long nbits) {
+    unsigned long result = 0;
+    for (size_t i = nbits - 1; i < nbits; i--)
+      result += ((readBitFromReversedStream(bitp, bits)) << i);
+    return result;
+  }
+  void setBitOfReversedStream(size_t& bitp, unsigned char* bits,
+                              unsigned long bit) {
+    unsigned char mask = (unsigned char)(1 << (7 - (bitp & 0x7)));
+    bits[bitp >> 3] = (unsigned char)(bit ? bits[bitp >> 3] | mask
+                                          : bits[bitp >> 3] & ~mask);
+    bitp++;
+  }
+  unsigned long read32bitInt(const unsigned char* buffer) {
+    return (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) |
+           buffer[3];
+  }
+  int checkColorValidity(
+      unsigned long colorType,
+      unsigned long bd)  // return type is a LodePNG error code
+  {
+    if ((colorType == 2 || colorType == 4 || colorType == 6)) {
+      if (!(bd == 8 || bd == 16))
+        return 37;
+      else
+        return 0;
+    } else if (colorType == 0) {
+      if (!(bd == 1 || bd == 2 || bd == 4 || bd == 8 || bd == 16))
+        return 37;
+      else
+        return 0;
+    } else if (colorType == 3) {
+      if (!(bd == 1 || bd == 2 || bd == 4 || bd == 8))
+        return 37;
+      else
+        return 0;
+    } else
+      return 31;  // unexisting color type
+  }
+  unsigned long getBpp(const Info& info) const {
+    if (info.colorType == 2)
+      return (3 * info.bitDepth);
+    else if (info.colorType >= 4)
+      return (info.colorType - 2) * info.bitDepth;
+    else
+      return info.bitDepth;
+  }
+  int convertLine(unsigned char* out, size_t step, const unsigned char* in,
+                  const Info& infoIn,
+                  size_t numpixels) {  // converts a line of pixels from any
+                                       // color type to 32-bit, the out
+                                       // pixels are step bytes apart.
+                                       // return value = LodePNG error code
+    if (step == 4 && infoIn.bitDepth >= 8 &&
+        (infoIn.bitDepth == 8 || !infoIn.key_defined))
+      return convertContiguousLine(out, in, infoIn, numpixels);
+    size_t bp = 0;
+    if (infoIn.bitDepth == 8 && infoIn.colorType == 0)  // greyscale
+      for (size_t i = 0; i < numpixels; i++) {
+        out[step * i + 0] = out[step * i + 1] = out[step * i + 2] = in[i];
+        out[step * i + 3] =
+            (infoIn.key_defined && in[i] == infoIn.key_r) ? 0 : 255;
+      }
+    else if (infoIn.bitDepth == 8 && infoIn.colorType == 2)  // RGB color
+      for (size_t i = 0; i < numpixels; i++) {
+        for (size_t c = 0; c < 3; c++) out[step * i + c] = in[3 * i + c];
+        out[step * i + 3] =
+            (infoIn.key_defined == 1 && in[3 * i + 0] == infoIn.key_r &&
+             in[3 * i + 1] == infoIn.key_g && in[3 * i + 2] == infoIn.key_b)
+                ? 0
+                : 255;
+      }
+    else if (infoIn.bitDepth == 8 &&
+             infoIn.colorType == 3)  // indexed color (palette)
+      for (size_t i = 0; i < numpixels; i++) {
+        if (4U * in[i] >= infoIn.palettesize) return 46;
+        for (size_t c = 0; c < 4; c++)
+          out[step * i + c] =
+              infoIn
+                  .palette[4 * in[i] + c];  // get rgb colors from the palette
+      }
+    else if (infoIn.bitDepth == 8 &&
+             infoIn.colorType == 4)  // greyscale with alpha
+      for (size_t i = 0; i < numpixels; i++) {
+        out[step * i + 0] = out[step * i + 1] = out[step * i + 2] =
+            in[2 * i + 0];
+        out[step * i + 3] = in[2 * i + 1];
+      }
+    else if (infoIn.bitDepth == 8 && infoIn.colorType == 6)
+      for (size_t i = 0; i < numpixels; i++)
+        for (size_t c = 0; c < 4; c++)
+          out[step * i + c] = in[4 * i + c];  // RGB with alpha
+    else if (infoIn.bitDepth == 16 && infoIn.colorType == 0)  // greyscale
+      for (size_t i = 0; i < numpixels; i++) {
+        out[step * i + 0] = out[step * i + 1] = out[step * i + 2] = in[2 * i];
+        out[step * i + 3] =
+            (infoIn.key_defined &&
+             256U * in[2 * i] + in[2 * i + 1] == infoIn.key_r)
+                ? 0
+                : 255;
+      }
+    else if (infoIn.bitDepth == 16 && infoIn.colorType == 2)  // RGB color
+      for (size_t i = 0; i < numpixels; i++) {
+        for (size_t c = 0; c < 3; c++) out[step * i + c] = in[6 * i + 2 * c];
+        out[step * i + 3] =
+            (infoIn.key_defined &&
+             256U * in[6 * i + 0] + in[6 * i + 1] == infoIn.key_r &&
+             256U * in[6 * i + 2] + in[6 * i + 3] == infoIn.key_g &&
+             256U * in[6 * i + 4] + in[6 * i + 5] == infoIn.key_b)
+                ? 0
+                : 255;
+      }
+    else if (infoIn.bitDepth == 16 &&
+             infoIn.colorType == 4)  // greyscale with alpha
+      for (size_t i = 0; i < numpixels; i++) {
+        out[step * i + 0] = out[step * i + 1] = out[step * i + 2] =
+            in[4 * i];  // most significant byte
+        out[step * i + 3] = in[4 * i + 2];
+      }
+    else if (infoIn.bitDepth == 16 && infoIn.colorType == 6)
+      for (size_t i = 0; i < numpixels; i++)
+        for (size_t c = 0; c < 4; c++)
+          out[step * i + c] = in[8 * i + 2 * c];  // RGB with alpha
+    else if (infoIn.bitDepth < 8 && infoIn.colorType == 0)  // greyscale
+      for (size_t i = 0; i < numpixels; i++) {
+        unsigned long sample =
+            readBitsFromReversedStream(bp, in, infoIn.bitDepth);
+        unsigned long value =
+            (sample * 255) /
+            ((1 << infoIn.bitDepth) - 1);  // scale value from 0 to 255
+        out[step * i + 0] = out[step * i + 1] = out[step * i + 2] =
+            (unsigned char)(value);
+        out[step * i + 3] =
+            (infoIn.key_defined && sample == infoIn.key_r) ? 0 : 255;
+      }
+    else if (infoIn.bitDepth < 8 && infoIn.colorType == 3)  // palette
+      for (size_t i = 0; i < numpixels; i++) {
+        unsigned long value =
+            readBitsFromReversedStream(bp, in, infoIn.bitDepth);
+        if (4 * value >= infoIn.palettesize) return 47;
+        for (size_t c = 0; c < 4; c++)
+          out[step * i + c] =
+              infoIn
+                  .palette[4 * value + c];  // get rgb colors from the palette
+      }
+    return 0;
+  }
+  int convertPixels(unsigned char* out, size_t step, const unsigned char* in,
+                    size_t numpixels) {  // convertLine to the format, the
+                                         // packed ones and the finished ones
+                                         // by way of RGBA, 256 pixels at a
+                                         // time
+    // only images that can have alpha below 255 need premultiplying
+    bool multiply =
+        premultiply && (info.colorType >= 3 || info.key_defined),
+         finish = multiply || swizzled();
+    if (format == FORMAT_RGBA8 && !finish)
+      return convertLine(out, step, in, info, numpixels);
+    bool direct = format == FORMAT_RGBA8 && step == 4;  // finished in out
+    picopng::SimdLevel level = picopng::simdLevel();
+    unsigned long bpp = getBpp(info);
+    unsigned char rgba[4 * 256];
+    for (size_t i = 0; i < numpixels; i += 256) {
+      size_t n = numpixels - i < 256 ? numpixels - i : 256;
+      unsigned char* pixels = direct ? &out[4 * i] : rgba;
+      int result = convertLine(pixels, 4, &in[i * bpp / 8], info, n);
+      if (result) return result;
+      if (multiply) picopng::premultiplyAlpha(pixels, n, level);
+      if (swizzled()) picopng::swizzleChannels(pixels, n, swizzle, level);
+      if (!direct) picopng::packRGBA(&out[step * i], step, rgba, n, format);
+    }
+    return 0;
+  }
+  int convertContiguousLine(unsigned char* out, const unsigned char* in,
+                            const Info& infoIn,
+                            size_t numpixels) {  // convertLine for pixels
+                                                 // 4 bytes apart, using the
+                                                 // whole-line conversions
+    picopng::SimdLevel level = picopng::simdLevel();
+    if (infoIn.bitDepth == 8)
+      return expandLine8(out, in, infoIn, numpixels, level);
+    if (infoIn.colorType == 6) {  // RGBA 16-bit only needs truncation
+      picopng::truncate16(out, in, 4 * numpixels, level);
+      return 0;
+    }
+    size_t channels = infoIn.colorType == 2 ? 3 : infoIn.colorType == 4 ? 2
+                                                                        : 1;
+    unsigned char line[3 * 256];  // truncate 256 pixels at a time
+    for (size_t i = 0; i < numpixels; i += 256) {
+      size_t n = numpixels - i < 256 ? numpixels - i : 256;
+      picopng::truncate16(line, &in[2 * channels * i], channels * n, level);
+      expandLine8(&out[4 * i], line, infoIn, n, level);
+    }
+    return 0;
+  }
+  int expandLine8(unsigned char* out, const unsigned char* in,
+                  const Info& infoIn, size_t numpixels,
+                  picopng::SimdLevel level) {  // contiguous 8-bit samples
+                                               // to RGBA, the color key
+                                               // only applies to 8-bit
+    bool key8 = infoIn.bitDepth == 8 && infoIn.key_defined &&
+                infoIn.key_r <= 255 && infoIn.key_g <= 255 &&
+                infoIn.key_b <= 255;
+    switch (infoIn.colorType) {
+      case 0:  // greyscale
+        picopng::expandGrey8(out, in, numpixels,
+                             key8 ? (int)infoIn.key_r : -1, level);
+        break;
+      case 2:  // RGB color
+        picopng::expandRGB8(out, in, numpixels,
+                            key8 ? (int)(infoIn.key_r | infoIn.key_g << 8 |
+                                         infoIn.key_b << 16)
+                                 : -1,
+                            level);
+        break;
+      case 3:  // indexed color (palette)
+        if (numpixels &&
+            4U * picopng::maxByte(in, numpixels, level) >= infoIn.palettesize)
+          return 46;
+        picopng::expandPalette8(out, in, numpixels, infoIn.palette, level);
+        break;
+      case 4:  // greyscale with alpha
+        picopng::expandGreyAlpha8(out, in, numpixels, level);
+        break;
+      case 6:  // RGB with alpha
+        std::memcpy(out, in, 4 * numpixels);
+        break;
+    }
+    return 0;
+  }
+};
+
+// Incremental decoding. A StreamDecoder is given the PNG file in pieces of any
+// size while it is read, inflates the image data as it arrives and hands each
+// row to the callback as soon as the row is complete, in the format decodePNG
+// would give. Apart from the palette it keeps the 32 KiB zlib window and a few
+// rows in memory, except for interlaced images: their rows are only complete
+// in the last two passes, so these are assembled in a full image buffer and
+// the rows come out even rows first. Rows of less than 8 bits per pixel
+// start at a byte boundary, unlike in the output of decodePNG.
+//
+// In progressive mode every pixel of an interlaced image is also copied over
+// the block of pixels that the later passes fill in, so that the whole image
+// is a coarse but usable picture after each pass: 8x8 blocks after pass 1,
+// 4x4 after pass 3, 2x2 after pass 5. The pass callback is told when a pass
+// is finished and can show the image so far, the next passes refine it in
+// place. The blocks cost about four times the writes of the plain image.
+class StreamDecoder {
+ public:
+  typedef void (*RowCallback)(void* user, const unsigned char* row,
+                              unsigned long y);
+  typedef void (*HeaderCallback)(void* user);
+  typedef void (*PassCallback)(void* user, int pass);
+  StreamDecoder(RowCallback callback, void* user,
+                bool convert_to_rgba32 = true)
+      : callback(callback),
+        headercallback(0),
+        passcallback(0),
+        user(user),
+        convert_to_rgba32(convert_to_rgba32),
+        out(0),
+        stride(0),
+        stage(HEADER),
+        filled(0),
+        idatseen(false),
+        idatdone(false) {
+    png.error = 0;
+  }
+  int write(const unsigned char* data,
+            size_t size) {  // decode the next piece of the file, returns the
+                            // LodePNG error code so far
+    while (size != 0 && !png.error && stage != END) {
+      size_t n = size;
+      switch (stage) {
+        case HEADER:
+          n = collect(head, 33, data, size);
+          if (filled == 33) startImage();
           break;
-        case 2:
-          if (precon)
-            for (size_t i = 0; i < length; i++)
-              recon[i] = scanline[i] + precon[i];
-          else
-            for (size_t i = 0; i < length; i++) recon[i] = scanline[i];
+        case CHUNK:
+          n = collect(head, 8, data, size);
+          if (filled == 8) startChunk();
           break;
-        case 3:
-          if (precon) {
-            for (size_t i = 0; i < bytewidth; i++)
-              recon[i] = scanline[i] + precon[i] / 2;
-            for (size_t i = bytewidth; i < length; i++)
-              recon[i] = scanline[i] + ((recon[i - bytewidth] + precon[i]) / 2);
-          } else {
-            for (size_t i = 0; i < bytewidth; i++) recon[i] = scanline[i];
-            for (size_t i = bytewidth; i < length; i++)
-              recon[i] = scanline[i] + recon[i - bytewidth] / 2;
+        case DATA:
+          n = collect(&chunk[0], chunk.size(), data, size);
+          if (png.verify) crc = crc32(crc, data, n);
+          if (filled == chunk.size()) {
+            png.readChunk(&head[4], &chunk[0], chunk.size());
+            skip(0);
           }
           break;
-        case 4:
-          if (precon) {
-            for (size_t i = 0; i < bytewidth; i++)
-              recon[i] = scanline[i] + paethPredictor(0, precon[i], 0);
-            for (size_t i = bytewidth; i < length; i++)
-              recon[i] =
-                  scanline[i] + paethPredictor(recon[i - bytewidth], precon[i],
-                                               precon[i - bytewidth]);
-          } else {
-            for (size_t i = 0; i < bytewidth; i++) recon[i] = scanline[i];
-            for (size_t i = bytewidth; i < length; i++)
-              recon[i] =
-                  scanline[i] + paethPredictor(recon[i - bytewidth], 0, 0);
-          }
+        case IDAT:
+          if (n > left) n = left;
+          if (png.verify) crc = crc32(crc, data, n);
+          inflateIdat(data, n, false);
+          left -= n;
+          if (left == 0) skip(0);
           break;
-        default:
-          error = 36;
-          return;  // error: unexisting filter type given
-      }
-    }
-    void adam7Pass(unsigned char* out, unsigned char* linen,
-                   unsigned char* lineo, const unsigned char* in,
-                   unsigned long w, size_t passleft, size_t passtop,
-                   size_t spacex, size_t spacey, size_t passw, size_t passh,
-                   unsigned long bpp) {  // filter and reposition the pixels
-                                         // into the output when the image is
-                                         // Adam7 interlaced. This function can
-                                         // only do it after the full image is
-                                         // already decoded. The out buffer must
-                                         // have the correct allocated memory
-                                         // size already.
-      if (passw == 0) return;
-      size_t bytewidth = (bpp + 7) / 8,
-             linelength = 1 + ((bpp * passw + 7) / 8);
-      for (unsigned long y = 0; y < passh; y++) {
-        unsigned char filterType = in[y * linelength],
-                      *prevline = (y == 0) ? 0 : lineo;
-        unFilterScanline(linen, &in[y * linelength + 1], prevline, bytewidth,
-                         filterType, (w * bpp + 7) / 8);
-        if (error) return;
-        if (bpp >= 8)
-          for (size_t i = 0; i < passw; i++)
-            for (size_t b = 0; b < bytewidth;
-                 b++)  // b = current byte of this pixel
-              out[bytewidth * w * (passtop + spacey * y) +
-                  bytewidth * (passleft + spacex * i) + b] =
-                  linen[bytewidth * i + b];
-        else
-          for (size_t i = 0; i < passw; i++) {
-            size_t obp = bpp * w * (passtop + spacey * y) +
-                         bpp * (passleft + spacex * i),
-                   bp = i * bpp;
-            for (size_t b = 0; b < bpp; b++)
-              setBitOfReversedStream(obp, out,
-                                     readBitFromReversedStream(bp, &linen[0]));
+        case SKIP:
+          if (n > left) n = left;
+          if (png.verify) crc = crc32(crc, data, n);
+          left -= n;
+          if (left == 0) skip(0);
+          break;
+        case CRC:
+          n = collect(&head[8], 4, data, size);
+          if (filled == 4) {
+            if (png.verify && readChecksum(&head[8]) != crc)
+              png.error = 57;  // error: the CRC doesn't match the chunk
+            stage = CHUNK;
+            filled = 0;
           }
-        unsigned char* temp = linen;
-        linen = lineo;
-        lineo = temp;  // swap the two buffer pointers "line old" and "line new"
+          break;
+        case END:
+          break;
       }
+      data += n;
+      size -= n;
     }
-    static unsigned long readBitFromReversedStream(size_t& bitp,
-                                                   const unsigned char* bits) {
-      unsigned long result = (bits[bitp >> 3] >> (7 - (bitp & 0x7))) & 1;
-      bitp++;
-      return result;
+    return png.error;
+  }
+  int finish() {  // call after the last piece, gives an error if the file
+                  // ended before the IEND chunk
+    if (!png.error && stage != END)
+      png.error = stage != HEADER ? 30 : filled != 0 ? 27 : 48;
+    return png.error;
+  }
+  void setHeaderCallback(HeaderCallback callback) {  // called once the size
+                                                     // of the image is known,
+                                                     // before the first row
+    headercallback = callback;
+  }
+  void setVerify(bool verify) {  // check the CRC of each chunk and the adler32
+                                 // of the image data, call it before the
+                                 // first piece
+    png.verify = verify;
+  }
+  void setFormat(Format format) {  // convert to format instead of RGBA, if
+                                   // converting. Set it from the header
+                                   // callback at the latest, the rows then
+                                   // have rowSize() bytes of it
+    png.format = format;
+  }
+  void setPremultiply(bool premultiply) {  // scale the color of converted
+                                           // pixels by their alpha, for
+                                           // blending with GL_ONE. Set it
+                                           // from the header callback at the
+                                           // latest
+    png.premultiply = premultiply;
+  }
+  void setFlip(bool flip) {  // the rows come out bottom up: row y of the
+                             // image is row height() - 1 - y of the output,
+                             // and the callback gets the output row. Call it
+                             // before the first row
+    png.flip = flip;
+  }
+  bool setSwizzle(const char* order) {  // reorder the channels of converted
+                                        // pixels, e.g. "BGRA", false if
+                                        // order isn't 4 of R, G, B, A. Set
+                                        // it from the header callback at
+                                        // the latest
+    return png.setSwizzle(order);
+  }
+  void setProgressive(PassCallback callback) {  // fill in the whole image
+                                                // after every Adam7 pass and
+                                                // call callback with the
+                                                // pass number 1 to 7. Only
+                                                // for interlaced images of 8
+                                                // or more bits per pixel or
+                                                // converted to RGBA, set it
+                                                // from the header callback
+                                                // at the latest
+    passcallback = callback;
+  }
+  void setOutput(unsigned char* out_,
+                 size_t stride_) {  // write row y to out_ + y * stride_
+                                    // instead of an internal buffer, out_
+                                    // must hold height() rows of rowSize()
+                                    // bytes. Call it before the first row,
+                                    // from the header callback at the latest.
+                                    // out_ is only written to, unless the
+                                    // pixels are less than 8 bits and not
+                                    // converted, so it can be mapped memory
+    out = out_;
+    stride = stride_;
+  }
+  int error() const { return png.error; }
+  bool headerDone() const { return stage != HEADER; }
+  bool interlaced() const { return png.info.interlaceMethod != 0; }
+  unsigned long colorType() const { return png.info.colorType; }
+  unsigned long bitDepth() const { return png.info.bitDepth; }
+  unsigned long width() const { return png.info.width; }
+  unsigned long height() const { return png.info.height; }
+  size_t rowSize() const {  // bytes in a row of the output
+    return png.getRowSize(png.needsConversion(convert_to_rgba32));
+  }
+
+ private:
+  enum Stage { HEADER, CHUNK, DATA, IDAT, SKIP, CRC, END };
+  size_t collect(unsigned char* dst, size_t need, const unsigned char* data,
+                 size_t size) {  // append to a partly filled dst until it
+                                 // holds need bytes, returns the bytes used
+    size_t n = need - filled < size ? need - filled : size;
+    std::memcpy(&dst[filled], data, n);
+    filled += n;
+    return n;
+  }
+  void skip(size_t n) {  // skip n bytes of chunk data, then read the CRC
+    stage = n != 0 ? SKIP : CRC;
+    left = n;
+    filled = 0;
+  }
+  void startImage() {  // the header is in, set up the buffers of the image
+    png.readPngHeader(head, 33);
+    if (png.error) return;
+    png.checkImageSize();
+    if (png.error) return;
+    bpp = png.getBpp(png.info);
+    size_t w = png.info.width, h = png.info.height;
+    numpasses = png.getPasses(passes);
+    total = 0;
+    for (size_t i = 0; i < numpasses; i++)
+      if (passes[i].w != 0)
+        total += passes[i].h * (1 + (passes[i].w * bpp + 7) / 8);
+    bytewidth = (bpp + 7) / 8;
+    linelength = (w * bpp + 7) / 8;
+    line.resize(linelength);
+    prevline.resize(linelength);
+    // The window keeps the last 32 KiB for the back references, and the start
+    // of a row that isn't complete yet. It gets as much room again to inflate
+    // into, so it is only moved down every few rows.
+    size_t keep = 1 + linelength > 32768 ? 1 + linelength : 32768;
+    size_t room = 2 * keep + 258 < total ? 2 * keep + 258 : total;
+    window.resize(room + Zlib::Inflator::SLACK);
+    inflator.reset(window.data(), room);
+    adler = 1;
+    dropped = 0;
+    setWindow();
+    rowstart = 0;
+    pass = 0;
+    passy = 0;
+    skipEmptyPasses();
+    stage = CHUNK;
+    filled = 0;
+    if (headercallback) headercallback(user);
+    convert = png.needsConversion(convert_to_rgba32);  // after the callback,
+                                                       // which may set the
+                                                       // format
+    progressive = passcallback && numpasses == 7 && (convert || bpp >= 8);
+    if (convert && (progressive || (!out && numpasses == 1)))
+      rgba.resize(rowSize());
+    if (numpasses == 7 && !out) image.resize(h * rowSize());
+  }
+  void startChunk() {  // the length and type of a chunk are in head
+    size_t chunkLength = png.read32bitInt(head);
+    const unsigned char* type = &head[4];
+    if (chunkLength > 2147483647) {
+      png.error = 63;
+      return;
     }
-    static unsigned long readBitsFromReversedStream(size_t& bitp,
-                                                    const unsigned char* bits,
-                                                    unsigned long nbits) {
-      unsigned long result = 0;
-      for (size_t i = nbits - 1; i < nbits; i--)
-        result += ((readBitFromReversedStream(bitp, bits)) << i);
-      return result;
+    if (png.verify) crc = crc32(0, type, 4);
+    bool idat = type[0] == 'I' && type[1] == 'D' && type[2] == 'A' &&
+                type[3] == 'T',
+         iend = type[0] == 'I' && type[1] == 'E' && type[2] == 'N' &&
+                type[3] == 'D';
+    if (!idat && !idatdone && (idatseen || iend)) {
+      inflateIdat(0, 0, true);  // the image data is complete
+      idatdone = true;
+      if (png.error) return;
+      size_t start = inflator.skipbits != 0;  // the checksum is byte aligned
+      if (png.verify && (pending.size() < start + 4 ||
+                         readChecksum(&pending[start]) != adler)) {
+        png.error = 58;
+        return;
+      }  // error: the adler32 checksum doesn't match the data
     }
-    void setBitOfReversedStream(size_t& bitp, unsigned char* bits,
-                                unsigned long bit) {
-      bits[bitp >> 3] |= (bit << (7 - (bitp & 0x7)));
-      bitp++;
+    if (idat) {
+      idatseen = true;
+      if (idatdone)
+        skip(chunkLength);  // after the end of the zlib stream
+      else {
+        stage = IDAT;
+        left = chunkLength;
+        if (left == 0) skip(0);
+      }
+    } else if (iend)
+      stage = END;
+    else if ((type[0] == 'P' || type[0] == 't') && chunkLength <= 1024) {
+      chunk.resize(chunkLength);  // PLTE and tRNS are read when complete
+      filled = 0;
+      stage = DATA;
+      if (chunkLength == 0) {
+        png.readChunk(type, 0, 0);
+        skip(0);
+      }
+    } else {  // an unknown chunk, or a PLTE or tRNS chunk too long to be
+              // valid, which readChunk rejects from the length alone
+      png.readChunk(type, 0, chunkLength);
+      skip(chunkLength);
     }
-    unsigned long read32bitInt(const unsigned char* buffer) {
-      return (buffer[0] << 24) | (buffer[1] << 16) | (buffer[2] << 8) |
-             buffer[3];
+  }
+  void inflateIdat(const unsigned char* data, size_t size,
+                   bool final) {  // inflate the next piece of the zlib stream
+    if (inflator.state == Zlib::Inflator::DONE) {
+      size_t n = pending.size() < 5 ? 5 - pending.size() : 0;
+      if (n > size) n = size;
+      if (png.verify)  // keep the adler32 that follows the stream
+        pending.insert(pending.end(), data, data + n);
+      return;
     }
-    int checkColorValidity(
-        unsigned long colorType,
-        unsigned long bd)  // return type is a LodePNG error code
-    {
-      if ((colorType == 2 || colorType == 4 || colorType == 6)) {
-        if (!(bd == 8 || bd == 16))
-          return 37;
-        else
-          return 0;
-      } else if (colorType == 0) {
-        if (!(bd == 1 || bd == 2 || bd == 4 || bd == 8 || bd == 16))
-          return 37;
-        else
-          return 0;
-      } else if (colorType == 3) {
-        if (!(bd == 1 || bd == 2 || bd == 4 || bd == 8))
-          return 37;
-        else
-          return 0;
-      } else
-        return 31;  // unexisting color type
-    }
-    unsigned long getBpp(const Info& info) {
-      if (info.colorType == 2)
-        return (3 * info.bitDepth);
-      else if (info.colorType >= 4)
-        return (info.colorType - 2) * info.bitDepth;
-      else
-        return info.bitDepth;
-    }
-    int convert(std::vector<unsigned char>& out, const unsigned char* in,
-                Info& infoIn, unsigned long w,
-                unsigned long h) {  // converts from any color type to 32-bit.
-                                    // return value = LodePNG error code
-      size_t numpixels = w * h, bp = 0;
-      out.resize(numpixels * 4);
-      unsigned char* out_ =
-          out.empty() ? 0 : &out[0];  // faster if compiled without optimization
-      if (infoIn.bitDepth == 8 && infoIn.colorType == 0)  // greyscale
-        for (size_t i = 0; i < numpixels; i++) {
-          out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] = in[i];
-          out_[4 * i + 3] =
-              (infoIn.key_defined && in[i] == infoIn.key_r) ? 0 : 255;
-        }
-      else if (infoIn.bitDepth == 8 && infoIn.colorType == 2)  // RGB color
-        for (size_t i = 0; i < numpixels; i++) {
-          for (size_t c = 0; c < 3; c++) out_[4 * i + c] = in[3 * i + c];
-          out_[4 * i + 3] =
-              (infoIn.key_defined == 1 && in[3 * i + 0] == infoIn.key_r &&
-               in[3 * i + 1] == infoIn.key_g && in[3 * i + 2] == infoIn.key_b)
-                  ? 0
-                  : 255;
-        }
-      else if (infoIn.bitDepth == 8 &&
-               infoIn.colorType == 3)  // indexed color (palette)
-        for (size_t i = 0; i < numpixels; i++) {
-          if (4U * in[i] >= infoIn.palette.size()) return 46;
-          for (size_t c = 0; c < 4; c++)
-            out_[4 * i + c] =
-                infoIn
-                    .palette[4 * in[i] + c];  // get rgb colors from the palette
-        }
-      else if (infoIn.bitDepth == 8 &&
-               infoIn.colorType == 4)  // greyscale with alpha
-        for (size_t i = 0; i < numpixels; i++) {
-          out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] = in[2 * i + 0];
-          out_[4 * i + 3] = in[2 * i + 1];
-        }
-      else if (infoIn.bitDepth == 8 && infoIn.colorType == 6)
-        for (size_t i = 0; i < numpixels; i++)
-          for (size_t c = 0; c < 4; c++)
-            out_[4 * i + c] = in[4 * i + c];  // RGB with alpha
-      else if (infoIn.bitDepth == 16 && infoIn.colorType == 0)  // greyscale
-        for (size_t i = 0; i < numpixels; i++) {
-          out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] = in[2 * i];
-          out_[4 * i + 3] =
-              (infoIn.key_defined && 256U * in[i] + in[i + 1] == infoIn.key_r)
-                  ? 0
-                  : 255;
-        }
-      else if (infoIn.bitDepth == 16 && infoIn.colorType == 2)  // RGB color
-        for (size_t i = 0; i < numpixels; i++) {
-          for (size_t c = 0; c < 3; c++) out_[4 * i + c] = in[6 * i + 2 * c];
-          out_[4 * i + 3] =
-              (infoIn.key_defined &&
-               256U * in[6 * i + 0] + in[6 * i + 1] == infoIn.key_r &&
-               256U * in[6 * i + 2] + in[6 * i + 3] == infoIn.key_g &&
-               256U * in[6 * i + 4] + in[6 * i + 5] == infoIn.key_b)
-                  ? 0
-                  : 255;
-        }
-      else if (infoIn.bitDepth == 16 &&
-               infoIn.colorType == 4)  // greyscale with alpha
-        for (size_t i = 0; i < numpixels; i++) {
-          out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] =
-              in[4 * i];  // most significant byte
-          out_[4 * i + 3] = in[4 * i + 2];
-        }
-      else if (infoIn.bitDepth == 16 && infoIn.colorType == 6)
-        for (size_t i = 0; i < numpixels; i++)
-          for (size_t c = 0; c < 4; c++)
-            out_[4 * i + c] = in[8 * i + 2 * c];              // RGB with alpha
-      else if (infoIn.bitDepth < 8 && infoIn.colorType == 0)  // greyscale
-        for (size_t i = 0; i < numpixels; i++) {
-          unsigned long value =
-              (readBitsFromReversedStream(bp, in, infoIn.bitDepth) * 255) /
-              ((1 << infoIn.bitDepth) - 1);  // scale value from 0 to 255
-          out_[4 * i + 0] = out_[4 * i + 1] = out_[4 * i + 2] =
-              (unsigned char)(value);
-          out_[4 * i + 3] = (infoIn.key_defined && value &&
-                             ((1U << infoIn.bitDepth) - 1U) == infoIn.key_r &&
-                             ((1U << infoIn.bitDepth) - 1U))
-                                ? 0
-                                : 255;
+    if (!pending.empty()) {  // the end of the previous piece wasn't used yet
+      pending.insert(pending.end(), data, data + size);
+      data = pending.data();
+      size = pending.size();
+    }
+    size_t used = 0;
+    for (;;) {
+      size_t outpos = inflator.outpos;
+      used += inflator.inflate(data + used, size - used, final);
+      if (inflator.error) {
+        png.error = inflator.error;
+        return;
+      }
+      if (png.verify)
+        adler = adler32(adler, &window[outpos], inflator.outpos - outpos,
+                        simdLevel());
+      emitRows();
+      if (png.error || inflator.state == Zlib::Inflator::DONE ||
+          inflator.outpos < inflator.outlimit)
+        break;  // done, or waiting for more input
+      slideWindow();  // out of room in the window
+    }
+    if (data == pending.data())
+      pending.erase(pending.begin(), pending.begin() + used);
+    else
+      pending.assign(data + used, data + size);
+  }
+  void setWindow() {
+    size_t left = total - dropped;  // bytes still to be inflated
+    size_t room = window.size() - Zlib::Inflator::SLACK;
+    inflator.out = window.data();
+    inflator.outfinal = left <= room;
+    inflator.outsize = inflator.outfinal ? left : room;
+    inflator.outlimit = inflator.outfinal ? (size_t)(-1) : room - 258;
+  }
+  void slideWindow() {  // drop what is no longer needed from the window
+    size_t pos = inflator.outpos, keepfrom = pos > 32768 ? pos - 32768 : 0;
+    if (keepfrom > rowstart) keepfrom = rowstart;
+    std::memmove(&window[0], &window[keepfrom], pos - keepfrom);
+    inflator.outpos = pos - keepfrom;
+    rowstart -= keepfrom;
+    dropped += keepfrom;
+    setWindow();
+  }
+  void skipEmptyPasses() {
+    while (pass < numpasses && (passes[pass].w == 0 || passes[pass].h == 0))
+      pass++;
+  }
+  size_t lastPass(size_t y) const {  // the last pass with pixels in row y
+    for (size_t i = numpasses - 1; i > 0; i--)
+      if (passes[i].w != 0 && y >= passes[i].top &&
+          (y - passes[i].top) % passes[i].spacey == 0)
+        return i;
+    return 0;
+  }
+  size_t outputY(size_t y) const {  // where row y of the image goes
+    return png.flip ? png.info.height - 1 - y : y;
+  }
+  unsigned char* outputRow(size_t y) {  // of row y of the image
+    y = outputY(y);
+    return out ? &out[y * stride] : &image[y * rowSize()];
+  }
+  void fillBlocks(const unsigned char* pixels,
+                  size_t y) {  // copy each pixel of a row of the current pass
+                               // over its block of not yet decoded pixels
+    static const size_t blockw[7] = {8, 4, 4, 2, 2, 1, 1};
+    static const size_t blockh[7] = {8, 8, 4, 4, 2, 2, 1};
+    const PNG::Pass& p = passes[pass];
+    size_t w = png.info.width, h = png.info.height;
+    size_t size = convert ? formatSize(png.format) : bpp / 8;
+    size_t endy = y + blockh[pass] < h ? y + blockh[pass] : h;
+    for (; y < endy; y++) {
+      unsigned char* row = outputRow(y);
+      for (size_t i = 0; i < p.w; i++) {
+        size_t x = p.left + p.spacex * i;
+        size_t endx = x + blockw[pass] < w ? x + blockw[pass] : w;
+        for (; x < endx; x++)
+          std::memcpy(&row[x * size], &pixels[i * size], size);
+      }
+    }
+  }
+  void emitRows() {  // unfilter the complete rows in the window and pass on
+                     // the ones that are finished
+    size_t w = png.info.width;
+    while (pass < numpasses) {
+      const PNG::Pass& p = passes[pass];
+      size_t length = (p.w * bpp + 7) / 8;
+      if (inflator.outpos - rowstart < 1 + length) return;
+      const unsigned char* scanline = &window[rowstart];
+      png.unFilterScanline(&line[0], scanline + 1,
+                           passy == 0 ? 0 : &prevline[0], bytewidth,
+                           scanline[0], length);
+      if (png.error) return;
+      rowstart += 1 + length;
+      size_t y = p.top + p.spacey * passy;
+      if (numpasses == 1) {
+        unsigned char* row = &line[0];
+        if (convert) {
+          row = out ? &out[outputY(y) * stride] : &rgba[0];
+          png.error = png.convertPixels(row, formatSize(png.format), &line[0],
+                                        w);
+        } else if (out) {
+          row = &out[outputY(y) * stride];
+          std::memcpy(row, &line[0], linelength);
         }
-      else if (infoIn.bitDepth < 8 && infoIn.colorType == 3)  // palette
-        for (size_t i = 0; i < numpixels; i++) {
-          unsigned long value =
-              readBitsFromReversedStream(bp, in, infoIn.bitDepth);
-          if (4 * value >= infoIn.palette.size()) return 47;
-          for (size_t c = 0; c < 4; c++)
-            out_[4 * i + c] =
-                infoIn
-                    .palette[4 * value + c];  // get rgb colors from the palette
+        if (png.error) return;
+        if (callback) callback(user, row, outputY(y));
+      } else {
+        unsigned char* row = outputRow(y);
+        if (progressive) {
+          const unsigned char* pixels = &line[0];
+          if (convert) {
+            pixels = &rgba[0];
+            png.error = png.convertPixels(&rgba[0], formatSize(png.format),
+                                          &line[0], p.w);
+          }
+          if (!png.error) fillBlocks(pixels, y);
+        } else {
+          png.writeLine(row, &line[0], p.w, p.left, p.spacex, bpp, convert);
         }
-      return 0;
-    }
-    unsigned char paethPredictor(
-        short a, short b,
-        short c)  // Paeth predicter, used by PNG filter type 4
-    {
-      short p = a + b - c, pa = p > a ? (p - a) : (a - p),
-            pb = p > b ? (p - b) : (b - p), pc = p > c ? (p - c) : (c - p);
-      return (unsigned char)((pa <= pb && pa <= pc) ? a : pb <= pc ? b : c);
+        if (png.error) return;
+        if (lastPass(y) == pass && callback)
+          callback(user, row, outputY(y));
+      }
+      line.swap(prevline);
+      if (++passy == p.h) {
+        if (progressive) passcallback(user, int(pass) + 1);
+        pass++;
+        passy = 0;
+        skipEmptyPasses();
+      }
     }
-  };
-  PNG decoder;
-  decoder.decode(out_image, in_png, in_size, convert_to_rgba32);
-  image_width = decoder.info.width;
-  image_height = decoder.info.height;
-  return decoder.error;
+  }
+  RowCallback callback;
+  HeaderCallback headercallback;
+  PassCallback passcallback;
+  void* user;
+  bool convert_to_rgba32;
+  unsigned char* out;  // the output of the caller, if any
+  size_t stride;
+  PNG png;
+  Zlib::Inflator inflator;
+  Stage stage;
+  unsigned char head[33];  // the header, then the length and type of a chunk
+  size_t filled;           // bytes collected in head or chunk
+  size_t left;             // bytes left of the IDAT data or to skip
+  std::vector<unsigned char> chunk;    // data of a PLTE or tRNS chunk
+  std::vector<unsigned char> pending;  // zlib data not used up yet
+  unsigned crc, adler;  // of the current chunk and of the image data so far
+  bool idatseen, idatdone;
+  unsigned long bpp;
+  bool convert;
+  bool progressive;  // fill in the blocks of the later passes
+  size_t bytewidth, linelength;
+  PNG::Pass passes[7];
+  size_t numpasses, pass, passy;  // the next row is row passy of pass
+  size_t total;    // size of the filtered scanlines of all passes
+  size_t dropped;  // bytes inflated before the start of the window
+  size_t rowstart;  // the next filtered row in the window
+  std::vector<unsigned char> window, line, prevline, rgba, image;
+};
+
+// Decodes PNG files one after the other, like decodePNG, but keeps the
+// buffers it needs besides the output from one image to the next: the
+// scanlines, the gathered image data of files with several IDAT chunks and the
+// Huffman tables. Once they are as large as the largest image needs, a decode
+// allocates nothing but the output, which the caller can keep too. To load
+// many small images, use one PngDecoder per thread. The options of a
+// PngDecoder apply to the converted pixels as each row is written, without
+// another pass over the image, and stay set for the next images.
+class PngDecoder {
+ public:
+  int decode(std::vector<unsigned char>& out_image,
+             unsigned long& image_width, unsigned long& image_height,
+             const unsigned char* in_png, size_t in_size,
+             bool convert_to_rgba32 = true,
+             bool verify = false) {  // as decodePNG
+    png.verify = verify;
+    png.decode(out_image, in_png, in_size, convert_to_rgba32);
+    image_width = png.info.width;
+    image_height = png.info.height;
+    return png.error;
+  }
+  int decode(unsigned char* out_image, size_t out_stride, size_t out_size,
+             unsigned long& image_width, unsigned long& image_height,
+             const unsigned char* in_png, size_t in_size,
+             bool convert_to_rgba32 = true,
+             bool verify = false) {  // as decodePNG into memory of the caller
+    png.verify = verify;
+    png.decode(out_image, out_stride, out_size, in_png, in_size,
+               convert_to_rgba32);
+    image_width = png.info.width;
+    image_height = png.info.height;
+    return png.error;
+  }
+  void setFormat(Format format) {  // convert to format instead of RGBA
+    png.format = format;
+  }
+  void setPremultiply(bool premultiply) {  // scale the color of converted
+                                           // pixels by their alpha
+    png.premultiply = premultiply;
+  }
+  void setFlip(bool flip) {  // the last row of the image comes first
+    png.flip = flip;
+  }
+  bool setSwizzle(const char* order) {  // reorder the channels of converted
+                                        // pixels, e.g. "BGRA", false if
+                                        // order isn't 4 of R, G, B, A
+    return png.setSwizzle(order);
+  }
+  size_t allocations() const {  // heap allocations of the kept buffers so
+                                // far, the output not counted. It stops
+                                // growing once they are large enough
+    return png.allocations + png.inflator.allocations();
+  }
+  void release() {  // free the image buffers, e.g. after a large image
+    std::vector<unsigned char>().swap(png.scanlines);
+    std::vector<unsigned char>().swap(png.gathered);
+  }
+
+ private:
+  PNG png;
+};
+
+// What the IHDR chunk says about an image, see probePNG.
+struct Header {
+  unsigned long width, height, bitDepth, colorType, interlaceMethod;
+};
+
+}  // namespace picopng
+
+/*
+decodePNG: The picoPNG function, decodes a PNG file buffer in memory, into a raw
+pixel buffer. out_image: output parameter, this will contain the raw pixels
+after decoding. By default the output is 32-bit RGBA color. The std::vector is
+automatically resized to the correct size. image_width: output_parameter, this
+will contain the width of the image in pixels. image_height: output_parameter,
+this will contain the height of the image in pixels. in_png: pointer to the
+buffer of the PNG file in memory. To get it from a file on disk, load it and
+store it in a memory buffer yourself first, or decode it with a StreamDecoder
+while reading it. To decode many files, a picopng::PngDecoder reuses its
+buffers, and can premultiply the alpha of the converted pixels, reorder their
+channels and flip the rows of the image while it decodes. in_size: size of the
+input PNG file in bytes. convert_to_rgba32: optional parameter, true by
+default. Set to true to get the output in RGBA 32-bit (8 bit per channel)
+color format no matter what color type the original PNG image had. This gives
+predictable, useable data from any random input PNG. Set to false to do no
+color conversion at all. The result then has the same data type as the PNG
+image, which can range from 1 bit to 64 bits per pixel. Information about the
+color type or palette colors are not provided. You need to know this
+information yourself to be able to use the data so this only works for
+trusted PNG files. Use LodePNG instead of picoPNG if you need this
+information. verify: optional parameter, false by default. Set to true to check
+the CRC of every chunk and the adler32 checksum of the image data, so that a
+corrupted file gives error 57 or 58 instead of wrong pixels. return: 0 if
+success, not 0 if some error occured.
+*/
+int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
+              unsigned long& image_height, const unsigned char* in_png,
+              size_t in_size, bool convert_to_rgba32 = true,
+              bool verify = false) {
+  picopng::PngDecoder decoder;
+  return decoder.decode(out_image, image_width, image_height, in_png, in_size,
+                        convert_to_rgba32, verify);
+}
+
+/*
+decodePNG into memory of the caller: the same, but the pixels are written to
+out_image, row y starting at out_image + y * out_stride, in out_size bytes at
+most. Rows of less than 8 bits per pixel start at a byte boundary. out_image is
+only written to, unless the pixels are less than 8 bits and not converted, so
+it can be mapped memory such as a GL pixel buffer. If the buffer is too small,
+nothing is decoded and the error is 94, with image_width and image_height set:
+to find the size first, call it with out_image 0 and out_size 0.
+*/
+int decodePNG(unsigned char* out_image, size_t out_stride, size_t out_size,
+              unsigned long& image_width, unsigned long& image_height,
+              const unsigned char* in_png, size_t in_size,
+              bool convert_to_rgba32 = true, bool verify = false) {
+  picopng::PngDecoder decoder;
+  return decoder.decode(out_image, out_stride, out_size, image_width,
+                        image_height, in_png, in_size, convert_to_rgba32,
+                        verify);
+}
+
+/*
+decodePNG to a packed format: the same, converting to format, one of the
+picopng::Format values, instead of RGBA. It takes 2 bytes per pixel for
+FORMAT_RGB565, FORMAT_RGBA4444 and FORMAT_RG8 and 1 byte for FORMAT_R8, the
+rows without padding. FORMAT_RGB565 and FORMAT_R8 drop the alpha channel, also
+the transparency of a color key, so they are for opaque images.
+*/
+int decodePNG(std::vector<unsigned char>& out_image, unsigned long& image_width,
+              unsigned long& image_height, const unsigned char* in_png,
+              size_t in_size, picopng::Format format, bool verify = false) {
+  picopng::PngDecoder decoder;
+  decoder.setFormat(format);
+  return decoder.decode(out_image, image_width, image_height, in_png, in_size,
+                        true, verify);
+}
+
+int decodePNG(unsigned char* out_image, size_t out_stride, size_t out_size,
+              unsigned long& image_width, unsigned long& image_height,
+              const unsigned char* in_png, size_t in_size,
+              picopng::Format format, bool verify = false) {
+  picopng::PngDecoder decoder;
+  decoder.setFormat(format);
+  return decoder.decode(out_image, out_stride, out_size, image_width,
+                        image_height, in_png, in_size, true, verify);
+}
+
+/*
+probePNG: reads only the signature and the IHDR chunk of a PNG file, to learn
+the size and format of the image before, or instead of, decoding it. Nothing is
+allocated or decompressed. header: output parameter, set if successful, gets
+the width and height in pixels and the bit depth, color type and interlace
+method as stored in the file. in_png: the start of the PNG file, only its first
+29 bytes are read. in_size: the number of bytes available at in_png. return: 0
+if success, otherwise the error decodePNG would give for this header, such as
+27 if in_size is too small for it and 28 if it isn't a PNG file.
+*/
+int probePNG(picopng::Header& header, const unsigned char* in_png,
+             size_t in_size) {
+  if (in_size == 0 || in_png == 0) return 48;  // the given data is empty
+  picopng::PNG decoder;
+  decoder.readPngHeader(in_png, in_size);
+  if (!decoder.error) decoder.checkImageSize();
+  if (decoder.error) return decoder.error;
+  header.width = decoder.info.width;
+  header.height = decoder.info.height;
+  header.bitDepth = decoder.info.bitDepth;
+  header.colorType = decoder.info.colorType;
+  header.interlaceMethod = decoder.info.interlaceMethod;
+  return 0;
 }
 
-  // an example using the PNG loading function:
+// an example using the PNG loading function, compiled only with PICOPNG_DEMO
+// defined, so that the file can be included in other programs:
 
+#ifdef PICOPNG_DEMO
 #include <fstream>
 #include <iostream>
 
@@ -957,6 +2983,7 @@ int main(int argc, char* argv[]) {
               << " first pixel: " << std::hex << int(image[0]) << int(image[1])
               << int(image[2]) << int(image[3]) << std::endl;
 }
+#endif  // PICOPNG_DEMO
 
 /*
   //this is test code, it displays the pixels of a 1 bit PNG. To use it, set the
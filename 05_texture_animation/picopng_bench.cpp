@@ -0,0 +1,82 @@
+// Benchmark of decodePNG to RGBA on PNG files, the best of a number of runs,
+// in MB/s of PNG data and in pixels per second.
+//
+// It uses only decodePNG(out, w, h, in, size), which every version of
+// picopng.cpp has, so that a change to the decoder can be measured against an
+// older picopng.cpp. PICOPNG_SOURCE names the file to include, picopng.cpp by
+// default:
+//
+//   git show <rev>:05_texture_animation/picopng.cpp |
+//       sed 's/^int main(/int demo_main(/' > /tmp/old/picopng.cpp
+//   g++ -std=c++11 -O2 -DPICOPNG_SOURCE='"/tmp/old/picopng.cpp"'
+//       picopng_bench.cpp -o picopng_bench_old
+//
+// The sed is for versions before the demo main of picopng.cpp was put under
+// PICOPNG_DEMO.
+//
+// usage: picopng_bench [-r runs] file.png...
+//   -r: runs per file, 20 by default
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#ifndef PICOPNG_SOURCE
+#define PICOPNG_SOURCE "picopng.cpp"
+#endif
+#include PICOPNG_SOURCE
+
+int main(int argc, char* argv[]) {
+  int runs = 20;
+  std::vector<std::string> files;
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-r" && i + 1 < argc) {
+      runs = std::max(1, std::atoi(argv[++i]));
+    } else {
+      files.push_back(arg);
+    }
+  }
+  if (files.empty()) {
+    std::fprintf(stderr, "usage: picopng_bench [-r runs] file.png...\n");
+    return 2;
+  }
+
+  int failures = 0;
+  for (const std::string& name : files) {
+    std::ifstream file(name, std::ios_base::binary);
+    const std::vector<unsigned char> png(
+        (std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+    if (png.empty()) {
+      std::fprintf(stderr, "%s: can't read it\n", name.c_str());
+      ++failures;
+      continue;
+    }
+    std::vector<unsigned char> out;
+    unsigned long w = 0, h = 0;
+    double best = 1e30;
+    int error = 0;
+    for (int i = 0; i < runs && !error; ++i) {
+      const auto start = std::chrono::steady_clock::now();
+      error = decodePNG(out, w, h, png.data(), png.size());
+      const std::chrono::duration<double> time =
+          std::chrono::steady_clock::now() - start;
+      best = std::min(best, time.count());
+    }
+    if (error) {
+      std::fprintf(stderr, "%s: error %d\n", name.c_str(), error);
+      ++failures;
+      continue;
+    }
+    std::printf("%-32s %9zu bytes %9.1f MB/s %9.2f Mpixels/s\n", name.c_str(),
+                png.size(), png.size() / best / 1e6,
+                double(w) * h / best / 1e6);
+  }
+  return failures != 0;
+}
@@ -0,0 +1,40 @@
+// libFuzzer entry point for the PNG decoder in picopng.cpp, built with
+// -DPICOPNG_FUZZ=ON and clang. Each input is decoded raw, to RGBA with
+// verification and with the stream decoder in small pieces; the sanitizers
+// report what goes wrong. picopng_test -w dir writes a seed corpus.
+//
+// usage: picopng_fuzz [corpus_dir]
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "picopng.cpp"
+
+namespace {
+
+void ignore_row(void*, const unsigned char*, unsigned long) {}
+
+}  // namespace
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+  // images that need more memory than a run should take are left out
+  picopng::Header header;
+  if (probePNG(header, data, size) != 0 ||
+      header.width * header.height > 4096 * 4096) {
+    return 0;
+  }
+
+  std::vector<unsigned char> out;
+  unsigned long w, h;
+  decodePNG(out, w, h, data, size, false);
+  decodePNG(out, w, h, data, size, true, true);
+
+  picopng::StreamDecoder decoder(ignore_row, nullptr);
+  int error = 0;
+  for (size_t pos = 0; pos < size && !error; pos += 7) {
+    error = decoder.write(data + pos, size - pos < 7 ? size - pos : 7);
+  }
+  if (!error) decoder.finish();
+  return 0;
+}
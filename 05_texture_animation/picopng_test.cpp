@@ -0,0 +1,857 @@
+// Conformance test and benchmark of the PNG decoder in picopng.cpp.
+//
+// The test images are made here, in every color type and bit depth that PNG
+// allows, interlaced or not, like the basic images of PngSuite. Their rows use
+// all five filter types, and their image data is compressed with stored
+// blocks, with fixed Huffman codes and back references at many distances, or
+// with both. Each image is decoded raw and converted to RGBA, with and without
+// verification, into a buffer of the caller and with the stream decoder in
+// pieces of several sizes, and converted to each packed format, and the pixels
+// are compared to the ones it was made from. A PngDecoder then decodes them
+// all twice and must not allocate the second time. tank.png and clouds.png,
+// compressed by a real encoder with dynamic Huffman codes, are compared to
+// checksums of their pixels. The SIMD unfilter and conversion kernels are
+// compared to the scalar code at every level the CPU has.
+//
+// Every case reports the speed of decodePNG to RGBA, the best of a number of
+// runs, in MB/s of PNG data and in pixels per second.
+//
+// usage: picopng_test [-r runs] [-w corpus_dir] [image_dir]
+//   -r: runs per case for the speeds, 3 by default
+//   -w: also write the test images to corpus_dir, e.g. to seed picopng_fuzz
+//   image_dir: where tank.png and clouds.png are, . by default
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "picopng.cpp"
+
+namespace {
+
+typedef std::vector<unsigned char> bytes;
+
+// The checksums are written out here, rather than taken from the decoder that
+// is being tested.
+unsigned crc32_of(const unsigned char* data, size_t size) {
+  unsigned crc = 0xFFFFFFFFu;
+  for (size_t i = 0; i < size; ++i) {
+    crc ^= data[i];
+    for (int k = 0; k < 8; ++k) {
+      crc = crc & 1 ? 0xEDB88320u ^ (crc >> 1) : crc >> 1;
+    }
+  }
+  return ~crc;
+}
+
+unsigned adler32_of(const bytes& data) {
+  unsigned s1 = 1, s2 = 0;
+  for (unsigned char c : data) {
+    s1 = (s1 + c) % 65521;
+    s2 = (s2 + s1) % 65521;
+  }
+  return s2 << 16 | s1;
+}
+
+void put32(bytes& out, unsigned value) {  // big endian, as in PNG and zlib
+  for (int shift = 24; shift >= 0; shift -= 8) {
+    out.push_back(static_cast<unsigned char>(value >> shift));
+  }
+}
+
+// Deflate writes values from the least significant bit of each byte on, and
+// Huffman codes from their most significant bit on.
+class bit_writer {
+ public:
+  explicit bit_writer(bytes& out) : out_(out) {}
+
+  void write(unsigned value, int count) {
+    for (int i = 0; i < count; ++i) {
+      if (bit_ == 0) out_.push_back(0);
+      out_.back() |= ((value >> i) & 1) << bit_;
+      bit_ = (bit_ + 1) & 7;
+    }
+  }
+
+  void write_code(unsigned code, int length) {
+    for (int i = length - 1; i >= 0; --i) write((code >> i) & 1, 1);
+  }
+
+  void align() { bit_ = 0; }  // the next value starts a new byte
+
+ private:
+  bytes& out_;
+  int bit_ = 0;
+};
+
+const unsigned length_base[29] = {3,  4,  5,  6,   7,   8,   9,   10,  11, 13,
+                                  15, 17, 19, 23,  27,  31,  35,  43,  51, 59,
+                                  67, 83, 99, 115, 131, 163, 195, 227, 258};
+const unsigned length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1,
+                                   1, 1, 2, 2, 2, 2, 3, 3, 3, 3,
+                                   4, 4, 4, 4, 5, 5, 5, 5, 0};
+const unsigned distance_base[30] = {
+    1,   2,   3,   4,   5,   7,    9,    13,   17,   25,   33,   49,   65,
+    97,  129, 193, 257, 385, 513,  769,  1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+const unsigned distance_extra[30] = {0, 0, 0, 0, 1, 1, 2,  2,  3,  3,
+                                     4, 4, 5, 5, 6, 6, 7,  7,  8,  8,
+                                     9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// the last entry of base that value reaches
+size_t code_index(const unsigned* base, size_t count, unsigned value) {
+  size_t i = 0;
+  while (i + 1 < count && base[i + 1] <= value) ++i;
+  return i;
+}
+
+void write_fixed_symbol(bit_writer& bits, unsigned symbol) {
+  if (symbol < 144) {
+    bits.write_code(0x30 + symbol, 8);
+  } else if (symbol < 256) {
+    bits.write_code(0x190 + symbol - 144, 9);
+  } else if (symbol < 280) {
+    bits.write_code(symbol - 256, 7);
+  } else {
+    bits.write_code(0xC0 + symbol - 280, 8);
+  }
+}
+
+enum compression { STORED, FIXED, MIXED };
+const char* const compression_names[] = {"stored", "fixed", "mixed"};
+
+// Blocks of 4 KiB, stored or with the fixed codes, or alternating. The matches
+// are found greedily among short distances, which repeat runs of pixels, and
+// multiples of the scanline length, which repeat rows.
+bytes zlib_compress(const bytes& data, size_t line_length, compression mode) {
+  std::vector<size_t> distances;
+  for (size_t d = 1; d <= 16; ++d) distances.push_back(d);
+  for (size_t d : {24, 32, 100}) distances.push_back(d);
+  for (size_t d = line_length; d <= 32768 && distances.size() < 24;
+       d += line_length) {
+    distances.push_back(d);
+  }
+
+  bytes out = {0x78, 0x01};
+  bit_writer bits(out);
+  size_t pos = 0;
+  for (size_t block = 0; block == 0 || pos < data.size(); ++block) {
+    const size_t end = std::min(data.size(), pos + 4096);
+    bits.write(end == data.size(), 1);
+    if (mode == STORED || (mode == MIXED && block % 2 == 0)) {
+      bits.write(0, 2);
+      bits.align();
+      const unsigned length = static_cast<unsigned>(end - pos);
+      bits.write(length, 16);
+      bits.write(~length & 0xFFFF, 16);
+      for (; pos < end; ++pos) bits.write(data[pos], 8);
+      continue;
+    }
+    bits.write(1, 2);
+    while (pos < end) {
+      size_t best_length = 0, best_distance = 0;
+      for (size_t d : distances) {
+        if (d > pos) continue;
+        size_t n = 0;
+        while (n < 258 && pos + n < end && data[pos + n] == data[pos + n - d]) {
+          ++n;
+        }
+        if (n > best_length) {
+          best_length = n;
+          best_distance = d;
+        }
+      }
+      if (best_length < 3) {
+        write_fixed_symbol(bits, data[pos++]);
+        continue;
+      }
+      const unsigned length = static_cast<unsigned>(best_length);
+      const unsigned distance = static_cast<unsigned>(best_distance);
+      const size_t l = code_index(length_base, 29, length);
+      write_fixed_symbol(bits, static_cast<unsigned>(257 + l));
+      bits.write(length - length_base[l], length_extra[l]);
+      const size_t d = code_index(distance_base, 30, distance);
+      bits.write_code(static_cast<unsigned>(d), 5);
+      bits.write(distance - distance_base[d], distance_extra[d]);
+      pos += best_length;
+    }
+    write_fixed_symbol(bits, 256);  // end of block
+  }
+  bits.align();
+  put32(out, adler32_of(data));
+  return out;
+}
+
+void write_chunk(bytes& png, const char* type, const bytes& data) {
+  put32(png, static_cast<unsigned>(data.size()));
+  const size_t start = png.size();
+  png.insert(png.end(), type, type + 4);
+  png.insert(png.end(), data.begin(), data.end());
+  put32(png, crc32_of(&png[start], png.size() - start));
+}
+
+// Appends count bits of value, most significant first: samples of less than 8
+// bits share bytes this way, and 16-bit samples come out big endian.
+void put_bits(bytes& out, size_t& bit, unsigned value, unsigned count) {
+  for (unsigned i = count; i-- > 0;) {
+    if (bit % 8 == 0) out.push_back(0);
+    out.back() |= ((value >> i) & 1) << (7 - bit % 8);
+    ++bit;
+  }
+}
+
+unsigned char paeth(int a, int b, int c) {
+  const int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b),
+            pc = std::abs(p - c);
+  return static_cast<unsigned char>(pa <= pb && pa <= pc ? a
+                                    : pb <= pc           ? b
+                                                         : c);
+}
+
+// Filters a row with the given type, prev is the unfiltered row above it.
+void filter_row(bytes& out, const bytes& row, const bytes& prev,
+                size_t bytewidth, unsigned type) {
+  out.push_back(static_cast<unsigned char>(type));
+  for (size_t i = 0; i < row.size(); ++i) {
+    const int a = i >= bytewidth ? row[i - bytewidth] : 0, b = prev[i],
+              c = i >= bytewidth ? prev[i - bytewidth] : 0;
+    const int predictor[5] = {0, a, b, (a + b) / 2, paeth(a, b, c)};
+    out.push_back(static_cast<unsigned char>(row[i] - predictor[type]));
+  }
+}
+
+struct test_image {
+  std::string name;
+  unsigned width = 0, height = 0, color_type = 0, bit_depth = 0,
+           interlace = 0;
+  bool transparent = false;  // a color key, or alpha in the palette
+  bytes png;   // the file
+  bytes raw;   // what decodePNG gives without conversion
+  bytes rgba;  // and converted to RGBA
+};
+
+unsigned channels(unsigned color_type) {
+  return color_type == 2 ? 3 : color_type == 4 ? 2 : color_type == 6 ? 4 : 1;
+}
+
+// Runs of equal pixels, rows that repeat the one above and noise, so that
+// every kind of back reference and filter input occurs.
+unsigned sample_value(unsigned x, unsigned y, unsigned c, unsigned bit_depth) {
+  if (y % 4 == 3) --y;
+  unsigned v = x % 16 < 6 ? y * 7 + c * 50 + x / 16 * 3
+                          : (x * 73856093u) ^ (y * 19349663u) ^ (c * 83492791u);
+  v ^= v >> 13;
+  return v & ((1u << bit_depth) - 1);
+}
+
+test_image make_image(unsigned width, unsigned height, unsigned color_type,
+                      unsigned bit_depth, unsigned interlace, bool transparent,
+                      compression mode) {
+  test_image image;
+  image.width = width;
+  image.height = height;
+  image.color_type = color_type;
+  image.bit_depth = bit_depth;
+  image.interlace = interlace;
+  image.transparent = transparent;
+  image.name = "c" + std::to_string(color_type) + "_b" +
+               std::to_string(bit_depth) + "_i" + std::to_string(interlace) +
+               "_" + std::to_string(width) + "x" + std::to_string(height) +
+               "_" + compression_names[mode] + (transparent ? "_trns" : "");
+
+  const unsigned n = channels(color_type), max = (1u << bit_depth) - 1;
+  std::vector<unsigned> samples;
+  for (unsigned y = 0; y < height; ++y) {
+    for (unsigned x = 0; x < width; ++x) {
+      for (unsigned c = 0; c < n; ++c) {
+        samples.push_back(sample_value(x, y, c, bit_depth));
+      }
+    }
+  }
+
+  bytes palette;  // RGBA, the alpha of the first half of the entries is given
+  bytes trns;
+  if (color_type == 3) {
+    for (unsigned i = 0; i <= max; ++i) {
+      const unsigned char alpha = transparent && i <= max / 2
+                                      ? static_cast<unsigned char>(i * 37)
+                                      : 255;
+      const unsigned char entry[4] = {
+          static_cast<unsigned char>(i * 67 + 5),
+          static_cast<unsigned char>(i * 13),
+          static_cast<unsigned char>(255 - i), alpha};
+      palette.insert(palette.end(), entry, entry + 4);
+      if (transparent && i <= max / 2) trns.push_back(alpha);
+    }
+  }
+  std::vector<unsigned> key;  // the color of the second pixel
+  if (transparent && (color_type == 0 || color_type == 2)) {
+    const size_t pixel = width > 1 ? 1 : 0;
+    for (unsigned c = 0; c < n; ++c) {
+      key.push_back(samples[pixel * n + c]);
+      put32(trns, key.back());
+      trns.erase(trns.end() - 4, trns.end() - 2);  // 16 bits per sample
+    }
+  }
+
+  // the expected output
+  size_t bit = 0;
+  for (unsigned s : samples) put_bits(image.raw, bit, s, bit_depth);
+  for (size_t p = 0; p < samples.size() / n; ++p) {
+    const unsigned* s = &samples[p * n];
+    auto scale = [&](unsigned v) {
+      return static_cast<unsigned char>(bit_depth == 16  ? v >> 8
+                                        : bit_depth == 8 ? v
+                                                         : v * 255 / max);
+    };
+    if (color_type == 3) {
+      image.rgba.insert(image.rgba.end(), &palette[4 * s[0]],
+                        &palette[4 * s[0]] + 4);
+      continue;
+    }
+    const unsigned char grey = scale(s[0]);
+    const bool keyed = !key.empty() && std::equal(key.begin(), key.end(), s);
+    unsigned char pixel[4] = {grey, grey, grey,
+                              static_cast<unsigned char>(keyed ? 0 : 255)};
+    if (color_type == 2 || color_type == 6) {
+      pixel[1] = scale(s[1]);
+      pixel[2] = scale(s[2]);
+    }
+    if (color_type == 4) pixel[3] = scale(s[1]);
+    if (color_type == 6) pixel[3] = scale(s[3]);
+    image.rgba.insert(image.rgba.end(), pixel, pixel + 4);
+  }
+
+  // the scanlines of the passes, each row filtered with the next filter type
+  const unsigned pass_x[7] = {0, 4, 0, 2, 0, 1, 0},
+                 pass_y[7] = {0, 0, 4, 0, 2, 0, 1},
+                 step_x[7] = {8, 8, 4, 4, 2, 2, 1},
+                 step_y[7] = {8, 8, 8, 4, 4, 2, 2};
+  const size_t bytewidth = std::max(1u, n * bit_depth / 8);
+  bytes scanlines;
+  size_t line_length = 0;
+  unsigned filter = 0;
+  for (unsigned pass = 0; pass < (interlace ? 7u : 1u); ++pass) {
+    const unsigned x0 = interlace ? pass_x[pass] : 0,
+                   y0 = interlace ? pass_y[pass] : 0,
+                   dx = interlace ? step_x[pass] : 1,
+                   dy = interlace ? step_y[pass] : 1;
+    if (x0 >= width || y0 >= height) continue;
+    bytes prev;
+    for (unsigned y = y0; y < height; y += dy) {
+      bytes row;
+      size_t row_bit = 0;
+      for (unsigned x = x0; x < width; x += dx) {
+        for (unsigned c = 0; c < n; ++c) {
+          put_bits(row, row_bit, samples[(y * width + x) * n + c], bit_depth);
+        }
+      }
+      if (prev.empty()) prev.assign(row.size(), 0);
+      filter_row(scanlines, row, prev, bytewidth, filter++ % 5);
+      prev = row;
+      line_length = std::max(line_length, row.size() + 1);
+    }
+  }
+
+  const unsigned char signature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+  image.png.assign(signature, signature + 8);
+  bytes header;
+  put32(header, width);
+  put32(header, height);
+  const unsigned char rest[5] = {static_cast<unsigned char>(bit_depth),
+                                 static_cast<unsigned char>(color_type), 0, 0,
+                                 static_cast<unsigned char>(interlace)};
+  header.insert(header.end(), rest, rest + 5);
+  write_chunk(image.png, "IHDR", header);
+  if (color_type == 3) {
+    bytes rgb;
+    for (size_t i = 0; i < palette.size(); i += 4) {
+      rgb.insert(rgb.end(), &palette[i], &palette[i] + 3);
+    }
+    write_chunk(image.png, "PLTE", rgb);
+  }
+  if (!trns.empty()) write_chunk(image.png, "tRNS", trns);
+  // the image data in several IDAT chunks
+  const bytes zlib = zlib_compress(scanlines, line_length, mode);
+  for (size_t pos = 0; pos < zlib.size(); pos += 1000) {
+    write_chunk(image.png, "IDAT",
+                bytes(zlib.begin() + pos,
+                      zlib.begin() + std::min(zlib.size(), pos + 1000)));
+  }
+  write_chunk(image.png, "IEND", bytes());
+  return image;
+}
+
+// the checks
+
+int failures = 0;
+
+void fail(const std::string& name, const std::string& what) {
+  std::printf("FAIL %s: %s\n", name.c_str(), what.c_str());
+  ++failures;
+}
+
+struct stream_rows {
+  picopng::StreamDecoder* decoder;
+  bytes image;
+  unsigned long rows;
+};
+
+void on_row(void* user, const unsigned char* row, unsigned long y) {
+  stream_rows& s = *static_cast<stream_rows*>(user);
+  const size_t size = s.decoder->rowSize();
+  s.image.resize(size * s.decoder->height());
+  std::memcpy(&s.image[y * size], row, size);
+  ++s.rows;
+}
+
+// The RGBA pixels in a packed format, as decodePNG should give them.
+bytes pack(const bytes& rgba, picopng::Format format) {
+  bytes out;
+  for (size_t i = 0; i < rgba.size(); i += 4) {
+    const unsigned r = rgba[i], g = rgba[i + 1], b = rgba[i + 2],
+                   a = rgba[i + 3];
+    const unsigned char grey =
+        static_cast<unsigned char>((77 * r + 150 * g + 29 * b) / 256);
+    auto bits = [](unsigned value, unsigned bits) {
+      const unsigned max = (1u << bits) - 1;
+      return static_cast<unsigned>(value / 255.0 * max + 0.5);
+    };
+    unsigned short word = 0;
+    switch (format) {
+      case picopng::FORMAT_RGBA8:
+        out.insert(out.end(), &rgba[i], &rgba[i] + 4);
+        break;
+      case picopng::FORMAT_RGB565:
+        word = static_cast<unsigned short>(bits(r, 5) << 11 |
+                                           bits(g, 6) << 5 | bits(b, 5));
+        break;
+      case picopng::FORMAT_RGBA4444:
+        word = static_cast<unsigned short>(bits(r, 4) << 12 | bits(g, 4) << 8 |
+                                           bits(b, 4) << 4 | bits(a, 4));
+        break;
+      case picopng::FORMAT_RG8:
+        out.push_back(grey);
+        out.push_back(static_cast<unsigned char>(a));
+        break;
+      case picopng::FORMAT_R8:
+        out.push_back(grey);
+        break;
+    }
+    if (format == picopng::FORMAT_RGB565 ||
+        format == picopng::FORMAT_RGBA4444) {
+      const unsigned char* p = reinterpret_cast<const unsigned char*>(&word);
+      out.insert(out.end(), p, p + 2);  // in native byte order
+    }
+  }
+  return out;
+}
+
+// The RGBA pixels with premultiplied alpha, in the channel order ABGR and
+// bottom up.
+bytes finish(const bytes& rgba, unsigned width) {
+  const size_t row_size = 4 * width;
+  bytes out;
+  for (size_t y = rgba.size() / row_size; y-- > 0;) {
+    for (size_t i = y * row_size; i < (y + 1) * row_size; i += 4) {
+      const unsigned a = rgba[i + 3];
+      auto multiply = [a](unsigned c) {
+        return static_cast<unsigned char>(c * a / 255.0 + 0.5);
+      };
+      const unsigned char pixel[4] = {rgba[i + 3], multiply(rgba[i + 2]),
+                                      multiply(rgba[i + 1]),
+                                      multiply(rgba[i])};
+      out.insert(out.end(), pixel, pixel + 4);
+    }
+  }
+  return out;
+}
+
+void ignore_pass(void*, int) {}
+
+void check_image(const test_image& image) {
+  const unsigned char* in = image.png.data();
+  const size_t size = image.png.size();
+  bytes out;
+  unsigned long w = 0, h = 0;
+
+  int error = decodePNG(out, w, h, in, size, false);
+  if (error || w != image.width || h != image.height || out != image.raw) {
+    fail(image.name, "raw decode, error " + std::to_string(error));
+  }
+  for (bool verify : {false, true}) {
+    error = decodePNG(out, w, h, in, size, true, verify);
+    if (error || out != image.rgba) {
+      fail(image.name, std::string(verify ? "verified " : "") +
+                           "RGBA decode, error " + std::to_string(error));
+    }
+  }
+
+  // rows padded to a stride of their own
+  const size_t row_size = 4 * image.width, stride = row_size + 12;
+  bytes buffer(stride * image.height);
+  error = decodePNG(buffer.data(), stride, buffer.size(), w, h, in, size);
+  for (unsigned y = 0; !error && y < image.height; ++y) {
+    if (std::memcmp(&buffer[y * stride], &image.rgba[y * row_size],
+                    row_size) != 0) {
+      error = -1;
+    }
+  }
+  if (error) fail(image.name, "decode with stride, " + std::to_string(error));
+
+  for (size_t piece : {size_t(1), size_t(7), size_t(4096), size}) {
+    stream_rows rows;
+    picopng::StreamDecoder decoder(on_row, &rows);
+    rows.decoder = &decoder;
+    rows.rows = 0;
+    decoder.setVerify(true);
+    error = 0;
+    for (size_t pos = 0; pos < size && !error; pos += piece) {
+      error = decoder.write(in + pos, std::min(piece, size - pos));
+    }
+    if (!error) error = decoder.finish();
+    if (error || rows.rows != image.height || rows.image != image.rgba) {
+      fail(image.name, "stream decode in pieces of " + std::to_string(piece) +
+                           ", error " + std::to_string(error));
+    }
+  }
+
+  for (picopng::Format format :
+       {picopng::FORMAT_RGB565, picopng::FORMAT_RGBA4444, picopng::FORMAT_RG8,
+        picopng::FORMAT_R8}) {
+    const bytes packed = pack(image.rgba, format);
+    error = decodePNG(out, w, h, in, size, format);
+    if (error || out != packed) {
+      fail(image.name, "decode to format " + std::to_string(format) +
+                           ", error " + std::to_string(error));
+    }
+    stream_rows rows;
+    picopng::StreamDecoder decoder(on_row, &rows);
+    rows.decoder = &decoder;
+    rows.rows = 0;
+    decoder.setFormat(format);
+    error = decoder.write(in, size);
+    if (!error) error = decoder.finish();
+    if (error || rows.image != packed) {
+      fail(image.name, "stream decode to format " + std::to_string(format) +
+                           ", error " + std::to_string(error));
+    }
+  }
+
+  // premultiplied, swizzled and flipped while decoding, and then packed
+  const bytes finished = finish(image.rgba, image.width);
+  for (picopng::Format format :
+       {picopng::FORMAT_RGBA8, picopng::FORMAT_RGBA4444}) {
+    const bytes packed = pack(finished, format);
+    picopng::PngDecoder decoder;
+    decoder.setFormat(format);
+    decoder.setPremultiply(true);
+    decoder.setSwizzle("ABGR");
+    decoder.setFlip(true);
+    error = decoder.decode(out, w, h, in, size);
+    if (error || out != packed) {
+      fail(image.name, "finished decode to format " + std::to_string(format) +
+                           ", error " + std::to_string(error));
+    }
+    for (bool progressive : {false, true}) {
+      stream_rows rows;
+      picopng::StreamDecoder stream(on_row, &rows);
+      rows.decoder = &stream;
+      rows.rows = 0;
+      stream.setFormat(format);
+      stream.setPremultiply(true);
+      stream.setSwizzle("ABGR");
+      stream.setFlip(true);
+      if (progressive) stream.setProgressive(ignore_pass);
+      error = 0;
+      for (size_t pos = 0; pos < size && !error; pos += 7) {
+        error = stream.write(in + pos, std::min<size_t>(7, size - pos));
+      }
+      if (!error) error = stream.finish();
+      if (error || rows.image != packed) {
+        fail(image.name, std::string("finished ") +
+                             (progressive ? "progressive " : "") +
+                             "stream decode to format " +
+                             std::to_string(format) + ", error " +
+                             std::to_string(error));
+      }
+    }
+  }
+
+  // a flipped bit in the image data must not go unnoticed
+  bytes corrupt = image.png;
+  corrupt[corrupt.size() - 12 - 5] ^= 0x10;  // in the last IDAT chunk
+  if (decodePNG(out, w, h, corrupt.data(), corrupt.size(), true, true) == 0) {
+    fail(image.name, "corrupt data decoded without error");
+  }
+}
+
+// A chunk that claims more bytes than are left in the file is an error, and
+// nothing past the end of the file is read, with or without verification.
+// Each case is a buffer of its own, so that ASan catches a read past it.
+void check_truncated(const test_image& image) {
+  bytes out;
+  unsigned long w, h;
+  // the signature and IHDR, then a tEXt chunk of 20 bytes cut after 18
+  bytes png(image.png.begin(), image.png.begin() + 33);
+  put32(png, 20);
+  const char text[] = "tEXt";
+  png.insert(png.end(), text, text + 4);
+  png.insert(png.end(), 18, 'a');
+  for (bool verify : {false, true}) {
+    if (decodePNG(out, w, h, png.data(), png.size(), true, verify) == 0) {
+      fail(image.name, "truncated tEXt chunk decoded without error");
+    }
+  }
+  for (size_t size = 8; size < image.png.size(); ++size) {
+    const bytes prefix(image.png.begin(), image.png.begin() + size);
+    if (decodePNG(out, w, h, prefix.data(), prefix.size(), true, true) == 0) {
+      fail(image.name, "first " + std::to_string(size) +
+                           " bytes decoded without error");
+    }
+  }
+}
+
+// the SIMD kernels, compared byte for byte to the scalar code on random lines
+
+const int random_lines = 2000;
+
+bytes random_bytes(std::mt19937& random, size_t size) {
+  bytes out(size);
+  for (unsigned char& byte : out) byte = static_cast<unsigned char>(random());
+  return out;
+}
+
+std::string level_name(picopng::SimdLevel level) {
+  const char* names[] = {"none", "SSE2", "SSSE3", "AVX2"};
+  return names[level];
+}
+
+// Every filter type for 3 and 4 bytes per pixel, the ones with kernels, on
+// lines with and without the one above, unfiltered into a buffer of their
+// own and in place.
+void check_unfilter() {
+  std::mt19937 random(4);
+  const picopng::SimdLevel best = picopng::simdLevel();
+  for (int line = 0; line < random_lines; ++line) {
+    const size_t bytewidth = 3 + line % 2;
+    const unsigned long filter = line / 2 % 5;
+    const bool above = line / 10 % 2 == 0;
+    const size_t length = bytewidth * (1 + random() % 200);  // pixels
+    const bytes scanline = random_bytes(random, length);
+    const bytes precon = random_bytes(random, length);
+    const unsigned char* prev = above ? precon.data() : nullptr;
+    bytes expected(length);
+    picopng::unfilterScanline(expected.data(), scanline.data(), prev,
+                              bytewidth, filter, length, picopng::SIMD_NONE);
+    for (int level = picopng::SIMD_NONE; level <= best; ++level) {
+      const picopng::SimdLevel simd = static_cast<picopng::SimdLevel>(level);
+      bytes recon(length), in_place = scanline;
+      picopng::unfilterScanline(recon.data(), scanline.data(), prev,
+                                bytewidth, filter, length, simd);
+      picopng::unfilterScanline(in_place.data(), in_place.data(), prev,
+                                bytewidth, filter, length, simd);
+      if (recon != expected || in_place != expected) {
+        fail("unfilter " + level_name(simd),
+             "filter " + std::to_string(filter) + ", " +
+                 std::to_string(bytewidth) + " bytes per pixel, " +
+                 std::to_string(length) + " bytes" +
+                 (above ? "" : ", first line"));
+      }
+    }
+  }
+}
+
+// The conversions of whole 8-bit lines to RGBA and of 16-bit samples to 8
+// bits, with and without a color key, which is the first pixel of the line.
+void check_conversions() {
+  std::mt19937 random(5);
+  const picopng::SimdLevel best = picopng::simdLevel();
+  const bytes palette = random_bytes(random, 4 * 256);
+  for (int line = 0; line < random_lines; ++line) {
+    const size_t pixels = 1 + random() % 300;
+    const bool keyed = line % 2 == 1;
+    const bytes in = random_bytes(random, 8 * pixels);
+    const int grey_key = keyed ? in[0] : -1;
+    const int rgb_key = keyed ? in[0] | in[1] << 8 | in[2] << 16 : -1;
+    bytes expected[6];
+    for (int level = picopng::SIMD_NONE; level <= best; ++level) {
+      const picopng::SimdLevel simd = static_cast<picopng::SimdLevel>(level);
+      bytes out[6] = {bytes(4 * pixels), bytes(4 * pixels), bytes(4 * pixels),
+                      bytes(4 * pixels), bytes(1), bytes(4 * pixels)};
+      picopng::expandGrey8(out[0].data(), in.data(), pixels, grey_key, simd);
+      picopng::expandGreyAlpha8(out[1].data(), in.data(), pixels, simd);
+      picopng::expandRGB8(out[2].data(), in.data(), pixels, rgb_key, simd);
+      picopng::expandPalette8(out[3].data(), in.data(), pixels,
+                              palette.data(), simd);
+      out[4][0] = picopng::maxByte(in.data(), pixels, simd);
+      picopng::truncate16(out[5].data(), in.data(), 4 * pixels, simd);
+      if (simd == picopng::SIMD_NONE) {
+        std::copy(out, out + 6, expected);
+        continue;
+      }
+      const char* names[] = {"G8", "GA8", "RGB8", "palette8", "maxByte",
+                             "truncate16"};
+      for (int i = 0; i < 6; ++i) {
+        if (out[i] != expected[i]) {
+          fail(std::string(names[i]) + " " + level_name(simd),
+               std::to_string(pixels) + " pixels" +
+                   (keyed ? " with a color key" : ""));
+        }
+      }
+    }
+  }
+}
+
+// One PngDecoder decodes all the images twice: the second time, its buffers
+// are large enough and it must not allocate.
+void check_reuse(const std::vector<test_image>& images) {
+  picopng::PngDecoder decoder;
+  size_t warm = 0;
+  bytes out;
+  for (int round = 0; round < 2; ++round) {
+    if (round == 1) warm = decoder.allocations();
+    for (const test_image& image : images) {
+      unsigned long w, h;
+      const int error = decoder.decode(out, w, h, image.png.data(),
+                                       image.png.size(), true, round == 1);
+      if (error || out != image.rgba) {
+        fail(image.name, "decode with a PngDecoder, error " +
+                             std::to_string(error));
+      }
+    }
+  }
+  std::printf("PngDecoder: %zu allocations for %zu images, then %zu more\n",
+              warm, images.size(), decoder.allocations() - warm);
+  if (decoder.allocations() != warm) {
+    fail("PngDecoder", "allocations after the buffers were large enough");
+  }
+}
+
+// Returns the best time of decodePNG to RGBA in seconds.
+double time_decode(const bytes& png, int runs) {
+  double best = 1e30;
+  bytes out;
+  for (int i = 0; i < runs; ++i) {
+    unsigned long w, h;
+    const auto start = std::chrono::steady_clock::now();
+    decodePNG(out, w, h, png.data(), png.size());
+    const std::chrono::duration<double> time =
+        std::chrono::steady_clock::now() - start;
+    best = std::min(best, time.count());
+  }
+  return best;
+}
+
+void report(const std::string& name, size_t png_size, double pixels,
+            double seconds) {
+  std::printf("%-32s %9zu bytes %9.1f MB/s %9.2f Mpixels/s\n", name.c_str(),
+              png_size, png_size / seconds / 1e6, pixels / seconds / 1e6);
+}
+
+bool read_file(const std::string& path, bytes& content) {
+  std::ifstream file(path, std::ios_base::binary);
+  content.assign(std::istreambuf_iterator<char>(file),
+                 std::istreambuf_iterator<char>());
+  return static_cast<bool>(file) || file.eof();
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  int runs = 3;
+  std::string corpus, image_dir = ".";
+  for (int i = 1; i < argc; ++i) {
+    const std::string arg = argv[i];
+    if (arg == "-r" && i + 1 < argc) {
+      runs = std::max(1, std::atoi(argv[++i]));
+    } else if (arg == "-w" && i + 1 < argc) {
+      corpus = argv[++i];
+    } else {
+      image_dir = arg;
+    }
+  }
+
+  struct format {
+    unsigned color_type, bit_depth;
+  };
+  const format formats[] = {{0, 1}, {0, 2}, {0, 4}, {0, 8}, {0, 16},
+                            {2, 8}, {2, 16}, {3, 1}, {3, 2}, {3, 4},
+                            {3, 8}, {4, 8}, {4, 16}, {6, 8}, {6, 16}};
+  struct size {
+    unsigned width, height;
+  };
+  const size sizes[] = {{32, 32}, {1, 1}, {13, 7}, {256, 256}};
+
+  std::vector<test_image> images;
+  for (const format& f : formats) {
+    for (unsigned interlace = 0; interlace < 2; ++interlace) {
+      for (size_t s = 0; s < 4; ++s) {
+        const compression mode = static_cast<compression>((s + interlace) % 3);
+        const bool transparent =
+            f.color_type != 4 && f.color_type != 6 && (s == 2 || interlace);
+        test_image image =
+            make_image(sizes[s].width, sizes[s].height, f.color_type,
+                       f.bit_depth, interlace, transparent, mode);
+        const int failed = failures;
+        check_image(image);
+        if (failures != failed) continue;
+        report(image.name, image.png.size(),
+               double(image.width) * image.height,
+               time_decode(image.png, runs));
+        if (!corpus.empty()) {
+          std::ofstream file(corpus + "/" + image.name + ".png",
+                             std::ios_base::binary);
+          file.write(reinterpret_cast<const char*>(image.png.data()),
+                     image.png.size());
+        }
+        images.push_back(std::move(image));
+      }
+    }
+  }
+  check_reuse(images);
+  check_truncated(images.front());
+  check_unfilter();
+  check_conversions();
+
+  // files of a real encoder, and the CRC32 of their pixels in RGBA
+  struct file_case {
+    const char* name;
+    unsigned long width, height;
+    unsigned pixels_crc;
+  };
+  const file_case files[] = {{"tank.png", 400, 260, 0xd204aaac},
+                             {"clouds.png", 3109, 1696, 0xcc69e4b8}};
+  for (const file_case& f : files) {
+    bytes png, out;
+    if (!read_file(image_dir + "/" + f.name, png) || png.empty()) {
+      fail(f.name, "can't read it from " + image_dir);
+      continue;
+    }
+    unsigned long w, h;
+    const int error = decodePNG(out, w, h, png.data(), png.size(), true, true);
+    const unsigned crc = crc32_of(out.data(), out.size());
+    if (error || w != f.width || h != f.height || crc != f.pixels_crc) {
+      char what[100];
+      std::snprintf(what, sizeof(what), "error %d, %lux%lu, pixels crc %08x",
+                    error, w, h, crc);
+      fail(f.name, what);
+      continue;
+    }
+    report(f.name, png.size(), double(w) * h, time_decode(png, runs));
+  }
+
+  if (failures != 0) {
+    std::printf("%d failures\n", failures);
+    return 1;
+  }
+  std::printf("all passed\n");
+  return 0;
+}
@@ -0,0 +1,187 @@
+#include "texture_cache.h"
+
+#include <sys/stat.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <utility>
+
+#ifdef _WIN32
+#include <direct.h>
+#endif
+
+namespace ns {
+
+namespace {
+
+const char entry_magic[4] = {'W', 'G', 'T', 'X'};
+// Bumped whenever the pixels made of an image change, by the decoder, its
+// options in the engine or the mip builder, which makes every entry stale.
+const uint32_t entry_version = 1;
+
+// The start of an entry, in native byte order since the cache never leaves
+// the machine. The pixels of the chain follow it.
+struct entry_header {
+  char magic[4];
+  uint32_t version;
+  uint64_t source_size;
+  int64_t source_mtime;
+  uint64_t source_hash;
+  uint32_t format;
+  uint32_t width;
+  uint32_t height;
+  uint32_t reserved;
+  uint64_t pixels_size;
+};
+
+// FNV-1a, 64 bits
+uint64_t hash_bytes(const unsigned char* data, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+}  // namespace
+
+texture_cache::texture_cache(std::string directory)
+    : directory(std::move(directory)) {
+#ifdef _WIN32
+  _mkdir(this->directory.c_str());
+#else
+  mkdir(this->directory.c_str(), 0755);
+#endif
+}
+
+std::string texture_cache::entry_path(const std::string& name,
+                                      pixel_format format) const {
+  const uint64_t hash = hash_bytes(
+      reinterpret_cast<const unsigned char*>(name.data()), name.size());
+  char file_name[32];
+  std::snprintf(file_name, sizeof(file_name), "%016llx.%d.tex",
+                static_cast<unsigned long long>(hash),
+                static_cast<int>(format));
+  return directory + '/' + file_name;
+}
+
+bool texture_cache::find(const std::string& name, const asset& source,
+                         pixel_format format, cached_texture& texture) const {
+  const std::string path = entry_path(name, format);
+  mapped_file file(path);
+  entry_header header;
+  if (file.size() < sizeof(header)) return false;
+  std::memcpy(&header, file.data(), sizeof(header));
+  if (std::memcmp(header.magic, entry_magic, sizeof(entry_magic)) != 0 ||
+      header.version != entry_version ||
+      header.format != static_cast<uint32_t>(format) || header.width == 0 ||
+      header.height == 0) {
+    return false;
+  }
+  std::vector<mip_chain::level> levels =
+      mip_levels(header.width, header.height, format);
+  const size_t pixels_size = levels.back().offset + pixel_size(format);
+  if (header.pixels_size != pixels_size ||
+      file.size() != sizeof(header) + pixels_size) {
+    return false;
+  }
+
+  if (header.source_size != source.size()) return false;
+  if (header.source_mtime != source.mtime()) {
+    // it was changed, or only touched, which the content tells
+    if (hash_bytes(source.data(), source.size()) != header.source_hash) {
+      return false;
+    }
+    // the same again, found without reading it the next time
+    header.source_mtime = source.mtime();
+    std::fstream entry(path, std::ios_base::in | std::ios_base::out |
+                                 std::ios_base::binary);
+    entry.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  }
+
+  texture.pixels = file.data() + sizeof(header);
+  texture.file = std::move(file);
+  texture.format = format;
+  texture.levels = std::move(levels);
+  return true;
+}
+
+bool texture_cache::store(const std::string& name, const asset& source,
+                          const mip_chain& chain) const {
+  if (chain.levels.empty()) return false;
+  cache_entry entry;
+  if (!begin(name, source, chain.format, chain.levels[0].width,
+             chain.levels[0].height, entry)) {
+    return false;
+  }
+  entry.write(0, chain.pixels.data(), chain.pixels.size());
+  return entry.commit();
+}
+
+bool texture_cache::begin(const std::string& name, const asset& source,
+                          pixel_format format, size_t width, size_t height,
+                          cache_entry& entry) const {
+  entry_header header;
+  std::memcpy(header.magic, entry_magic, sizeof(entry_magic));
+  header.version = entry_version;
+  header.source_size = source.size();
+  header.source_mtime = source.mtime();
+  header.source_hash = hash_bytes(source.data(), source.size());
+  header.format = static_cast<uint32_t>(format);
+  header.width = static_cast<uint32_t>(width);
+  header.height = static_cast<uint32_t>(height);
+  header.reserved = 0;
+  header.pixels_size =
+      mip_levels(width, height, format).back().offset + pixel_size(format);
+
+  // Written under another name first and then renamed, so that an entry is
+  // never seen half written, by this or another process.
+  static std::atomic<unsigned> writes(0);
+  entry.path = entry_path(name, format);
+  entry.temporary = entry.path + '.' + std::to_string(writes++) + ".tmp";
+  entry.header_size = sizeof(header);
+  entry.file.open(entry.temporary, std::ios_base::binary);
+  entry.file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  if (!entry.file) {
+    entry.file.close();
+    std::remove(entry.temporary.c_str());
+    entry.temporary.clear();
+    return false;
+  }
+  return true;
+}
+
+cache_entry::~cache_entry() {
+  if (temporary.empty()) return;
+  file.close();
+  std::remove(temporary.c_str());
+}
+
+void cache_entry::write(size_t offset, const unsigned char* data,
+                        size_t size) {
+  if (temporary.empty()) return;
+  file.seekp(static_cast<std::streamoff>(header_size + offset));
+  file.write(reinterpret_cast<const char*>(data), size);
+}
+
+bool cache_entry::commit() {
+  if (temporary.empty()) return false;
+  file.close();
+  const std::string written = std::move(temporary);
+  temporary.clear();
+  if (!file) {
+    std::remove(written.c_str());
+    return false;
+  }
+  std::remove(path.c_str());  // rename doesn't replace a file on Windows
+  if (std::rename(written.c_str(), path.c_str()) != 0) {
+    std::remove(written.c_str());
+    return false;
+  }
+  return true;
+}
+
+}  // namespace ns
@@ -0,0 +1,81 @@
+#pragma once
+#include <cstddef>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include "asset_pack.h"
+#include "mapped_file.h"
+#include "mipmap.h"
+
+namespace ns {
+
+// A mip chain found in the texture cache. Its pixels are those of the
+// mapped entry, laid out as in a mip_chain.
+struct cached_texture {
+  const unsigned char* data(size_t i) const {
+    return pixels + levels[i].offset;
+  }
+
+  mapped_file file;
+  pixel_format format = pixel_format::rgba8;
+  std::vector<mip_chain::level> levels;
+  const unsigned char* pixels = nullptr;  // into file
+};
+
+// An entry of the texture cache being written, in any order, as its chain
+// is built. It is only found once it is committed, and thrown away if it
+// isn't.
+class cache_entry {
+ public:
+  cache_entry() = default;
+  cache_entry(const cache_entry&) = delete;
+  cache_entry& operator=(const cache_entry&) = delete;
+  ~cache_entry();
+
+  // Writes size bytes of the pixels of the chain, offset bytes into them as
+  // a mip_chain lays them out.
+  void write(size_t offset, const unsigned char* data, size_t size);
+
+  // False if a write failed, and then there is no entry.
+  bool commit();
+
+ private:
+  friend class texture_cache;
+
+  std::ofstream file;
+  std::string path;
+  std::string temporary;  // where it is written, empty when there is none
+  size_t header_size = 0;
+};
+
+// A directory of the mip chains of decoded images, one file per image and
+// texture format. An entry remembers the size and content hash of the asset
+// it was made from and the modification time of its file. It is used as
+// long as the size and time are the same, or the content is, when only the
+// time has changed. Any other entry is stale and is written again.
+class texture_cache {
+ public:
+  explicit texture_cache(std::string directory);
+
+  // Maps the entry of the asset called name in this format, false if there
+  // is none that is up to date with source, its bytes.
+  bool find(const std::string& name, const asset& source, pixel_format format,
+            cached_texture& texture) const;
+
+  // Writes the chain made of the asset called name into its entry.
+  bool store(const std::string& name, const asset& source,
+             const mip_chain& chain) const;
+
+  // Starts the entry of the asset called name for a chain of width x height
+  // pixels in this format, to be written by entry, false if it can't be.
+  bool begin(const std::string& name, const asset& source, pixel_format format,
+             size_t width, size_t height, cache_entry& entry) const;
+
+ private:
+  std::string entry_path(const std::string& name, pixel_format format) const;
+
+  std::string directory;
+};
+
+}  // namespace ns